@@ -17,6 +17,7 @@
 /* --- Includes --- */
 #include <string.h>
 #include <syscall.h>
+#include <syscall_int.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -122,15 +123,30 @@ main(int argc, char *argv[])
 
     while((cmd_argv[j++] = strtok(NULL, separators)));
 
-    pid = fork();
+#ifdef SPAWN_INT
+    /* Launch without copying the shell. If it fails, fall back to the
+     * classic way, so a bad command still reports its exit status */
+    pid = spawn(cmd_argv[0], cmd_argv, -1);
     if(pid < 0) {
-      print(sizeof(forkerrmsg), forkerrmsg);
-      continue;
+      pid = vfork();
+      if(pid == 0) {
+        /* Borrowing our memory: only exec or vanish */
+        exec(cmd_argv[0], cmd_argv);
+        set_status(-1);
+        vanish();
+      }
     }
+#else
+    pid = fork();
     if(pid == 0) {
       exec(cmd_argv[0], cmd_argv);
       exit(-1);
     }
+#endif
+    if(pid < 0) {
+      print(sizeof(forkerrmsg), forkerrmsg);
+      continue;
+    }
     else {
       if((ret = wait(&res)) < 0) {
         printf("\nshell: wait on process %d failed!\n", pid);
@@ -83,7 +83,8 @@ UPDATE_METHOD = afs
 # directory.
 #
 STUDENTTESTS = agility_drill cyclone join_specific_test rwlock_downgrade_read_test switzerland thr_exit_join
-STUDENTTESTS += misbehave racer
+STUDENTTESTS += misbehave racer tid_lookup_bench large_pages_test
+STUDENTTESTS += syscall_bench spawn_test new_pages_hole_test
 
 ###########################################################################
 # Data files provided by course staff to build into the RAM disk
@@ -134,11 +135,12 @@ AUTOSTACK_OBJS = autostack.o
 #
 # Kernel object files you provide in from kern/
 #
-KERNEL_OBJS = kernel.o loader.o malloc_wrappers.o cpu.o
+KERNEL_OBJS = kernel.o loader.o image_cache.o malloc_wrappers.o slab.o cpu.o
 KERNEL_OBJS += driver.o graphic_driver.o int_handler.o keyboard_driver.o timer_driver.o
-KERNEL_OBJS += vm.o pm.o zeus.o mode_switch.o process.o
+KERNEL_OBJS += vm.o pm.o cow.o region.o zeus.o mode_switch.o process.o
 KERNEL_OBJS += syscall.o syscall_handler.o syscall_lifecycle.o syscall_memory.o
 KERNEL_OBJS += scheduler.o context_switch.o context_switch_c.o scheduler.o vm_asm.o
+KERNEL_OBJS += sched_mlfq.o
 KERNEL_OBJS += source_untrusted.o
 KERNEL_OBJS += kmutex.o
 KERNEL_OBJS += keyboard_event.o syscall_consoleio.o syscall_fileio.o
@@ -149,7 +151,8 @@ KERNEL_OBJS += timeout.o syscall_debug.o
 KERNEL_OBJS += kernel_stack_protection.o
 KERNEL_OBJS += hv.o hvseg.o hvlife.o
 KERNEL_OBJS += hv_hpcall_s.o hv_hpcall.o hv_hpcall_misc.o hv_hpcall_consoleio.o
-KERNEL_OBJS += hvinterrupt.o hvinterrupt_pushevent.o hv_hpcall_int.o
+KERNEL_OBJS += hvinterrupt.o hvinterrupt_pushevent.o hvinterrupt_ring.o
+KERNEL_OBJS += hv_hpcall_int.o
 KERNEL_OBJS += virtual_console.o hv_hpcall_vm.o
 
 ###########################################################################
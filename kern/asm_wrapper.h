@@ -14,4 +14,10 @@ int get_ss();
 // Get current %esp
 int get_esp();
 
+// Enable interrupts and halt until the next interrupt comes, atomically
+void enable_interrupts_and_halt();
+
+// Write value to model specific register msr (higher 32 bits are zero)
+void set_msr(unsigned int msr, unsigned int value);
+
 #endif
@@ -20,16 +20,18 @@
 #include "vm.h"
 #include "bool.h"
 #include "context_switch.h"
+#include "syscall.h"
 #include "dbgconf.h"
 
 // Switch to the process pointed by parameter, it will do several things:
 // It's not a public function
 // - Change the local CPU settings
-// - Activate the page directory of that process
+// - Activate the page directory pd of that process
 // NOTE: must be protected under LocalLock.
-static void switchToProcess(pcb* process) {
-  activatePageDirectory(process->pd);
+static void switchToProcess(pcb* process, PageDirectory pd) {
+  activatePageDirectory(pd);
   getLocalCPU()->runningPID = process->id;
+  getLocalCPU()->runningProcess = process;
 }
 
 // Swtich to the thread pointed by parameter, also switch the process if needed
@@ -54,8 +56,12 @@ void swtichToThread(tcb* thread) {
 
 void swtichToThread_Prelocked(tcb* thread) {
   cpu* core = getLocalCPU();
+  PageDirectory pd = THREAD_PD(thread);
   if (thread->process->id != core->runningPID) {
-    switchToProcess(thread->process);
+    switchToProcess(thread->process, pd);
+  } else if (getActivePageDirectory() != pd) {
+    // vCPUs of a hypervisor run on their own page directories
+    activatePageDirectory(pd);
   }
 
   #ifdef VERBOSE_PRINT
@@ -63,22 +69,19 @@ void swtichToThread_Prelocked(tcb* thread) {
       thread->kernelStackPage, thread->kernelStackPage + PAGE_SIZE - 1);
   #endif
   set_esp0(thread->kernelStackPage + PAGE_SIZE - 1);
+  setFastSyscallStack(thread->kernelStackPage + PAGE_SIZE - 1);
 
   ureg_t dummyUReg;
   ureg_t* currentUReg = &dummyUReg;
-  tcb* cThread = NULL;
-  if (core->runningTID != -1) {
-    cThread = findTCB(core->runningTID);
-    if (!cThread) {
-      panic("swtichToThread: fail to find the thread with id = %d",
-            core->runningTID);
-    }
+  tcb* cThread = core->runningThread;
+  if (cThread) {
     currentUReg = &cThread->regs;
     __sync_bool_compare_and_swap(
         &cThread->status, THREAD_RUNNING, THREAD_RUNNABLE);
     cThread->descheduling = false;
   }
   core->runningTID = thread->id;
+  core->runningThread = thread;
   thread->status = THREAD_RUNNING;
   tcb* switchedFrom =
       (tcb*)switchTheWorld(currentUReg, &thread->regs, (int)cThread);
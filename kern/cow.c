@@ -0,0 +1,84 @@
+/** @file cow.c
+ *
+ *  @brief Copy-on-write utilities for user memory
+ *
+ *  A shared frame is referred by several page directories, and pm.c keeps the
+ *  reference count for it. The last one to break copy-on-write on the frame
+ *  will find it unshared, and just take it over without copying.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdio.h>
+#include <simics.h>
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "common_kern.h"
+#include "cpu.h"
+#include "pm.h"
+#include "vm.h"
+#include "bool.h"
+#include "cow.h"
+
+static uint32_t markUserspaceCOW_EachPage(int pdIndex, int ptIndex,
+    PTE* ptentry, uint32_t _) {
+  if (PE_IS_WRITABLE(*ptentry)) {
+    *ptentry = (*ptentry & ~PE_WRITABLE(1)) | PE_COW(1);
+  }
+  return 0;
+}
+
+static uint32_t markUserspaceCOW_EachRange(uint32_t startPDIndex,
+    uint32_t endPDIndex, uint32_t pd) {
+  splitLargePageDirectory((PageDirectory)pd, startPDIndex, endPDIndex);
+  traverseEntryPageDirectory((PageDirectory)pd,
+                             startPDIndex,
+                             endPDIndex,
+                             markUserspaceCOW_EachPage,
+                             0);
+  return pd;
+}
+
+void markUserspaceCOW(PageDirectory pd, region* regions) {
+  assert(pd == getActivePageDirectory());
+  traverseRegionPDRange(regions, markUserspaceCOW_EachRange, (uint32_t)pd);
+  // Reload the page directory to flush all stale writable TLB entries
+  activatePageDirectory(pd);
+}
+
+bool breakCOWPage(PTE* pte, uint32_t vaddr) {
+  uint32_t pageAddr = PE_DECODE_ADDR(vaddr);
+  uint32_t oldPage = PE_DECODE_ADDR(*pte);
+  assert(!isZFOD(oldPage));
+
+  PTE privileges = PE_IS_COW(*pte) ? PE_WRITABLE(1) : 0;
+  if (!isUserMemPageShared(oldPage)) {
+    // We are the last one referring it, just take it
+    *pte = (*pte & ~PE_COW(1)) | privileges;
+    invalidateTLB(pageAddr);
+    return true;
+  }
+
+  uint32_t newPage = getUserMemPage();
+  if (!newPage) {
+    return false;
+  }
+
+  // Copy frame to frame, so the old mapping stays usable until it's replaced
+  LocalLockR();
+  void* src = kmap(KMAP_SRC, oldPage);
+  void* dst = kmap(KMAP_DST, newPage);
+  memcpy(dst, src, PAGE_SIZE);
+  kunmap(KMAP_DST);
+  kunmap(KMAP_SRC);
+  LocalUnlockR();
+  *pte = (PTE_CLEAR_ADDR(*pte) & ~PE_COW(1)) | privileges | newPage;
+  invalidateTLB(pageAddr);
+
+  // Drop our reference to the shared one
+  freeUserMemPage(oldPage);
+  return true;
+}
@@ -0,0 +1,36 @@
+/** @file cow.h
+ *
+ *  @brief Copy-on-write utilities for user memory
+ *
+ *  fork() shares every user frame between parent and child. Writable pages
+ *  are turned readonly and marked PE_COW, so that the first write to them
+ *  faults and gets a private copy (see COWBreaker in fault.c).
+ *
+ *  @author Leiyu Zhao
+ */
+
+#ifndef COW_H
+#define COW_H
+
+#include <stdint.h>
+
+#include "bool.h"
+#include "vm.h"
+#include "region.h"
+
+// Turn every writable user page of pd into a readonly copy-on-write page. Only
+// page tables of the regions are visited.
+// Large pages are split into 4k pages first, so that frames are shared one by
+// one. pd must be the active page directory, and TLB is flushed when done.
+// Must be protected under the process memlock
+void markUserspaceCOW(PageDirectory pd, region* regions);
+
+// Given the PTE of vaddr in the active page directory, make its frame private
+// to the current page directory: copy it to a new frame if the frame is shared,
+// and lift the write privilege if it's a copy-on-write page.
+// Return false if there's no user memory to make the copy, and the PTE is
+// left untouched.
+// Must be protected under the process memlock
+bool breakCOWPage(PTE* pte, uint32_t vaddr);
+
+#endif
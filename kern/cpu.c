@@ -20,6 +20,7 @@
 #include "cpu.h"
 #include "bool.h"
 #include "dbgconf.h"
+#include "asm_wrapper.h"
 
 static cpu UniCore;
 
@@ -28,6 +29,8 @@ void initCPU() {
   UniCore.interruptSwitch = false;
   UniCore.runningTID = -1;
   UniCore.runningPID = -1;
+  UniCore.runningThread = NULL;
+  UniCore.runningProcess = NULL;
   UniCore.currentMutexLayer = -1;
   lprintf("CPU env initiated, count = 1");
   // Corresponding to the LockLockR() at handler_install();
@@ -72,6 +75,15 @@ void LocalUnlockR() {
   }
 }
 
+void LocalUnlockAndHaltR() {
+  assert(!getLocalCPU()->interruptSwitch);
+  getLocalCPU()->currentMutexLayer--;
+  if (getLocalCPU()->currentMutexLayer < 0) {
+    getLocalCPU()->interruptSwitch = true;
+    enable_interrupts_and_halt();
+  }
+}
+
 void initCrossCPULock(CrossCPULock* lock) {
   lock->holderCPU = -1;
   lock->currentMutexLayer = -1;
@@ -28,12 +28,20 @@
 
 #include "bool.h"
 
+// Number of CPUs supported. Per-CPU data kept outside the module should be
+// sized by it and indexed by cpu.id
+#define CPU_COUNT 1
+
 // CPU record, id, runningPID and runningTID make sense to the outsiders
+// runningThread and runningProcess cache the control blocks for them, use
+// getRunningThread() / getRunningProcess() (see process.h) to get them
 typedef struct {
   int id;
   bool interruptSwitch;
   int runningTID;
   int runningPID;
+  struct _tcb* runningThread;
+  struct _pcb* runningProcess;
 
   int currentMutexLayer;
 } cpu;
@@ -61,6 +69,9 @@ void EnableInterrupts();
 // re-entrant local lock api
 void LocalLockR();
 void LocalUnlockR();
+// The same as LocalUnlockR, but if it's the outermost layer, halt the CPU
+// until next interrupt comes. No interrupt is missed between unlock and halt.
+void LocalUnlockAndHaltR();
 
 // re-entrant global lock api, and the lock object
 void initCrossCPULock(CrossCPULock* lock);
@@ -24,6 +24,7 @@
 #include <x86/cr.h>
 #include <x86/idt.h>
 #include <x86/seg.h>
+#include <x86/eflags.h>
 
 #include "common_kern.h"
 #include "pm.h"
@@ -39,6 +40,8 @@
 #include "console.h"
 #include "fault.h"
 #include "hv.h"
+#include "cow.h"
+#include "syscall.h"
 
 DECLARE_FAULT_ENTRANCE(IDT_DE);  // SWEXN_CAUSE_DIVIDE
 DECLARE_FAULT_ENTRANCE(IDT_DB);  // SWEXN_CAUSE_DEBUG
@@ -110,14 +113,18 @@ FAULT_ACTION(printError) {
   return false;
 }
 
-// This handler is used for upgrade an readonly ZFOD block to RW All zero block
+// Bit of page fault error code, set if the access is a write
+#define PF_ERRCODE_WRITE 0x2
+
+// This handler is used for upgrade an readonly ZFOD block to RW All zero block.
+// It also populates pages of lazily populated regions on their first touch
 FAULT_ACTION(ZFODUpgrader) {
   if ((uint32_t)cr2 < USER_MEM_START) {
     // Easy, access kernel memory, not ZFOD'd
     return false;
   }
 
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   if (!currentThread) {
     return false; // non-running thread then pass on
   }
@@ -131,10 +138,26 @@ FAULT_ACTION(ZFODUpgrader) {
   PTE* pteEntry = searchPTEntryPageDirectory(currentThread->process->pd,
       PE_DECODE_ADDR(cr2));
   if (!pteEntry) {
-    // This is a out-of-address access, not ZFOD
-    kmutexWUnlockForce(&currentThread->process->memlock,
-        &currentThread->memLockStatus, oldMemLockStatus);
-    return false;
+    region* reg = findRegion(currentThread->process->memMeta.regions, cr2);
+    if (!reg || reg->reserved == 0) {
+      // This is a out-of-address access, not ZFOD
+      kmutexWUnlockForce(&currentThread->process->memlock,
+          &currentThread->memLockStatus, oldMemLockStatus);
+      return false;
+    }
+    // First touch of a lazily populated region, hand one of its reservations
+    // to the page
+    createMapPageDirectory(currentThread->process->pd, PE_DECODE_ADDR(cr2),
+        reg->zfod, true, false);
+    reg->reserved--;
+    pteEntry = searchPTEntryPageDirectory(currentThread->process->pd,
+        PE_DECODE_ADDR(cr2));
+    if (!(errCode & PF_ERRCODE_WRITE)) {
+      // Reading zero is good enough, no need for a real page
+      kmutexWUnlockForce(&currentThread->process->memlock,
+          &currentThread->memLockStatus, oldMemLockStatus);
+      return true;
+    }
   }
   if (!isZFOD(PE_DECODE_ADDR(*pteEntry))) {
     if (PE_IS_WRITABLE(*pteEntry)) {
@@ -150,10 +173,61 @@ FAULT_ACTION(ZFODUpgrader) {
     return false;
   }
   // Handle ZFOD!
-  uint32_t newPage = upgradeUserMemPageZFOD(PE_DECODE_ADDR(*pteEntry));
+  bool zeroed;
+  uint32_t newPage =
+      upgradeUserMemPageZFOD(PE_DECODE_ADDR(*pteEntry), &zeroed);
   *pteEntry = PTE_CLEAR_ADDR(*pteEntry) | PE_WRITABLE(1) | newPage;
   invalidateTLB(cr2);
-  memset((void*)PE_DECODE_ADDR(cr2), 0, PAGE_SIZE);
+  if (!zeroed) memset((void*)PE_DECODE_ADDR(cr2), 0, PAGE_SIZE);
+
+  kmutexWUnlockForce(&currentThread->process->memlock,
+      &currentThread->memLockStatus, oldMemLockStatus);
+
+  // Good! Retry and everything should be fine!
+  return true;
+}
+
+// This handler is used to give a private copy of a copy-on-write page to the
+// writer. The page gets writable when it's no longer shared
+FAULT_ACTION(COWBreaker) {
+  if ((uint32_t)cr2 < USER_MEM_START) {
+    // Easy, access kernel memory, not COW'd
+    return false;
+  }
+
+  tcb* currentThread = getRunningThread();
+  if (!currentThread) {
+    return false; // non-running thread then pass on
+  }
+
+  // The same as ZFODUpgrader, recursively and adaptively get the lock
+  kmutexStatus oldMemLockStatus;
+  kmutexWLockForce(&currentThread->process->memlock,
+      &currentThread->memLockStatus, &oldMemLockStatus);
+
+  PTE* pteEntry = searchPTEntryPageDirectory(currentThread->process->pd,
+      PE_DECODE_ADDR(cr2));
+  if (!pteEntry) {
+    // This is a out-of-address access, not COW
+    kmutexWUnlockForce(&currentThread->process->memlock,
+        &currentThread->memLockStatus, oldMemLockStatus);
+    return false;
+  }
+  if (!PE_IS_COW(*pteEntry)) {
+    bool retry = PE_IS_WRITABLE(*pteEntry);
+    // Either it's fixed by others (retry), or it's a real readonly page
+    kmutexWUnlockForce(&currentThread->process->memlock,
+        &currentThread->memLockStatus, oldMemLockStatus);
+    return retry;
+  }
+  // Handle COW!
+  if (!breakCOWPage(pteEntry, cr2)) {
+    // No memory for the private copy, let others handle the fault
+    lprintf("Fail to break copy-on-write, no enough user space");
+    kmutexWUnlockForce(&currentThread->process->memlock,
+        &currentThread->memLockStatus, oldMemLockStatus);
+    return false;
+  }
 
   kmutexWUnlockForce(&currentThread->process->memlock,
       &currentThread->memLockStatus, oldMemLockStatus);
@@ -164,7 +238,7 @@ FAULT_ACTION(ZFODUpgrader) {
 
 // This handler is used to deligate the fault to user-fault handler
 FAULT_ACTION(UserModeErrorSWE) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   assert(currentThread);
 
   ureg_t uregs;
@@ -193,7 +267,7 @@ FAULT_ACTION(UserModeErrorSWE) {
 // angry
 FAULT_ACTION(UserModeErrorCrash) {
   // Crash! It's equal to vanish
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   lprintf("Thread #%d of process #%d aborts for exception.\n",
       getLocalCPU()->runningTID, getLocalCPU()->runningPID);
   // one way trip
@@ -222,8 +296,18 @@ void unifiedErrorHandler(int es, int ds, int edi, int esi, int ebp,
   int trueSS = cs != SEGSEL_KERNEL_CS ? ss : get_ss();
   int cr2 = get_cr2();
 
+  // SYSENTER doesn't clear TF as an interrupt gate does, so a user program
+  // single stepping into it traps on the first instruction of the kernel
+  // entry. Drop TF from the frame iret goes back with, and carry on
+  if (faultNumber == IDT_DB && cs == SEGSEL_KERNEL_CS &&
+      eip == (int)fastSyscall_Handler) {
+    *(volatile int*)&eflags &= ~EFL_TF;
+    return;
+  }
+
   // when it's something out of guest, give it
   // HyperFaultHandler should never return true!!
+  ON(cs == SEGSEL_GUEST_CS && faultNumber == IDT_PF, HyperPTWriteHandler);
   ON(cs == SEGSEL_GUEST_CS, HyperFaultHandler);
   assert(cs != SEGSEL_GUEST_CS);
 
@@ -233,6 +317,7 @@ void unifiedErrorHandler(int es, int ds, int edi, int esi, int ebp,
 
   // Area for OS tricks that's hidden from anyone else
   ON(faultNumber == IDT_PF, ZFODUpgrader);
+  ON(faultNumber == IDT_PF, COWBreaker);
 
   // General info for debugger
   ON(true, printError);
@@ -22,6 +22,13 @@ void initHypervisor();
 // asynchonously in timer callback
 void hv_CallMeOnTick(HyperInfo* info);
 
+// A fault.c-compatible fault handler.
+// Page faults of guest writing its own write protected page tables (see
+// hv_hpcall_vm.c) are handled here, without the guest knowing
+bool HyperPTWriteHandler(int es, int ds, int edi, int esi, int ebp,
+    int ebx, int edx, int ecx, int eax, int faultNumber, int errCode,
+    int eip, int cs, int eflags, int esp, int ss, int cr2);
+
 // A fault.c-compatible fault handler.
 // When the fault is generated by hypervisor, pass it to this.
 // This handler never returns
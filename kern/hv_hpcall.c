@@ -31,6 +31,7 @@
 #include "source_untrusted.h"
 #include "hv_hpcall_internal.h"
 #include "zeus.h"
+#include "sysconf.h"
 
 void initHyperCall() {
   int32_t* idtBase = (int32_t*)idt_base();
@@ -44,6 +45,9 @@ void initHyperCall() {
 extern bool applyInt(HyperInfo* info, hvInt hvi,
     uint32_t oldESP, uint32_t oldEFLAGS, uint32_t oldEIP,
     int oedi, int oesi, int oebp, int oebx, int oedx, int oecx, int oeax);
+extern void applyDelayedInt(HyperInfo* info,
+    uint32_t oldESP, uint32_t oldEFLAGS, uint32_t oldEIP,
+    int oedi, int oesi, int oebp, int oebx, int oedx, int oecx, int oeax);
 
 // The dispatcher
 int hyperCallHandler_Internal(int userEsp, int eax,
@@ -56,15 +60,17 @@ int hyperCallHandler_Internal(int userEsp, int eax,
     const int eflags, const int esp,  // from-user-mode only
     const int ss  // from-user-mode only
     ) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   if (!currentThread->process->hyperInfo.isHyper) {
     // Not a hypervisor. Cannot issue hyper call
     return -1;
   }
   assert(es == SEGSEL_GUEST_DS);
   assert(cs == SEGSEL_GUEST_CS);
+  // Some other vCPU has ended the guest
+  followHyperExit(&currentThread->process->hyperInfo, currentThread);
 
-  if (!currentThread->process->hyperInfo.inKernelMode) {
+  if (!currentThread->vcpu->inKernelMode) {
     // Guest-user cannot make hupercall. Convert it to a GP and give it to
     // guest kernel
     hvInt hvi;
@@ -87,9 +93,22 @@ int hyperCallHandler_Internal(int userEsp, int eax,
   HPC_ON(HV_PRINT_AT_OP, hpc_print_at);
 
   HPC_ON(HV_DISABLE_OP, hpc_disable_interrupts);
+#ifdef HV_BATCHED_INT_DELIVERY
+  if (eax == HV_ENABLE_OP) {
+    hpc_enable_interrupts(userEsp, currentThread);
+    // Deliver a pending delayed int on the way back, as if it comes right
+    // after the hypercall returns 0. It doesn't return if there is one
+    applyDelayedInt(&currentThread->process->hyperInfo,
+                    esp, eflags, eip, _edi, _esi, _ebp, _ebx, _edx, _ecx, 0);
+    return 0;
+  }
+#endif
   HPC_ON(HV_ENABLE_OP, hpc_enable_interrupts);
   HPC_ON(HV_SETIDT_OP, hpc_setidt);
   HPC_ON_X(HV_IRET_OP, hpc_iret);
+  HPC_ON(HV_EVENT_RING_OP, hpc_event_ring);
+  HPC_ON(HV_ROUTE_INT_OP, hpc_route_int);
+  HPC_ON(HV_START_VCPU_OP, hpc_start_vcpu);
 
   HPC_ON(HV_SETPD_OP, hpc_setpd);
   HPC_ON(HV_ADJUSTPG_OP, hpc_adjustpg);
@@ -28,15 +28,42 @@
 #include "hvinterrupt.h"
 #include "zeus.h"
 #include "hvvm.h"
+#include "sysconf.h"
 
+// In hvinterrupt.c
+extern void applyDelayedInt(HyperInfo* info,
+    uint32_t oldESP, uint32_t oldEFLAGS, uint32_t oldEIP,
+    int oedi, int oesi, int oebp, int oebx, int oedx, int oecx, int oeax);
 
 int hpc_disable_interrupts(int userEsp, tcb* thr) {
-  thr->process->hyperInfo.interrupt = false;
+  thr->vcpu->interrupt = false;
   return 0;
 }
 
 int hpc_enable_interrupts(int userEsp, tcb* thr) {
-  thr->process->hyperInfo.interrupt = true;
+  thr->vcpu->interrupt = true;
+  return 0;
+}
+
+int hpc_event_ring(int userEsp, tcb* thr) {
+  DEFINE_PARAM(uint32_t, ring, 0);
+  if (!registerEventRing(&thr->process->hyperInfo, ring)) {
+    return -1;
+  }
+  return 0;
+}
+
+int hpc_route_int(int userEsp, tcb* thr) {
+  DEFINE_PARAM(int, irqno, 0);
+  DEFINE_PARAM(int, vcpu, 1);
+
+  if (irqno < 0 || irqno > MAX_SUPPORTED_VIRTUAL_INT) return -1;
+  if (vcpu != HV_VCPU_ALL && (vcpu < 0 || vcpu >= HV_MAX_VCPUS)) return -1;
+
+  HyperInfo* info = &thr->process->hyperInfo;
+  GlobalLockR(&info->latch);
+  info->route[irqno] = vcpu;
+  GlobalUnlockR(&info->latch);
   return 0;
 }
 
@@ -52,15 +79,16 @@ int hpc_setidt(int userEsp, tcb* thr) {
   }
 
   HyperInfo* info = &thr->process->hyperInfo;
+  hvVCPU* vcpu = thr->vcpu;
   GlobalLockR(&info->latch);
   if (eip == 0) {
     // Uninstall
-    info->idt[irqno].present = false;
+    vcpu->idt[irqno].present = false;
   } else {
     // Install
-    info->idt[irqno].present = true;
-    info->idt[irqno].eip = eip;
-    info->idt[irqno].privileged = privileged;
+    vcpu->idt[irqno].present = true;
+    vcpu->idt[irqno].eip = eip;
+    vcpu->idt[irqno].privileged = privileged;
   }
 
   GlobalUnlockR(&info->latch);
@@ -76,12 +104,13 @@ int hpc_iret(int userEsp, tcb* thr,
   DEFINE_PARAM(uint32_t, eax, 4);
 
   HyperInfo* info = &thr->process->hyperInfo;
+  hvVCPU* vcpu = thr->vcpu;
 
   // Manually apply IF flag
   if (eflags & EFL_IF) {
-    info->interrupt = true;
+    vcpu->interrupt = true;
   } else {
-    info->interrupt = false;
+    vcpu->interrupt = false;
   }
   eflags |= EFL_IF;
   if (!validateEFLAGS(eflags)) {
@@ -92,22 +121,28 @@ int hpc_iret(int userEsp, tcb* thr,
 
   if (esp0 != 0) {
     // Switch to guest ring3!!
-    info->inKernelMode = false;
-    if (!info->originalPD) {
+    vcpu->inKernelMode = false;
+    if (!vcpu->originalPD) {
       // Oh... how can you get into user mode without turning on paging !?
       lprintf("Hypervisor crashes: Try to switch to user mode with "
               "paging off");
       exitHyperWithStatus(info, thr, GUEST_CRASH_STATUS);
     }
-    reActivateOriginalPD(thr);
     // Recompile PD to shadow kernel only memories
     if (!swtichGuestPD(thr)) {
       lprintf("Hypervisor crashes: fail to recompile user page table");
       exitHyperWithStatus(info, thr, GUEST_CRASH_STATUS);
     }
-    info->esp0 = esp0;
+    vcpu->esp0 = esp0;
   }
 
+#ifdef HV_BATCHED_INT_DELIVERY
+  // If guest returns with IF set, the next pending delayed int goes first, as
+  // if it comes right after iret. It doesn't return if there is one
+  applyDelayedInt(info, esp, eflags, eip,
+                  oedi, oesi, oebp, oebx, oedx, oecx, eax);
+#endif
+
   // One-way trip
   switchToRing3X(esp, eflags, eip, oedi, oesi, oebp, oebx, oedx, oecx, eax,
                  info->cs, info->ds);
@@ -18,6 +18,7 @@ void hyperCallHandler();
 
 int hpc_magic(int userEsp, tcb* thr);
 int hpc_exit(int userEsp, tcb* thr);
+int hpc_start_vcpu(int userEsp, tcb* thr);
 
 int hpc_print(int userEsp, tcb* thr);
 int hpc_cons_set_term_color(int userEsp, tcb* thr);
@@ -28,6 +29,8 @@ int hpc_print_at(int userEsp, tcb* thr);
 int hpc_disable_interrupts(int userEsp, tcb* thr);
 int hpc_enable_interrupts(int userEsp, tcb* thr);
 int hpc_setidt(int userEsp, tcb* thr);
+int hpc_event_ring(int userEsp, tcb* thr);
+int hpc_route_int(int userEsp, tcb* thr);
 int hpc_iret(int userEsp, tcb* thr,
     int oedi, int oesi, int oebp, int oebx, int oedx, int oecx, int oeax);
 
@@ -35,3 +35,10 @@ int hpc_exit(int userEsp, tcb* thr) {
   exitHyperWithStatus(&thr->process->hyperInfo, thr, status);
   return -1;
 }
+
+int hpc_start_vcpu(int userEsp, tcb* thr) {
+  DEFINE_PARAM(uint32_t, eip, 0);
+  DEFINE_PARAM(uint32_t, esp, 1);
+
+  return startVCPU(&thr->process->hyperInfo, thr, eip, esp);
+}
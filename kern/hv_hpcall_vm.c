@@ -2,28 +2,46 @@
  *
  *  @brief All about guest virtual memory and related hypercalls
  *
- *  In hyperInfo, there're several fields about guest virtual memory
+ *  In each vCPU, there're several fields about guest virtual memory
  *  (see hvlife.h). And they work in the following way:
  *
- *  When paging is off, hypervisor process keeps default direct mapping page
- *  directory (original page directory). And originalPD = null.
+ *  When paging is off, the vCPU keeps default direct mapping page directory
+ *  (original page directory). And originalPD = null.
  *
  *  As long as paging is turned on, the original mapping is shallow copied (
  *  copy page directory only, not page tables) to originalPD. originalPD is used
- *  in the following situation:
- *  - When we need to access the guest physical memory (e.g. access guest PD)
- *  - When we are about to exit, so that we must recover original page directory
- *    to let Reaper reclaim all user-pages (see reaper.c)
+ *  when we are about to exit, so that we must recover original page directory
+ *  to let Reaper reclaim all user-pages (see reaper.c)
  *
- *  We don't keep a copy of guest page table in kernel memory, instead, we
- *  recompile it everytime on 1. change cr3; 2. mode switch.
+ *  Guest page directory is compiled on 1. change cr3; 2. mode switch. A few
+ *  compiled page directories are cached per guest cr3 and mode, together with
+ *  the in-kernel copies of guest page directory and page tables they are
+ *  compiled from. Going back to originalPD drops the active one from cache.
+ *
+ *  A cached one is trusted while the guest physical pages it's compiled from
+ *  (guest page directory and page tables) are write protected: every host
+ *  mapping of them is made read-only, and the first guest write to one faults
+ *  into unprotectGuestWrite, which makes every shadow compiled from that page
+ *  untrusted and lets the write go. Switching to a trusted one just swaps it
+ *  into process pd and reloads cr3. An untrusted one is checked against guest
+ *  memory: guest page directory and page tables are copied, and only those
+ *  that differ from the copies are compiled again; then it's trusted again.
+ *  So no write to guest page tables is missed, even without adjustpg. Write
+ *  protection is per vCPU, so guests with more vCPUs always take the check.
+ *
+ *  Guest physical memory never moves, so a frame table (guest physical page to
+ *  host frame) is captured on boot. Guest page directory and page tables are
+ *  read by frame through kmap, and adjustpg just rewrites one host page table
+ *  entry and flushes it from TLB.
  *
  *  Except adjustpg, which just changes a one mapping, every large-scale mapping
  *  mutation (e.g. change cr3, mode switch, temporarily use originalPD) needs
  *  flush the whole TLB. To avoid any race with context switcher itself, we
  *  deligate it to context switch, i.e., achieving flushing TLB by forcing a
- *  context switch to other threads. Since for hypervisor there should only be
- *  one thread (in host kernel's view), there's no race at all.
+ *  context switch to other threads. Each vCPU is one host thread with its own
+ *  page directory (see hvlife.h), which is only changed by itself, and context
+ *  switch reloads cr3 whenever the page directory differs, so there's no race
+ *  at all, even with other vCPUs of the same guest.
  *
  *  @author Leiyu Zhao
  */
@@ -56,20 +74,27 @@
 // from page directory)
 // Otherwise it's a deep clear (free related page tables)
 static void clearCurrentPD(tcb* thr) {
-  HyperInfo* info = &thr->process->hyperInfo;
-  PageDirectory pd = thr->process->pd;
-  assert(info->originalPD != NULL);
+  hvVCPU* vcpu = thr->vcpu;
+  PageDirectory pd = vcpu->pd;
+  assert(vcpu->originalPD != NULL);
   for (int i = STRIP_PD_INDEX(USER_MEM_START); i <= STRIP_PD_INDEX(0xffffffff);
       i++) {
-    if (pd[i] != info->originalPD[i]) {
+    if (pd[i] != vcpu->originalPD[i]) {
       if (PE_IS_PRESENT(pd[i])) {
-        sfree(PDE2PT(pd[i]), sizeof(PTE) * PT_SIZE);
+        freePageTable(PDE2PT(pd[i]));
       }
     }
     pd[i] = EMPTY_PDE;
   }
 }
 
+// Whether guest physical page at guestPAddr is write protected, i.e. some
+// trusted shadow page directory is compiled from it
+static bool isGuestFrameTracked(hvVCPU* vcpu, uint32_t guestPAddr) {
+  return vcpu->ptFrameRefs && guestPAddr < HYPERVISOR_MEMORY &&
+         vcpu->ptFrameRefs[guestPAddr >> PAGE_SHIFT] > 0;
+}
+
 // The key function for establishing a mapping from guest virtual addr to guest
 // physical addr in host's page directory.
 // guestPAddr = 0xffffffff for remove
@@ -77,7 +102,8 @@ static void clearCurrentPD(tcb* thr) {
 static bool generatePDMapping(tcb* thr, bool isWritable, bool isUser,
     uint32_t guestVAddr, uint32_t guestPAddr, bool forceRefresh) {
   HyperInfo* info = &thr->process->hyperInfo;
-  PageDirectory pd = thr->process->pd;
+  hvVCPU* vcpu = thr->vcpu;
+  PageDirectory pd = vcpu->pd;
 
   // Validate guestVAddr and guestPAddr
   if (guestVAddr > GUEST_PHYSICAL_MAXVADDR) {
@@ -89,7 +115,7 @@ static bool generatePDMapping(tcb* thr, bool isWritable, bool isUser,
   uint32_t hostVAddr = guestVAddr + info->baseAddr;
   assert(hostVAddr >= USER_MEM_START);
   if (guestPAddr == 0xffffffff ||
-      (!isUser && !info->inKernelMode)) {
+      (!isUser && !vcpu->inKernelMode)) {
     // remove mapping
     PTE* currentPTE = searchPTEntryPageDirectory(pd, hostVAddr);
     if (!currentPTE) {
@@ -101,20 +127,27 @@ static bool generatePDMapping(tcb* thr, bool isWritable, bool isUser,
     // create mapping
 
     // 1. Find the host physical address of given guest physical address
-    PTE* directMapPTE = searchPTEntryPageDirectory(info->originalPD,
-        guestPAddr + info->baseAddr);
-    if (!directMapPTE) {
+    uint32_t frame = info->guestFrames[guestPAddr >> PAGE_SHIFT];
+    if (!frame) {
       // Not a valid guestPAddr
       return false;
     }
 
     // 2. Make the mapping in page directory
     // The page is writable if: 1. it's defined as writable; 2. guest is in
-    // ring0 and write protection is off.
+    // ring0 and write protection is off. Unless a trusted shadow page
+    // directory is compiled from it.
     bool shouldBeWritable =
-        isWritable || (info->inKernelMode && !info->writeProtection);
-    createMapPageDirectory(pd, hostVAddr, PE_DECODE_ADDR(*directMapPTE),
-        true, shouldBeWritable);
+        (isWritable || (vcpu->inKernelMode && !vcpu->writeProtection)) &&
+        !isGuestFrameTracked(vcpu, guestPAddr);
+    PTE* currentPTE = searchPTEntryPageDirectory(pd, hostVAddr);
+    if (currentPTE) {
+      *currentPTE = PE_PRESENT(1) | PE_WRITABLE(shouldBeWritable) |
+                    PE_USERMODE(1) | PE_WRITETHROUGH_CACHE(0) |
+                    PE_DISABLE_CACHE(0) | frame;
+    } else {
+      createMapPageDirectory(pd, hostVAddr, frame, true, shouldBeWritable);
+    }
   }
 
   if (forceRefresh) {
@@ -138,73 +171,236 @@ static bool generatePDMapping(tcb* thr, bool isWritable, bool isUser,
       ) == 0 \
     )
 
-// Recompile given guestPD to current page directory and activate it
-// Will discard the current mapping
-// We don't fear that interrupt may use guest memory: that only happens when
-// iret will directly going back.
+// Compile one guest page table (guestPDE, whose address is a kernel copy of
+// the page table) into current page directory. The host page directory entry
+// for it must be empty.
 // Failure may leave page directory (user part) in a total mess, so caller need
 // to follow standard crashing sequence (reActivate originalPD and vanish)
-// guestPD must be a kernel space guest PD
-static bool reCompileGuestPD(tcb* thr, PageDirectory guestPD) {
-  // clear current page table
-  clearCurrentPD(thr);
+static bool compileGuestPT(tcb* thr, int pdIndex, PDE guestPDE) {
+  if (!IS_VALID_GUEST_PE(guestPDE)) {
+    return false;
+  }
+  bool isUserRoot = PE_IS_USERMODE(guestPDE);
+  bool isWritableRoot = PE_IS_WRITABLE(guestPDE);
+  PageTable cpt = PDE2PT(guestPDE);
+  for (int j = 0; j < PT_SIZE; j++) {
+    if (!PE_IS_PRESENT(cpt[j])) continue;
+    bool isUser = isUserRoot && PE_IS_USERMODE(cpt[j]);
+    bool isWritable = isWritableRoot && PE_IS_WRITABLE(cpt[j]);
+    if (!IS_VALID_GUEST_PE(cpt[j])) {
+      return false;
+    }
+    if (!generatePDMapping(thr, isWritable, isUser,
+                           RECONSTRUCT_ADDR(pdIndex, j),
+                           PE_DECODE_ADDR(cpt[j]), false)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Remove the compiled mappings of guest page directory entry pdIndex from
+// current page directory
+static void clearGuestPT(tcb* thr, int pdIndex) {
+  HyperInfo* info = &thr->process->hyperInfo;
+  hvVCPU* vcpu = thr->vcpu;
+  PageDirectory pd = vcpu->pd;
+  uint32_t hostIndex = pdIndex + STRIP_PD_INDEX(info->baseAddr);
+  if (hostIndex >= PD_SIZE) return;
+  if (PE_IS_PRESENT(pd[hostIndex])) {
+    freePageTable(PDE2PT(pd[hostIndex]));
+  }
+  pd[hostIndex] = EMPTY_PDE;
+}
+
+// Add (delta = 1) or remove (delta = -1) one reference to the guest page
+// directory and page tables a shadow page directory is compiled from
+static void refShadowFrames(hvVCPU* vcpu, shadowPD* sh, int delta) {
+  for (int i = -1; i < PD_SIZE; i++) {
+    PDE guestPDE = i < 0 ? sh->vCR3 : sh->rawPD[i];
+    if (i >= 0 && !PE_IS_PRESENT(guestPDE)) continue;
+    uint16_t* ref = &vcpu->ptFrameRefs[PE_DECODE_ADDR(guestPDE) >> PAGE_SHIFT];
+    assert(delta > 0 || *ref > 0);
+    if (*ref == 0) {
+      // A newly protected page, which may still be writable in others
+      vcpu->protectGen++;
+    }
+    *ref += delta;
+  }
+}
+
+// Make a shadow page directory trusted, by write protecting what it's compiled
+// from. It must just be checked against guest memory
+static void trackShadow(hvVCPU* vcpu, shadowPD* sh) {
+  assert(vcpu->ptFrameRefs && sh->rawPD && !sh->trusted);
+  refShadowFrames(vcpu, sh, 1);
+  sh->trusted = true;
+}
+
+static void untrackShadow(hvVCPU* vcpu, shadowPD* sh) {
+  if (!sh->trusted) return;
+  refShadowFrames(vcpu, sh, -1);
+  sh->trusted = false;
+}
 
-  // compile
+// Whether the shadow page directory is compiled from guest physical page at
+// guestPAddr
+static bool shadowUsesFrame(shadowPD* sh, uint32_t guestPAddr) {
+  if (PE_DECODE_ADDR(sh->vCR3) == guestPAddr) return true;
   for (int i = 0; i < PD_SIZE; i++) {
-    if (!PE_IS_PRESENT(guestPD[i])) continue;
-    if (!IS_VALID_GUEST_PE(guestPD[i])) {
-      return false;
+    if (PE_IS_PRESENT(sh->rawPD[i]) &&
+        PE_DECODE_ADDR(sh->rawPD[i]) == guestPAddr) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Make every page in current page directory (compiled from sh, the active
+// one) that maps a write protected guest page read-only. Caller flushes TLB
+static void protectCompiledPD(tcb* thr, shadowPD* sh) {
+  HyperInfo* info = &thr->process->hyperInfo;
+  hvVCPU* vcpu = thr->vcpu;
+  PageDirectory pd = vcpu->pd;
+  uint32_t baseIndex = STRIP_PD_INDEX(info->baseAddr);
+  for (int i = 0; i + baseIndex < PD_SIZE; i++) {
+    if (!PE_IS_PRESENT(sh->guestPD[i]) ||
+        !PE_IS_PRESENT(pd[i + baseIndex])) {
+      continue;
     }
-    bool isUserRoot = PE_IS_USERMODE(guestPD[i]);
-    bool isWritableRoot = PE_IS_WRITABLE(guestPD[i]);
-    PageTable cpt = PDE2PT(guestPD[i]);
+    PageTable guestPT = PDE2PT(sh->guestPD[i]);
+    PageTable hostPT = PDE2PT(pd[i + baseIndex]);
     for (int j = 0; j < PT_SIZE; j++) {
-      if (!PE_IS_PRESENT(cpt[j])) continue;
-      bool isUser = isUserRoot && PE_IS_USERMODE(cpt[j]);
-      bool isWritable = isWritableRoot && PE_IS_WRITABLE(cpt[j]);
-      if (!IS_VALID_GUEST_PE(cpt[j])) {
-        return false;
+      if (PE_IS_PRESENT(guestPT[j]) && PE_IS_PRESENT(hostPT[j]) &&
+          isGuestFrameTracked(vcpu, PE_DECODE_ADDR(guestPT[j]))) {
+        hostPT[j] &= ~PE_WRITABLE(1);
       }
-      if (!generatePDMapping(thr, isWritable, isUser,
-                             RECONSTRUCT_ADDR(i, j), PE_DECODE_ADDR(cpt[j]),
-                             false)) {
-        return false;
+    }
+  }
+  sh->protectGen = vcpu->protectGen;
+}
+
+// Free everything kept by a cached shadow page directory that is not active,
+// and make it invalid
+static void evictShadow(hvVCPU* vcpu, shadowPD* sh) {
+  untrackShadow(vcpu, sh);
+  if (sh->shadow) {
+    for (int i = STRIP_PD_INDEX(USER_MEM_START);
+        i <= STRIP_PD_INDEX(0xffffffff); i++) {
+      if (PE_IS_PRESENT(sh->shadow[i])) {
+        freePageTable(PDE2PT(sh->shadow[i]));
       }
+      sh->shadow[i] = EMPTY_PDE;
     }
   }
+  if (sh->guestPD) {
+    freePageDirectory(sh->guestPD);
+    sh->guestPD = NULL;
+  }
+  if (sh->rawPD) {
+    freePageDirectoryOnly(sh->rawPD);
+    sh->rawPD = NULL;
+  }
+  sh->valid = false;
+}
 
-  // Force a context switch to ensure directory change and relavidation
-  // (Given the assumtion that a hypervisor only has one thread)
-  assert(yieldToNext());
-  return true;
+// Forget the active shadow page directory. Its compiled page tables stay in
+// current page directory, and are not owned by the cache any more
+static void dropActiveShadow(hvVCPU* vcpu) {
+  shadowPD* sh = vcpu->activeShadow;
+  if (!sh) return;
+  vcpu->activeShadow = NULL;
+  untrackShadow(vcpu, sh);
+  if (sh->guestPD) {
+    freePageDirectory(sh->guestPD);
+    sh->guestPD = NULL;
+  }
+  if (sh->rawPD) {
+    freePageDirectoryOnly(sh->rawPD);
+    sh->rawPD = NULL;
+  }
+  sh->valid = false;
+}
+
+// Take the user part of current page directory away (so it's empty). If it
+// belongs to the active shadow, it's kept by the shadow for later use
+static void parkCurrentPD(tcb* thr) {
+  hvVCPU* vcpu = thr->vcpu;
+  PageDirectory pd = vcpu->pd;
+  shadowPD* sh = vcpu->activeShadow;
+  if (!sh) {
+    clearCurrentPD(thr);
+    return;
+  }
+  for (int i = STRIP_PD_INDEX(USER_MEM_START); i <= STRIP_PD_INDEX(0xffffffff);
+      i++) {
+    sh->shadow[i] = pd[i];
+    pd[i] = EMPTY_PDE;
+  }
+  vcpu->activeShadow = NULL;
+}
+
+// Find the cached shadow page directory for current guest cr3 and mode, or
+// pick the least recently used one and make it empty for them
+static shadowPD* lookupShadow(hvVCPU* vcpu) {
+  shadowPD* victim = NULL;
+  for (int i = 0; i < HV_SHADOW_PD_CACHE_SIZE; i++) {
+    shadowPD* sh = &vcpu->shadows[i];
+    if (sh->valid && sh->vCR3 == vcpu->vCR3 &&
+        sh->inKernelMode == vcpu->inKernelMode &&
+        sh->writeProtection == vcpu->writeProtection) {
+      return sh;
+    }
+    if (!victim || !sh->valid ||
+        (victim->valid && sh->lastUse < victim->lastUse)) {
+      victim = sh;
+    }
+  }
+  evictShadow(vcpu, victim);
+  if (!victim->shadow) {
+    victim->shadow = newPageDirectory();
+  }
+  victim->vCR3 = vcpu->vCR3;
+  victim->inKernelMode = vcpu->inKernelMode;
+  victim->writeProtection = vcpu->writeProtection;
+  return victim;
 }
 
 // shallow - backing up the current pd to originalPD. This cannot be called more
 // than once: just do it when first turning on paging
 static void backupOriginalPD(tcb* thr) {
-  HyperInfo* info = &thr->process->hyperInfo;
-  PageDirectory pd = thr->process->pd;
-  assert(info->originalPD == NULL);
-  info->originalPD = newPageDirectory();
+  hvVCPU* vcpu = thr->vcpu;
+  PageDirectory pd = vcpu->pd;
+  assert(vcpu->originalPD == NULL);
+  vcpu->originalPD = newPageDirectory();
   for (int i = STRIP_PD_INDEX(USER_MEM_START); i <= STRIP_PD_INDEX(0xffffffff);
       i++) {
-    info->originalPD[i] = pd[i];
+    vcpu->originalPD[i] = pd[i];
+  }
+  // Without it, shadow page directories are never trusted
+  vcpu->ptFrameRefs = smalloc(sizeof(uint16_t) *
+      (HYPERVISOR_MEMORY / PAGE_SIZE));
+  if (vcpu->ptFrameRefs) {
+    memset(vcpu->ptFrameRefs, 0,
+        sizeof(uint16_t) * (HYPERVISOR_MEMORY / PAGE_SIZE));
   }
 }
 
 // Discard current guest page directory and activate original PD.
 // This is needed before crashing or want to accessing guest page directory
 void reActivateOriginalPD(tcb* thr) {
-  HyperInfo* info = &thr->process->hyperInfo;
-  PageDirectory pd = thr->process->pd;
+  hvVCPU* vcpu = thr->vcpu;
+  PageDirectory pd = vcpu->pd;
 
+  // The compiled page tables in pd are freed right below
+  dropActiveShadow(vcpu);
   clearCurrentPD(thr);
   for (int i = STRIP_PD_INDEX(USER_MEM_START); i <= STRIP_PD_INDEX(0xffffffff);
       i++) {
-    pd[i] = info->originalPD[i];
+    pd[i] = vcpu->originalPD[i];
   }
   // Force a context switch to ensure directory change and relavidation
-  // (Given the assumtion that a hypervisor only has one thread)
+  // (No one else runs on the page directory of this vCPU)
   assert(yieldToNext());
 }
 
@@ -212,136 +408,281 @@ void reActivateOriginalPD(tcb* thr) {
 // Hypercall is not allowed to turn off paging, so this only happens on
 // hypervisor exiting
 void exitPagingMode(tcb* thr) {
-  HyperInfo* info = &thr->process->hyperInfo;
-  if (info->originalPD) {
+  hvVCPU* vcpu = thr->vcpu;
+  if (vcpu->originalPD) {
     reActivateOriginalPD(thr);
-    sfree(info->originalPD, sizeof(PDE) * PD_SIZE);
+    for (int i = 0; i < HV_SHADOW_PD_CACHE_SIZE; i++) {
+      evictShadow(vcpu, &vcpu->shadows[i]);
+      if (vcpu->shadows[i].shadow) {
+        freePageDirectoryOnly(vcpu->shadows[i].shadow);
+        vcpu->shadows[i].shadow = NULL;
+      }
+    }
+    freePageDirectoryOnly(vcpu->originalPD);
+    if (vcpu->ptFrameRefs) {
+      sfree(vcpu->ptFrameRefs,
+          sizeof(uint16_t) * (HYPERVISOR_MEMORY / PAGE_SIZE));
+      vcpu->ptFrameRefs = NULL;
+    }
   }
 }
 
-// The wrapper of reCompileGuestPD, since reCompileGuestPD needs a in-memory
-// copy of guest page directory. This function make a temporary copy, call it,
-// and destroy the copy.
-// NOTE: this function will access guest physical memory, so caller must
-// recover originalPD before calling me
-bool swtichGuestPD(tcb* thr) {
-  HyperInfo* info = &thr->process->hyperInfo;
-  uint32_t pdbase = info->vCR3 + info->baseAddr;
+bool captureGuestFrames(HyperInfo* info, PageDirectory pd) {
+  int count = HYPERVISOR_MEMORY / PAGE_SIZE;
+  info->guestFrames = smalloc(sizeof(uint32_t) * count);
+  if (!info->guestFrames) return false;
+  for (int i = 0; i < count; i++) {
+    PTE* pte = searchPTEntryPageDirectory(pd,
+        info->baseAddr + i * PAGE_SIZE);
+    info->guestFrames[i] = pte ? PE_DECODE_ADDR(*pte) : 0;
+  }
+  return true;
+}
 
-  if (!IS_PAGE_ALIGNED(pdbase)) {
+void releaseGuestFrames(HyperInfo* info) {
+  if (!info->guestFrames) return;
+  sfree(info->guestFrames,
+      sizeof(uint32_t) * (HYPERVISOR_MEMORY / PAGE_SIZE));
+  info->guestFrames = NULL;
+}
+
+uint32_t guestFrameOf(HyperInfo* info, uint32_t guestPAddr) {
+  if (guestPAddr >= HYPERVISOR_MEMORY) return 0;
+  return info->guestFrames[guestPAddr >> PAGE_SHIFT];
+}
+
+// Copy len bytes of guest physical memory at guestPAddr to buf, through kmap,
+// so that it works on whatever page directory is active. The range must not
+// cross a page. Return false if it's not guest memory
+static bool copyGuestPhysical(HyperInfo* info, uint32_t guestPAddr,
+    void* buf, int len) {
+  assert((guestPAddr & (PAGE_SIZE - 1)) + len <= PAGE_SIZE);
+  uint32_t frame = guestFrameOf(info, guestPAddr);
+  if (!frame) {
     return false;
   }
+  LocalLockR();
+  char* src = kmap(KMAP_SRC, frame);
+  memcpy(buf, src + (guestPAddr & (PAGE_SIZE - 1)), len);
+  kunmap(KMAP_SRC);
+  LocalUnlockR();
+  return true;
+}
 
-  // Check the address validation for PD
-  if (!verifyUserSpaceAddr(
-      pdbase, pdbase + sizeof(PDE) * PD_SIZE - 1, false)) {
+// Copy one page of guest physical memory at guestPAddr (page aligned) to buf.
+// Return false if guestPAddr is not a page of guest physical memory
+static bool copyGuestPhysicalPage(HyperInfo* info, uint32_t guestPAddr,
+    void* buf) {
+  if (!IS_PAGE_ALIGNED(guestPAddr)) {
     return false;
   }
+  return copyGuestPhysical(info, guestPAddr, buf, PAGE_SIZE);
+}
 
-  PageDirectory guestPD = (PageDirectory)pdbase;
-  // Check the address validation for PT
-  for (int i = 0; i < PD_SIZE; i++) {
-    if (PE_IS_PRESENT(guestPD[i])) {
-      uint32_t pteAddrAfterDelta = PE_DECODE_ADDR(guestPD[i]) + info->baseAddr;
-      if (!verifyUserSpaceAddr(pteAddrAfterDelta,
-          pteAddrAfterDelta + sizeof(PTE) * PT_SIZE - 1, false)) {
-        return false;
-      }
+// Compile guest page directory at cr3 into current page directory, and
+// activate it. Compiled page directories are cached by guest cr3 and mode. A
+// trusted one is just swapped in; otherwise guest page directory and page
+// tables are copied (by frame, through kmap) and compared with the copies the
+// cached one is compiled from, so that only the changed ones are compiled.
+// On failure, caller need to follow standard crashing sequence
+// (reActivate originalPD and vanish)
+bool swtichGuestPD(tcb* thr) {
+  HyperInfo* info = &thr->process->hyperInfo;
+  hvVCPU* vcpu = thr->vcpu;
+  PageDirectory pd = vcpu->pd;
+  assert(vcpu->originalPD != NULL);
+  assert(IS_LARGE_PAGE_ALIGNED(info->baseAddr));
+
+  // Switch to the cached one (which may be empty)
+  parkCurrentPD(thr);
+  shadowPD* sh = lookupShadow(vcpu);
+  for (int i = STRIP_PD_INDEX(USER_MEM_START); i <= STRIP_PD_INDEX(0xffffffff);
+      i++) {
+    pd[i] = sh->shadow[i];
+    sh->shadow[i] = EMPTY_PDE;
+  }
+  vcpu->activeShadow = sh;
+  sh->lastUse = vcpu->shadowClock++;
+
+  if (sh->valid && sh->trusted && info->vcpuCount == 1) {
+    // Nothing it's compiled from has changed. Pages protected since it's
+    // parked may still be writable in it
+    vcpu->shadowHits++;
+    if (sh->protectGen != vcpu->protectGen) {
+      protectCompiledPD(thr, sh);
     }
+    LocalLockR();
+    activatePageDirectory(pd);
+    LocalUnlockR();
+    return true;
+  }
+  if (sh->valid) {
+    vcpu->shadowVerified++;
+  } else {
+    vcpu->shadowMisses++;
+  }
+  untrackShadow(vcpu, sh);
+
+  PageDirectory guestPD = newPageDirectory();
+  if (!copyGuestPhysicalPage(info, vcpu->vCR3, guestPD)) {
+    freePageDirectoryOnly(guestPD);
+    dropActiveShadow(vcpu);
+    return false;
   }
 
-  // Setup a temporary in-kernel page directory
+  // A temporary in-kernel copy of guest page directory, to be kept by the
+  // shadow for next time
   PageDirectory tPageDirectory = newPageDirectory();
-  for (int i = 0; i < PD_SIZE; i++) {
-    if (PE_IS_PRESENT(guestPD[i])) {
-      uint32_t pteAddrAfterDelta = PE_DECODE_ADDR(guestPD[i]) + info->baseAddr;
-      PageTable tPageTable = clonePageTable((PageTable)pteAddrAfterDelta);
-      tPageDirectory[i] =
-          PTE_CLEAR_ADDR(guestPD[i]) | PE_DECODE_ADDR((uint32_t)tPageTable);
+  bool succ = true;
+  for (int i = 0; i < PD_SIZE && succ; i++) {
+    PDE cachedPDE = sh->guestPD ? sh->guestPD[i] : EMPTY_PDE;
+    if (!PE_IS_PRESENT(guestPD[i])) {
+      if (PE_IS_PRESENT(cachedPDE)) clearGuestPT(thr, i);
+      continue;
+    }
+    PageTable tPageTable = newPageTable();
+    tPageDirectory[i] =
+        PTE_CLEAR_ADDR(guestPD[i]) | PE_DECODE_ADDR((uint32_t)tPageTable);
+    if (!copyGuestPhysicalPage(info, PE_DECODE_ADDR(guestPD[i]),
+        tPageTable)) {
+      succ = false;
+      break;
+    }
+    if (PE_IS_PRESENT(cachedPDE) &&
+        PTE_CLEAR_ADDR(cachedPDE) == PTE_CLEAR_ADDR(guestPD[i]) &&
+        memcmp(PDE2PT(cachedPDE), tPageTable, PAGE_SIZE) == 0) {
+      // Compiled one is still good
+      continue;
     }
+    vcpu->shadowPTCompiled++;
+    clearGuestPT(thr, i);
+    succ = compileGuestPT(thr, i, tPageDirectory[i]);
   }
 
-  bool succ = reCompileGuestPD(thr, tPageDirectory);
+  if (!succ) {
+    freePageDirectoryOnly(guestPD);
+    freePageDirectory(tPageDirectory);
+    dropActiveShadow(vcpu);
+    return false;
+  }
+  if (sh->guestPD) freePageDirectory(sh->guestPD);
+  if (sh->rawPD) freePageDirectoryOnly(sh->rawPD);
+  sh->guestPD = tPageDirectory;
+  sh->rawPD = guestPD;
+  sh->valid = true;
+  if (vcpu->ptFrameRefs && info->vcpuCount == 1) {
+    trackShadow(vcpu, sh);
+    protectCompiledPD(thr, sh);
+  }
 
-  freePageDirectory(tPageDirectory);
-  return succ;
+  // Force a context switch to ensure directory change and relavidation
+  // (No one else runs on the page directory of this vCPU)
+  assert(yieldToNext());
+  return true;
 }
 
-// Invalidate only one mapping is complicated: we have to clear the current
-// page directory, recover originalPD; while we need to preserve most.
-// Simply recover originalPD will cause loss to current PD. Therefore, caller
-// mustn't recover originalPD before calling this. (it's different from
-// swtichGuestPD)
-bool invalidateGuestPDAt(tcb* thr, uint32_t guestaddr) {
+// Let a guest write to a page that's read-only only for being write protected
+// (see swtichGuestPD): every shadow page directory compiled from the guest
+// physical page is not trusted any more, and the page gets writable.
+// The guest mapping is read from the copy of active shadow, which is what's
+// compiled
+bool unprotectGuestWrite(tcb* thr, uint32_t guestaddr) {
   HyperInfo* info = &thr->process->hyperInfo;
-  uint32_t pdbase = info->vCR3 + info->baseAddr;
+  hvVCPU* vcpu = thr->vcpu;
+  shadowPD* sh = vcpu->activeShadow;
+  if (!sh || !sh->guestPD || guestaddr > GUEST_PHYSICAL_MAXVADDR) {
+    return false;
+  }
 
-  if (!IS_PAGE_ALIGNED(pdbase)) {
+  // 1. It's a write the guest allows
+  PDE guestPDE = sh->guestPD[STRIP_PD_INDEX(guestaddr)];
+  if (!PE_IS_PRESENT(guestPDE)) return false;
+  PTE guestPTE = PDE2PT(guestPDE)[STRIP_PT_INDEX(guestaddr)];
+  if (!PE_IS_PRESENT(guestPTE)) return false;
+  bool isUser = PE_IS_USERMODE(guestPDE) && PE_IS_USERMODE(guestPTE);
+  bool isWritable = PE_IS_WRITABLE(guestPDE) && PE_IS_WRITABLE(guestPTE);
+  if (!isUser && !vcpu->inKernelMode) return false;
+  if (!isWritable && !(vcpu->inKernelMode && !vcpu->writeProtection)) {
     return false;
   }
 
-  // 1. Make a shallow-copy of current compiled pagetable, before it's cleared
-  // Also, we want to protect current page tables from being freed by
-  // clearCurrentPD, so we give them all zero
-  PageDirectory tPD = newPageDirectory();
-  memcpy(tPD, thr->process->pd, sizeof(PDE) * PD_SIZE);
-  for (int i = STRIP_PD_INDEX(USER_MEM_START); i <= STRIP_PD_INDEX(0xffffffff);
-      i++) {
-    thr->process->pd[i] = EMPTY_PDE;
+  // 2. And it's compiled into a read-only page
+  uint32_t hostVAddr = guestaddr + info->baseAddr;
+  uint32_t guestPAddr = PE_DECODE_ADDR(guestPTE);
+  PTE* hostPTE = searchPTEntryPageDirectory(vcpu->pd, hostVAddr);
+  if (!hostPTE || !PE_IS_PRESENT(*hostPTE) || PE_IS_WRITABLE(*hostPTE) ||
+      PE_DECODE_ADDR(*hostPTE) != guestFrameOf(info, guestPAddr)) {
+    return false;
   }
 
-  // 2. activate original pd to fetch the guest pd entry
-  reActivateOriginalPD(thr);
+  if (vcpu->ptFrameRefs) {
+    for (int i = 0; i < HV_SHADOW_PD_CACHE_SIZE; i++) {
+      shadowPD* other = &vcpu->shadows[i];
+      if (other->trusted && shadowUsesFrame(other, guestPAddr)) {
+        untrackShadow(vcpu, other);
+      }
+    }
+  }
+  *hostPTE |= PE_WRITABLE(1);
+  invalidateTLB(hostVAddr);
+  vcpu->shadowProtectFaults++;
+  return true;
+}
+
+// Recompile the mapping of one guest virtual page: read the guest page
+// directory entry and page table entry (by frame, through frame table), and
+// write the one host page table entry, with only that page flushed from TLB.
+// The active shadow page directory stays valid, its copy of the guest page
+// table entry is updated as well
+bool invalidateGuestPDAt(tcb* thr, uint32_t guestaddr) {
+  HyperInfo* info = &thr->process->hyperInfo;
+  hvVCPU* vcpu = thr->vcpu;
+  uint32_t pdbase = vcpu->vCR3;
+  uint32_t pdIndex = STRIP_PD_INDEX(guestaddr);
+  uint32_t ptIndex = STRIP_PT_INDEX(guestaddr);
+  guestaddr = PE_DECODE_ADDR(guestaddr);
 
-  // 3. Check the address validation for PD
-  if (!verifyUserSpaceAddr(
-      pdbase, pdbase + sizeof(PDE) * PD_SIZE - 1, false)) {
-    sfree(tPD, sizeof(PDE) * PD_SIZE);
+  if (!IS_PAGE_ALIGNED(pdbase)) {
     return false;
   }
 
-  PageDirectory guestPD = (PageDirectory)pdbase;
-
-  if (PE_IS_PRESENT(guestPD[STRIP_PD_INDEX(guestaddr)])) {
-    bool isUser = PE_IS_USERMODE(guestPD[STRIP_PD_INDEX(guestaddr)]);
-    bool isWritable = PE_IS_WRITABLE(guestPD[STRIP_PD_INDEX(guestaddr)]);
-    if (!IS_VALID_GUEST_PE(guestPD[STRIP_PD_INDEX(guestaddr)])) {
-      sfree(tPD, sizeof(PDE) * PD_SIZE);
+  PDE guestPDE;
+  if (!copyGuestPhysical(info, pdbase + sizeof(PDE) * pdIndex, &guestPDE,
+      sizeof(PDE))) {
+    return false;
+  }
+  PTE guestPTE = EMPTY_PDE;
+  if (PE_IS_PRESENT(guestPDE)) {
+    if (!IS_VALID_GUEST_PE(guestPDE)) {
       return false;
     }
-    PageTable cpt = (PageTable)PE_DECODE_ADDR(
-        guestPD[STRIP_PD_INDEX(guestaddr)] + info->baseAddr);
-    if (!verifyUserSpaceAddr(
-        (uint32_t)cpt, (uint32_t)cpt + sizeof(PTE) * PT_SIZE - 1, false)) {
-      sfree(tPD, sizeof(PDE) * PD_SIZE);
+    if (!copyGuestPhysical(info,
+        PE_DECODE_ADDR(guestPDE) + sizeof(PTE) * ptIndex, &guestPTE,
+        sizeof(PTE))) {
       return false;
     }
-    if (PE_IS_PRESENT(cpt[STRIP_PT_INDEX(guestaddr)])) {
-      if (!IS_VALID_GUEST_PE(cpt[STRIP_PT_INDEX(guestaddr)])) {
-        sfree(tPD, sizeof(PDE) * PD_SIZE);
-        return false;
-      }
-      isUser &= PE_IS_USERMODE(cpt[STRIP_PT_INDEX(guestaddr)]);
-      isWritable &= PE_IS_WRITABLE(cpt[STRIP_PT_INDEX(guestaddr)]);
-      uint32_t guestPAddr = PE_DECODE_ADDR(cpt[STRIP_PT_INDEX(guestaddr)]);
-
-      // 4.1. Restore pd copied in step 1 and apply new mapping
-      memcpy(thr->process->pd, tPD, sizeof(PDE) * PD_SIZE);
-      sfree(tPD, sizeof(PDE) * PD_SIZE);
-      assert(yieldToNext());  // force pd flush
-
-      return generatePDMapping(thr, isWritable, isUser, guestaddr,
-                               guestPAddr, true);
+    if (PE_IS_PRESENT(guestPTE) && !IS_VALID_GUEST_PE(guestPTE)) {
+      return false;
     }
   }
-  // No page directory or page table. Remove it
 
-  // 4.2. Restore pd copied in step 1 and apply new mapping
-  memcpy(thr->process->pd, tPD, sizeof(PDE) * PD_SIZE);
-  sfree(tPD, sizeof(PDE) * PD_SIZE);
-  assert(yieldToNext());  // force pd flush
+  // Keep the active shadow's copy in step with what is compiled, if it's
+  // still the same guest page table
+  shadowPD* sh = vcpu->activeShadow;
+  if (sh && sh->guestPD && PE_IS_PRESENT(guestPDE) &&
+      PE_IS_PRESENT(sh->guestPD[pdIndex]) &&
+      PTE_CLEAR_ADDR(sh->guestPD[pdIndex]) == PTE_CLEAR_ADDR(guestPDE)) {
+    PDE2PT(sh->guestPD[pdIndex])[ptIndex] = guestPTE;
+  }
 
-  return generatePDMapping(thr, false, false, guestaddr, 0xffffffff, true);
+  if (!PE_IS_PRESENT(guestPTE)) {
+    // No page directory or page table. Remove it
+    return generatePDMapping(thr, false, false, guestaddr, 0xffffffff, true);
+  }
+  bool isUser = PE_IS_USERMODE(guestPDE) && PE_IS_USERMODE(guestPTE);
+  bool isWritable = PE_IS_WRITABLE(guestPDE) && PE_IS_WRITABLE(guestPTE);
+  return generatePDMapping(thr, isWritable, isUser, guestaddr,
+                           PE_DECODE_ADDR(guestPTE), true);
 }
 
 // Below are simple entries for virtual memory -related hypercalls
@@ -351,13 +692,13 @@ int hpc_setpd(int userEsp, tcb* thr) {
   DEFINE_PARAM(int, wp, 1);
 
   HyperInfo* info = &thr->process->hyperInfo;
-  if (!info->originalPD) {
+  hvVCPU* vcpu = thr->vcpu;
+  if (!vcpu->originalPD) {
     backupOriginalPD(thr);
   }
-  reActivateOriginalPD(thr);
 
-  info->vCR3 = pdbase;
-  info->writeProtection = (wp == 1);
+  vcpu->vCR3 = pdbase;
+  vcpu->writeProtection = (wp == 1);
 
   if (!swtichGuestPD(thr)) {
     lprintf("Hypervisor crashes: fail to set new page directory");
@@ -370,7 +711,8 @@ int hpc_adjustpg(int userEsp, tcb* thr) {
   DEFINE_PARAM(uint32_t, vaddr, 0);
 
   HyperInfo* info = &thr->process->hyperInfo;
-  if (!info->originalPD) {
+  hvVCPU* vcpu = thr->vcpu;
+  if (!vcpu->originalPD) {
     // Has not got a valid cr3 yet.
     lprintf("Hypervisor crashes: cannot call adjustpg before setting cr3");
     exitHyperWithStatus(info, thr, GUEST_CRASH_STATUS);
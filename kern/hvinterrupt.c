@@ -37,31 +37,48 @@
 
 MAKE_VAR_QUEUE_UTILITY(hvInt);
 
+// Queue a delayed int to delayedInt of the vCPU(s) it's routed to, returns
+// false if IDT is not specified or int queue is full on all of them
+bool enqueueDelayedInt(HyperInfo* info, hvInt hvi) {
+  bool succ = false;
+  GlobalLockR(&info->latch);
+  int target = info->route[hvi.intNum];
+  for (int i = 0; i < info->vcpuCount; i++) {
+    hvVCPU* vcpu = &info->vcpus[i];
+    if (target != HV_VCPU_ALL && target != i) continue;
+    if (!vcpu->online || !vcpu->idt[hvi.intNum].present) continue;
+    if (!varQueueEnq(&vcpu->delayedInt, hvi)) {
+      info->intDropped++;
+      continue;
+    }
+    succ = true;
+    info->intQueued++;
+    if (vcpu->delayedInt.size > info->intMaxPending) {
+      info->intMaxPending = vcpu->delayedInt.size;
+    }
+  }
+  GlobalUnlockR(&info->latch);
+  return succ;
+}
+
 // Append an delayed int to one hypervisor, returns false if IDT is not
 // specified or int queue is full
 // Info is actually a hyperInfo*
 bool appendIntTo(void* _info, hvInt hvi) {
   assert(hvi.intNum >= 0 && hvi.intNum <= MAX_SUPPORTED_VIRTUAL_INT);
   HyperInfo* info = (HyperInfo*)_info;
-  GlobalLockR(&info->latch);
-  IDTEntry localIDT = info->idt[hvi.intNum];
-  GlobalUnlockR(&info->latch);
-  if (!localIDT.present) {
-    return false;
+  if (info->ringFrame) {
+    return appendToEventRing(info, hvi);
   }
-  bool succ;
-  GlobalLockR(&info->latch);
-  succ = varQueueEnq(&info->delayedInt, hvi);
-  GlobalUnlockR(&info->latch);
-  return succ;
+  return enqueueDelayedInt(info, hvi);
 }
 
 // Elevate privilege, which happens on interrupt delivery
 static void elevatePriviledge(HyperInfo* info, tcb* thr) {
-  assert(!info->inKernelMode);
-  info->inKernelMode = true;
-  assert(info->originalPD);
-  reActivateOriginalPD(thr);
+  hvVCPU* vcpu = thr->vcpu;
+  assert(!vcpu->inKernelMode);
+  vcpu->inKernelMode = true;
+  assert(vcpu->originalPD);
   // Recompile PD to shadow kernel only memories
   if (!swtichGuestPD(thr)) {
     lprintf("Hypervisor crashes: fail to recompile kernel page directory");
@@ -78,20 +95,23 @@ bool applyInt(HyperInfo* info, hvInt hvi,
     int oedi, int oesi, int oebp, int oebx, int oedx, int oecx, int oeax) {
 
   assert(hvi.intNum >= 0 && hvi.intNum <= MAX_SUPPORTED_VIRTUAL_INT);
+  tcb* currentThread = getRunningThread();
+  hvVCPU* vcpu = currentThread->vcpu;
   GlobalLockR(&info->latch);
-  IDTEntry localIDT = info->idt[hvi.intNum];
+  IDTEntry localIDT = vcpu->idt[hvi.intNum];
   GlobalUnlockR(&info->latch);
   if (!localIDT.present) {
     return false;
   }
 
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
-
   uint32_t* stack;
   uint32_t newESP;
   // 1. Push state:
-  if (info->inKernelMode) {
-    // No stack change
+  if (vcpu->inKernelMode) {
+    // No stack change. It may share a page with write protected guest page
+    // tables (see hv_hpcall_vm.c)
+    unprotectGuestWrite(currentThread, oldESP - 10 * sizeof(uint32_t));
+    unprotectGuestWrite(currentThread, oldESP - 1);
     if (!verifyUserSpaceAddr(oldESP + info->baseAddr - 10 * sizeof(uint32_t),
                              oldESP + info->baseAddr - 1,
                              true)) {
@@ -109,15 +129,17 @@ bool applyInt(HyperInfo* info, hvInt hvi,
   } else {
     // Elevate priviledge
     elevatePriviledge(info, currentThread);
+    unprotectGuestWrite(currentThread, vcpu->esp0 - 10 * sizeof(uint32_t));
+    unprotectGuestWrite(currentThread, vcpu->esp0 - 1);
     if (!verifyUserSpaceAddr(
-          info->esp0 + info->baseAddr - 10 * sizeof(uint32_t),
-          info->esp0 + info->baseAddr - 1,
+          vcpu->esp0 + info->baseAddr - 10 * sizeof(uint32_t),
+          vcpu->esp0 + info->baseAddr - 1,
           true)) {
       // Not a proper stack to push. Crash the kernel
       lprintf("Hypervisor crashes: not a proper esp0 on int delivery");
       exitHyperWithStatus(info, currentThread, GUEST_CRASH_STATUS);
     }
-    stack = (uint32_t*)(info->esp0 + info->baseAddr);
+    stack = (uint32_t*)(vcpu->esp0 + info->baseAddr);
     stack[-1] = oldESP;
     stack[-2] = oldEFLAGS;
     stack[-3] = GUEST_INTERRUPT_UMODE;
@@ -135,22 +157,25 @@ bool applyInt(HyperInfo* info, hvInt hvi,
 }
 
 // Called on hypervisorTimerHook (context switch on my own) when it's from
-//  kernel to guest
+//  kernel to guest, and on hypercalls that enable interrupts (see
+//  HV_BATCHED_INT_DELIVERY)
 // Deliver a delayed int to guest. If success, it never returns
 void applyDelayedInt(HyperInfo* info,
     uint32_t oldESP, uint32_t oldEFLAGS, uint32_t oldEIP,
     int oedi, int oesi, int oebp, int oebx, int oedx, int oecx, int oeax) {
-  if (!info->interrupt) return;
+  hvVCPU* vcpu = getRunningThread()->vcpu;
+  if (!vcpu->interrupt) return;
   GlobalLockR(&info->latch);
   #ifdef HYPERVISOR_VERBOSE_PRINT
-    lprintf("%d", info->delayedInt.size);
+    lprintf("%d", vcpu->delayedInt.size);
   #endif
-  if (info->delayedInt.size == 0) {
+  if (vcpu->delayedInt.size == 0) {
     GlobalUnlockR(&info->latch);
     return;
   }
-  info->interrupt = false;
-  hvInt hvi = varQueueDeq(&info->delayedInt);
+  vcpu->interrupt = false;
+  hvInt hvi = varQueueDeq(&vcpu->delayedInt);
+  info->intDelivered++;
   GlobalUnlockR(&info->latch);
 
   applyInt(info, hvi, oldESP, oldEFLAGS, oldEIP,
@@ -171,10 +196,12 @@ void hypervisorTimerHook(const int es, const int ds,
     // either from normal elf or kernel mode. We are not interested.
     return;
   }
-  tcb* thr = findTCB(getLocalCPU()->runningTID);
+  tcb* thr = getRunningThread();
   assert(thr != NULL);
   assert(thr->process->hyperInfo.isHyper);
 
+  // Some other vCPU has ended the guest
+  followHyperExit(&thr->process->hyperInfo, thr);
   applyDelayedInt(&thr->process->hyperInfo, esp, eflags, eip,
                   _edi, _esi, _ebp, _ebx, _edx, _ecx, _eax);
 }
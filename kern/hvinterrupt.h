@@ -23,6 +23,16 @@
  *  the delayed int queue runs out. That's why we keep virtual timer rate at
  *  2 per own timer tick (timer tick when it's on my own process)
  *
+ *  With HV_BATCHED_INT_DELIVERY, enabling interrupts is also one-iret away
+ *  from guest: hv_enable_interrupts and hv_iret (with IF set) deliver the next
+ *  pending delayed interrupt right away. Since each handler ends with hv_iret,
+ *  a backlog is drained back-to-back, one handler after another, without
+ *  waiting for own timer ticks
+ *
+ *  A guest can go further by an event ring (see hvinterrupt_ring.c): delayed
+ *  interrupts become records in its memory, and one interrupt tells it to
+ *  drain all of them
+ *
  *  So how to notify hypervisor of int? The first way is pushevent (see
  *  pushevent.c), so that outsider is hooked to call some functions provided;
  *  The second way is via multiplexer (see below), outsider will notify
@@ -70,6 +80,19 @@ typedef struct {
 // Info is actually a hyperInfo*
 bool appendIntTo(void* info, hvInt hvi);
 
+/*****************************************************************************/
+// Event Ring (see hvinterrupt_ring.c):
+// Guest may ask delayed ints to be appended to a ring in its memory instead,
+// and it's only interrupted (at HV_EVENT_RING) when the ring becomes non-empty.
+
+// Register the ring at guest physical page guestPAddr (0 to unregister), and
+// reset it. Return false if it's not a page of guest memory
+bool registerEventRing(void* info, uint32_t guestPAddr);
+
+// Append a delayed int to the ring of the hypervisor, and signal the guest if
+// needed. Returns false if the ring is full or the signal fails to queue
+bool appendToEventRing(void* info, hvInt hvi);
+
 /*****************************************************************************/
 // Interrupt Multiplexer:
 // Multiplexer is used to multiplex the delayed int deliver process. Kernel
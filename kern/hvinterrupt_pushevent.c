@@ -35,6 +35,7 @@
 #include "hvinterrupt_pushevent.h"
 #include "zeus.h"
 #include "fault.h"
+#include "hvvm.h"
 
 // In hvinterrupt.c, internal use only
 bool applyInt(HyperInfo* info, hvInt hvi,
@@ -71,12 +72,13 @@ void hypervisorSyscallHook(int intNum, const int es, const int ds,
     // either from normal elf or kernel mode. We are not interested.
     return;
   }
-  tcb* thr = findTCB(getLocalCPU()->runningTID);
+  tcb* thr = getRunningThread();
   assert(thr);
   assert(thr->process->hyperInfo.isHyper);
 
   HyperInfo* info = &thr->process->hyperInfo;
-  if (info->inKernelMode) {
+  followHyperExit(info, thr);
+  if (thr->vcpu->inKernelMode) {
     // Why a kernel mode guest is calling INT ?!
     exitHyperWithStatus(info, thr, GUEST_CRASH_STATUS);
   }
@@ -96,13 +98,22 @@ void hypervisorSyscallHook(int intNum, const int es, const int ds,
 // See (fault.c) for the hook point.
 // It simply forward the exception to guest kernel. If guest kernel hasn't
 // set up corresponding IDT, crash the guest
+FAULT_ACTION(HyperPTWriteHandler) {
+  // Only a write to a present page
+  if ((errCode & 0x3) != 0x3) return false;
+  tcb* thr = getRunningThread();
+  assert(thr);
+  assert(thr->process->hyperInfo.isHyper);
+  return unprotectGuestWrite(thr, cr2 - thr->process->hyperInfo.baseAddr);
+}
+
 FAULT_ACTION(HyperFaultHandler) {
   lprintf("Hypervisor exception.");
   printError(es, ds, edi, esi, ebp,
       ebx, edx, ecx, eax, faultNumber, errCode,
       eip, cs, eflags, esp, ss, cr2);
 
-  tcb* thr = findTCB(getLocalCPU()->runningTID);
+  tcb* thr = getRunningThread();
   assert(thr);
   assert(thr->process->hyperInfo.isHyper);
 
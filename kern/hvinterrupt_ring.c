@@ -0,0 +1,127 @@
+/** @file hvinterrupt_ring.c
+ *
+ *  @brief Paravirtual event ring, the other way to deliver delayed interrupts
+ *
+ *  A guest may register one page of its physical memory as an event ring (see
+ *  hv_event_ring in hvcall.h for the layout). Then delayed interrupts are
+ *  appended to the ring instead of delayedInt queue, and the guest is only
+ *  interrupted (at HV_EVENT_RING) when the ring becomes non-empty, so that one
+ *  handler drains all events that come before it's done. Chatty guests save
+ *  both the queue latch and a frame built on guest stack for every event.
+ *
+ *  The ring is written by frame through kmap, so events can come from any
+ *  process. No latch is taken: producers claim slots by CAS on ringClaimed and
+ *  publish them in order by ringPublished, all with LocalLock (which also owns
+ *  the kmap slot), so a producer never waits for one it interrupted.
+ *
+ *  Host and guest only talk by head (written by host) and tail (written by
+ *  guest). After publishing, the producer reads tail, and signals if the guest
+ *  has consumed everything before its event; while the guest writes tail and
+ *  then reads head again before leaving its handler. One of them must see the
+ *  other, so no event is left without a signal.
+ *  The host never trusts what it reads from the ring: a broken tail only makes
+ *  the ring look full.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdio.h>
+#include <simics.h>
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include <hvcall_int.h>
+#include <hvcall.h>
+#include <x86/asm.h>
+
+#include "common_kern.h"
+#include "bool.h"
+#include "process.h"
+#include "cpu.h"
+#include "vm.h"
+#include "hv.h"
+#include "hvlife.h"
+#include "hvinterrupt.h"
+#include "hvvm.h"
+
+// In hvinterrupt.c, internal use only
+bool enqueueDelayedInt(HyperInfo* info, hvInt hvi);
+
+// Queue the signal for the ring. If it fails, the next event tries again
+static bool _signalRing(HyperInfo* info) {
+  hvInt sig;
+  sig.intNum = HV_EVENT_RING;
+  sig.spCode = 0;
+  sig.cr2 = 0;
+  info->ringUnsignaled = !enqueueDelayedInt(info, sig);
+  if (info->ringUnsignaled) return false;
+  __sync_fetch_and_add(&info->ringSignals, 1);
+  return true;
+}
+
+bool registerEventRing(void* _info, uint32_t guestPAddr) {
+  HyperInfo* info = (HyperInfo*)_info;
+  assert(sizeof(hv_event_ring_t) <= PAGE_SIZE);
+  if (guestPAddr == 0) {
+    info->ringFrame = 0;
+    return true;
+  }
+  if (!IS_PAGE_ALIGNED(guestPAddr)) return false;
+  uint32_t frame = guestFrameOf(info, guestPAddr);
+  if (!frame) return false;
+
+  LocalLockR();
+  hv_event_ring_t* ring = kmap(KMAP_DST, frame);
+  ring->head = ring->tail = ring->dropped = 0;
+  kunmap(KMAP_DST);
+  info->ringClaimed = info->ringPublished = 0;
+  info->ringUnsignaled = false;
+  info->ringFrame = frame;
+  LocalUnlockR();
+  return true;
+}
+
+bool appendToEventRing(void* _info, hvInt hvi) {
+  HyperInfo* info = (HyperInfo*)_info;
+  LocalLockR();
+  uint32_t frame = info->ringFrame;
+  if (!frame) {
+    // Unregistered just now
+    LocalUnlockR();
+    return enqueueDelayedInt(info, hvi);
+  }
+  hv_event_ring_t* ring = kmap(KMAP_DST, frame);
+
+  // Claim a slot
+  uint32_t slot;
+  do {
+    slot = info->ringClaimed;
+    if (slot - ring->tail >= HV_EVENT_RING_SIZE) {
+      ring->dropped = __sync_add_and_fetch(&info->ringDropped, 1);
+      kunmap(KMAP_DST);
+      LocalUnlockR();
+      // Guest won't drain it without a signal
+      if (info->ringUnsignaled) _signalRing(info);
+      return false;
+    }
+  } while (!__sync_bool_compare_and_swap(&info->ringClaimed, slot, slot + 1));
+
+  hv_event_t* ev = &ring->events[slot & (HV_EVENT_RING_SIZE - 1)];
+  ev->irqno = hvi.intNum;
+  ev->code = hvi.spCode;
+  ev->cr2 = hvi.cr2;
+
+  // Publish in order, after producers of earlier slots on other CPUs
+  while (info->ringPublished != slot) continue;
+  __sync_synchronize();
+  ring->head = slot + 1;
+  info->ringPublished = slot + 1;
+  __sync_synchronize();
+  bool signal = ring->tail == slot || info->ringUnsignaled;
+  kunmap(KMAP_DST);
+  LocalUnlockR();
+
+  __sync_fetch_and_add(&info->ringEvents, 1);
+  if (!signal) return true;
+  return _signalRing(info);
+}
@@ -26,6 +26,8 @@
 #include "process.h"
 #include "zeus.h"
 #include "hvvm.h"
+#include "context_switch.h"
+#include "x86/eflags.h"
 
 MAKE_VAR_QUEUE_UTILITY(hvInt);
 
@@ -67,54 +69,204 @@ bool fillHyperInfo(simple_elf_t* elfMetadata, HyperInfo* info) {
   return info->isHyper;
 }
 
-void destroyHyperInfo(HyperInfo* info, tcb* thr, int vcn) {
+// Set up a vCPU of info, run by thr on pd
+static void initVCPU(HyperInfo* info, hvVCPU* vcpu, int id, tcb* thr,
+    PageDirectory pd) {
+  vcpu->id = id;
+  vcpu->thr = thr;
+  vcpu->pd = pd;
+
+  vcpu->interrupt = false;
+  vcpu->originalPD = NULL;
+  vcpu->vCR3 = 0;
+  vcpu->writeProtection = false;
+  vcpu->inKernelMode = true;
+  vcpu->esp0 = 0;
+
+  for (int i = 0; i < HV_SHADOW_PD_CACHE_SIZE; i++) {
+    vcpu->shadows[i].valid = false;
+    vcpu->shadows[i].guestPD = NULL;
+    vcpu->shadows[i].shadow = NULL;
+    vcpu->shadows[i].rawPD = NULL;
+    vcpu->shadows[i].trusted = false;
+    vcpu->shadows[i].protectGen = 0;
+  }
+  vcpu->activeShadow = NULL;
+  vcpu->shadowClock = 0;
+  vcpu->ptFrameRefs = NULL;
+  vcpu->protectGen = 0;
+  vcpu->shadowHits = vcpu->shadowVerified = vcpu->shadowMisses = 0;
+  vcpu->shadowPTCompiled = vcpu->shadowProtectFaults = 0;
+
+  varQueueInit(&vcpu->delayedInt, MAX_WAITING_INT);
+  vcpu->idt = (IDTEntry*)smalloc(sizeof(IDTEntry) *
+                                 (MAX_SUPPORTED_VIRTUAL_INT + 1));
+  if (!vcpu->idt) {
+    panic("No enough kernel memory to launch hypervisor");
+  }
+  for (int i = 0; i <= MAX_SUPPORTED_VIRTUAL_INT; i++) {
+    vcpu->idt[i].present = false;
+  }
+  thr->vcpu = vcpu;
+
+  GlobalLockR(&info->latch);
+  vcpu->online = true;
+  GlobalUnlockR(&info->latch);
+}
+
+// Tear down the paging of the vCPU of thr, which is only used by itself. Except
+// the boot one, it goes back to process pd, and its own one is freed
+static void leaveVCPU(HyperInfo* info, tcb* thr) {
+  hvVCPU* vcpu = thr->vcpu;
+  GlobalLockR(&info->latch);
+  vcpu->online = false;
+  GlobalUnlockR(&info->latch);
+
+  exitPagingMode(thr);
+  if (vcpu->pd != thr->process->pd) {
+    // Only the direct mapping is left, whose page tables are process pd's
+    LocalLockR();
+    thr->vcpu = NULL;
+    activatePageDirectory(thr->process->pd);
+    LocalUnlockR();
+    freePageDirectoryOnly(vcpu->pd);
+  }
+}
+
+// Free what's shared by all vCPUs. It's done by the last vCPU to leave
+static void destroyHyperInfo(HyperInfo* info, int vcn) {
   removeWaiter(&info->selfMulti, info);
   intMultiplexer* currentKB = getKeyboardMultiplexer(vcn);
   removeWaiter(currentKB, info);
 
-  varQueueDestroy(&info->delayedInt);
-  sfree(info->idt, sizeof(IDTEntry) * (MAX_SUPPORTED_VIRTUAL_INT + 1));
+  for (int i = 0; i < info->vcpuCount; i++) {
+    varQueueDestroy(&info->vcpus[i].delayedInt);
+    sfree(info->vcpus[i].idt,
+        sizeof(IDTEntry) * (MAX_SUPPORTED_VIRTUAL_INT + 1));
+  }
 
-  exitPagingMode(thr);
+  releaseGuestFrames(info);
+  freePageDirectoryOnly(info->directPD);
 }
 
 void exitHyperWithStatus(HyperInfo* info, void* _thr, int statusCode) {
   tcb* thr = (tcb*)_thr;
   assert((&thr->process->hyperInfo) == info);
-  destroyHyperInfo(info, thr, thr->process->vcNumber);
-
-  thr->process->retStatus = statusCode;
+  // The first one to exit decides the status
+  if (__sync_bool_compare_and_swap(&info->exiting, false, true)) {
+    info->exitStatus = statusCode;
+  }
+  leaveVCPU(info, thr);
+  if (__sync_sub_and_fetch(&info->vcpuAlive, 1) == 0) {
+    destroyHyperInfo(info, thr->process->vcNumber);
+    thr->process->retStatus = info->exitStatus;
+  }
   // one way trp
   terminateThread(thr);
 }
 
+void followHyperExit(HyperInfo* info, void* thr) {
+  if (info->exiting) {
+    exitHyperWithStatus(info, thr, info->exitStatus);
+  }
+}
+
+// The entry of the thread of a new vCPU, after swtichTheWorld. It goes into
+// guest kernel with the vCPU id in %eax
+static void RunVCPU(tcb* creatorThread, tcb* currentThread,
+    uint32_t eip, uint32_t esp) {
+  // From swtichToThread, disown the creator and unlock
+  creatorThread->owned = THREAD_NOT_OWNED;
+  LocalUnlockR();
+
+  HyperInfo* info = &currentThread->process->hyperInfo;
+  uint32_t eflags = (get_eflags() | EFL_RESV1 | EFL_IF) & ~EFL_AC;
+  switchToRing3X(esp, eflags, eip, 0,
+                 0, 0, HYPERVISOR_MEMORY / PAGE_SIZE, 0,
+                 GUEST_PHYSICAL_MAXVADDR, currentThread->vcpu->id,
+                 info->cs, info->ds);
+}
+
+int startVCPU(HyperInfo* info, void* _thr, uint32_t eip, uint32_t esp) {
+  tcb* thr = (tcb*)_thr;
+  pcb* proc = thr->process;
+  GlobalLockR(&info->latch);
+  if (info->exiting || info->vcpuCount == HV_MAX_VCPUS) {
+    GlobalUnlockR(&info->latch);
+    return -1;
+  }
+  int id = info->vcpuCount++;
+  __sync_fetch_and_add(&info->vcpuAlive, 1);
+  GlobalUnlockR(&info->latch);
+
+  // Its own page directory, starting from the direct mapping
+  PageDirectory pd = newPageDirectory();
+  setKernelMapping(pd);
+  for (int i = STRIP_PD_INDEX(USER_MEM_START); i <= STRIP_PD_INDEX(0xffffffff);
+      i++) {
+    pd[i] = info->directPD[i];
+  }
+
+  kmutexWLock(&proc->mutex);
+  proc->numThread++;
+  kmutexWUnlock(&proc->mutex);
+  tcb* newThread = SpawnThread(proc);
+  initVCPU(info, &info->vcpus[id], id, newThread, pd);
+
+  // Initial kernel stack, calling RunVCPU on switch
+  newThread->regs.eip = (uint32_t)RunVCPU;
+  newThread->regs.esp = newThread->kernelStackPage + PAGE_SIZE - 1;
+  newThread->regs.ebp = 0;
+  uint32_t* futureStack = (uint32_t*)newThread->regs.esp;
+  futureStack[-1] = esp;
+  futureStack[-2] = eip;
+  futureStack[-3] = (uint32_t)newThread;
+  futureStack[-4] = (uint32_t)thr;
+  futureStack[-5] = 0xdeadbeef;   // invalid ret address of root call frame
+  newThread->regs.esp = (uint32_t)&futureStack[-5];
+
+  // Let it run first, I'm still runnable
+  swtichToThread(newThread);
+  return id;
+}
+
 void bootstrapHypervisorAndSwitchToRing3(
     HyperInfo* info, uint32_t entryPoint, uint32_t eflags, int vcn) {
   assert(info->isHyper);
+  tcb* thr = getRunningThread();
 
   // 1. set all the other fields for hyperInfo before activating it
-  info->interrupt = false;
-
   info->tics = 0;
 
-  info->originalPD = NULL;
-  info->vCR3 = 0;
-  info->writeProtection = false;
-  info->inKernelMode = true;
-  info->esp0 = 0;
+  info->intQueued = info->intDelivered = info->intDropped = 0;
+  info->intMaxPending = 0;
+  info->ringFrame = 0;
+  info->ringClaimed = info->ringPublished = 0;
+  info->ringUnsignaled = false;
+  info->ringEvents = info->ringDropped = info->ringSignals = 0;
+  info->exiting = false;
+  info->exitStatus = 0;
 
   initMultiplexer(&info->selfMulti);
 
   initCrossCPULock(&info->latch);
-  varQueueInit(&info->delayedInt, MAX_WAITING_INT);
-  info->idt = (IDTEntry*)smalloc(sizeof(IDTEntry) *
-                                 (MAX_SUPPORTED_VIRTUAL_INT + 1));
-  if (!info->idt) {
+  // All delayed ints go to the boot vCPU
+  for (int i = 0; i <= MAX_SUPPORTED_VIRTUAL_INT; i++) {
+    info->route[i] = 0;
+  }
+  for (int i = 0; i < HV_MAX_VCPUS; i++) {
+    info->vcpus[i].online = false;
+  }
+  if (!captureGuestFrames(info, thr->process->pd)) {
     panic("No enough kernel memory to launch hypervisor");
   }
-  for (int i = 0; i <= MAX_SUPPORTED_VIRTUAL_INT; i++) {
-    info->idt[i].present = false;
+  info->directPD = newPageDirectory();
+  for (int i = STRIP_PD_INDEX(USER_MEM_START); i <= STRIP_PD_INDEX(0xffffffff);
+      i++) {
+    info->directPD[i] = thr->process->pd[i];
   }
+  info->vcpuCount = info->vcpuAlive = 1;
+  initVCPU(info, &info->vcpus[0], 0, thr, thr->process->pd);
 
   // 2. register myself to self-multiplexer
   addToWaiter(&info->selfMulti, info);
@@ -9,6 +9,8 @@
  *  - Instead of just entering ring3, exec() will call
  *    bootstrapHypervisorAndSwitchToRing3 to complete the whole init phase for
  *    a hypervisor and entering guest. At this point, status = HyperInited
+ *  - The guest may start more vCPUs by startVCPU, each of which is a new host
+ *    thread in the same process
  *  - When a process decides to exit, it calls exitHyperWithStatus (instead of
  *    Zeus::terminateThread)
  *
@@ -27,6 +29,7 @@
 #include "cpu.h"
 #include "queue.h"
 #include "vm.h"
+#include "sysconf.h"
 
 typedef enum {
   HyperNA = 0,
@@ -36,6 +39,91 @@ typedef enum {
 
 #define HYPER_STATUS_READY(s) ((s) != HyperNA && (s) != HyperNew)
 
+// A compiled guest page directory cached by hypervisor (see hv_hpcall_vm.c),
+// for one guest cr3 in one mode
+typedef struct {
+  bool valid;
+  uint32_t vCR3;
+  bool inKernelMode;
+  bool writeProtection;
+  // For LRU replacement
+  uint32_t lastUse;
+  // In-kernel copy of guest page directory it's compiled from, each present
+  // entry points to an in-kernel copy of the guest page table
+  PageDirectory guestPD;
+  // User part of compiled page directory, owning the page tables. It's kept
+  // here only when not active; the active one lives in pd of its vCPU
+  PageDirectory shadow;
+  // Raw copy of guest page directory, i.e. guest page tables it's compiled from
+  PageDirectory rawPD;
+  // Whether guest page directory and page tables it's compiled from are write
+  // protected (see hv_hpcall_vm.c), so it's known to be up to date
+  bool trusted;
+  // protectGen of its vCPU when its page tables are last write protected
+  uint32_t protectGen;
+} shadowPD;
+
+// A virtual CPU of a hypervisor, run by one host thread. Each has its own
+// virtual IDT, interrupt flag and guest page directory, compiled into its own
+// host page directory: the boot one runs on process pd, the others on page
+// directories of their own (see THREAD_PD in process.h)
+typedef struct _hvVCPU {
+  // Index in HyperInfo::vcpus
+  int id;
+  // The host thread running it (tcb*), and the page directory it runs on
+  void* thr;
+  PageDirectory pd;
+
+  // === Fields that will only be accessed in its own thread's one-iret away
+  //     kernel stack
+  // Can delayed interrupt be delivered
+  bool interrupt;
+
+  // If null, paging is off;
+  // Otherwise, point to one shallow copy of the original direct-map page table
+  // This is a copied table, so destructor should release it when unnecessary
+  PageDirectory originalPD;
+
+  // virtual CR3. (before + segment offset)
+  // When == 0, page is off
+  uint32_t vCR3;
+
+  // can guest write to readonly pages in ring0
+  bool writeProtection;
+
+  // whether the guest is in ring0
+  bool inKernelMode;
+
+  // The stack for next switch-to-ring0
+  uint32_t esp0;
+
+  // Cache of compiled guest page directories, and the one in use by pd (NULL
+  // if pd is not from cache)
+  shadowPD shadows[HV_SHADOW_PD_CACHE_SIZE];
+  shadowPD* activeShadow;
+  uint32_t shadowClock;
+  // Number of trusted shadows compiled from each guest physical page (as page
+  // directory or page table), NULL if not tracking. Such pages are write
+  // protected, and protectGen goes up whenever a page gets protected
+  uint16_t* ptFrameRefs;
+  uint32_t protectGen;
+  // Switches served by a trusted one, a cached one checked against guest
+  // memory, or none; guest page tables compiled; and writes to protected pages
+  uint32_t shadowHits;
+  uint32_t shadowVerified;
+  uint32_t shadowMisses;
+  uint32_t shadowPTCompiled;
+  uint32_t shadowProtectFaults;
+
+  // === Fields protected by latch of HyperInfo
+  // Whether delayed ints can be queued to it, i.e. it's started and not left
+  bool online;
+  // The idt table
+  IDTEntry* idt;
+  // the delayed int queue
+  varQueue delayedInt;
+} hvVCPU;
+
 // The basic data structure describing a hypervisor, which is embedded in
 // PCB
 typedef struct HyperInfo {
@@ -64,8 +152,6 @@ typedef struct HyperInfo {
 
   // === SectionB: Fields that will only be accessed in self's one-iret away
   //               kernel stack
-  // Can delayed interrupt be delivered
-  bool interrupt;
 
   // For those who want to send interrupt to this hyper only, broadcast this
   // This helps prevent race when this hypervisor is exiting
@@ -81,35 +167,53 @@ typedef struct HyperInfo {
   // === SectionC: Fields that may be accessed in multithreaded or reentry way
   //               Therefore the section are protected by latch
 
-  // The idt table
-  IDTEntry* idt;
-
-  // the delayed int queue
-  varQueue delayedInt;
+  // Virtual CPUs, vcpus[0] is the boot one. Only the first vcpuCount ones are
+  // ever started
+  hvVCPU vcpus[HV_MAX_VCPUS];
+  int vcpuCount;
+  // The vCPU each delayed int goes to, or HV_VCPU_ALL for all of them
+  int route[MAX_SUPPORTED_VIRTUAL_INT + 1];
+  // Delayed ints queued, delivered and dropped on full queue, and the longest
+  // a queue has been
+  uint32_t intQueued;
+  uint32_t intDelivered;
+  uint32_t intDropped;
+  uint32_t intMaxPending;
   CrossCPULock latch;
+
+  // Paravirtual event ring (see hvinterrupt_ring.c), which doesn't use latch.
+  // Host frame of the ring (0 if not registered), slots claimed and published
+  // by producers, and whether a signal for the ring failed to be queued
+  uint32_t ringFrame;
+  volatile uint32_t ringClaimed;
+  volatile uint32_t ringPublished;
+  bool ringUnsignaled;
+  // Events appended to ring, dropped on full ring and signals queued, updated
+  // atomically
+  uint32_t ringEvents;
+  uint32_t ringDropped;
+  uint32_t ringSignals;
+
+  // vCPUs not left yet, updated atomically. The last one to leave destroys
+  // the hypervisor
+  int vcpuAlive;
+  // Set by the first vCPU to exit, with the status of hypervisor. The others
+  // follow on their next way into host (see followHyperExit)
+  bool exiting;
+  int exitStatus;
   // === SectionC ends
 
 
-  // === SectionD: Fields that will only be accessed in self's one-iret away
-  //               kernel stack (as SectionB). It's all about paging & Umode
+  // === SectionD: Fixed after HyperInited status
 
-  // If null, paging is off;
-  // Otherwise, point to one shallow copy of the original direct-map page table
-  // This is a copied table, so destructor should release it when unnecessary
-  PageDirectory originalPD;
+  // Host frame of each guest physical page, captured on boot (see
+  // captureGuestFrames)
+  uint32_t* guestFrames;
 
-  // virtual CR3. (before + segment offset)
-  // When == 0, page is off
-  uint32_t vCR3;
+  // Shallow copy of the user part of process pd on boot, i.e. the direct
+  // mapping of guest memory, where a new vCPU starts from
+  PageDirectory directPD;
 
-  // can guest write to readonly pages in ring0
-  bool writeProtection;
-
-  // whether the guest is in ring0
-  bool inKernelMode;
-
-  // The stack for next switch-to-ring0
-  uint32_t esp0;
   // === SectionD ends
 
 } HyperInfo;
@@ -123,9 +227,18 @@ void initHyperInfo(HyperInfo* info);
 bool fillHyperInfo(simple_elf_t* elfMetadata, HyperInfo* info);
 
 // One-way function, it's to a hypervisor is like how terminateThread is to
-// a normal program
+// a normal program. Only the vCPU of thr leaves at once; the others follow
+// (see followHyperExit), and the last one destroys the hypervisor
 void exitHyperWithStatus(HyperInfo* info, void* thr, int statusCode);
 
+// If the hypervisor is exiting, the vCPU of thr leaves as well (never returns).
+// Called whenever a vCPU gets into host
+void followHyperExit(HyperInfo* info, void* thr);
+
+// Start a new vCPU running guest kernel at eip and esp, with paging off and
+// interrupts disabled. Return its id, or -1 if no more vCPU can be started
+int startVCPU(HyperInfo* info, void* thr, uint32_t eip, uint32_t esp);
+
 // Finish all initialization of hypervisor, and go into guest
 void bootstrapHypervisorAndSwitchToRing3(
     HyperInfo* info, uint32_t entryPoint, uint32_t eflags, int vcn);
@@ -17,22 +17,33 @@
 // hypervisor exiting
 void exitPagingMode(tcb* thr);
 
-// The wrapper of reCompileGuestPD, since reCompileGuestPD needs a in-memory
-// copy of guest page directory. This function make a temporary copy, call it,
-// and destroy the copy.
-// NOTE: this function will access guest physical memory, so caller must
-// recover originalPD before calling me
+// Record the host frame of every guest physical page, from pd (the direct
+// mapping on boot). Return false if out of memory
+bool captureGuestFrames(HyperInfo* info, PageDirectory pd);
+void releaseGuestFrames(HyperInfo* info);
+
+// Host frame of guest physical address, or 0 if it's not guest memory
+uint32_t guestFrameOf(HyperInfo* info, uint32_t guestPAddr);
+
+// Compile the guest page directory at vCR3 (in current mode) and activate it.
+// Compiled ones are cached; a cached one whose guest page tables are write
+// protected is reused as is, otherwise only guest page tables changed since
+// last time are compiled again.
+// Guest physical memory is read by frame, so there's no need to recover
+// originalPD before calling me
 bool swtichGuestPD(tcb* thr);
 
-// Invalidate only one mapping is complicated: we have to clear the current
-// page directory, recover originalPD; while we need to preserve most.
-// Simply recover originalPD will cause loss to current PD. Therefore, caller
-// mustn't recover originalPD before calling this. (it's different from
-// swtichGuestPD)
+// Make a write protected page (see swtichGuestPD) writable for the guest write
+// at guestaddr. Return false if it's not such a write, i.e. the guest should
+// get the page fault
+bool unprotectGuestWrite(tcb* thr, uint32_t guestaddr);
+
+// Recompile the mapping of one guest virtual page in current page directory,
+// and flush just that page from TLB
 bool invalidateGuestPDAt(tcb* thr, uint32_t guestaddr);
 
 // Discard current guest page directory and activate original PD.
-// This is needed before crashing or want to accessing guest page directory
+// This is needed before crashing
 void reActivateOriginalPD(tcb* thr);
 
 #endif
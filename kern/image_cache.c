@@ -0,0 +1,329 @@
+/** @file image_cache.c
+ *
+ *  @brief Cache of loaded executable images
+ *
+ *  Each image covers all pages touched by text, rodata and data segments of a
+ *  program, plus bss pages in between. The cache holds one reference to each
+ *  frame, so the frames outlive all processes running the program. A page is
+ *  writable (so mapped copy-on-write) if it has any data or bss in it.
+ *
+ *  All the images are kept in a linklist, protected by imageLock. Building an
+ *  image takes the write lock, so one program is only built once.
+ *
+ *  Evicting an image only drops the references held by cache, processes still
+ *  running it keep theirs. Images whose frames nothing else refers to (idle
+ *  ones) are evicted first, then least recently used ones. Eviction only
+ *  happens in building, with write lock.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdio.h>
+#include <simics.h>
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include <exec2obj.h>
+
+#include "common_kern.h"
+#include "image_cache.h"
+#include "vm.h"
+#include "pm.h"
+#include "cow.h"
+#include "kmutex.h"
+#include "cpu.h"
+#include "bool.h"
+#include "sysconf.h"
+
+typedef struct _execImage {
+  // execname in exec2obj TOC, which never goes away
+  const char* name;
+  uint32_t startAddr;
+  int pageCount;
+  // frame of each page, or 0 if the page is not part of image
+  uint32_t* frames;
+  bool* writable;
+  // Number of frames held, and when it's mapped last time (by useClock)
+  int frameCount;
+  uint32_t lastUse;
+  struct _execImage* next;
+} execImage;
+
+static execImage* images;
+static int cachedFrames;
+static int evictedImages;
+static uint32_t useClock;
+static kmutex imageLock;
+
+void initImageCache() {
+  images = NULL;
+  cachedFrames = 0;
+  evictedImages = 0;
+  useClock = 0;
+  kmutexInit(&imageLock);
+}
+
+// Whether [start, start + len) intersects the page
+static bool _intersect(uint32_t start, uint32_t len, uint32_t page) {
+  if (len == 0) return false;
+  return start <= page + (PAGE_SIZE - 1) && start + (len - 1) >= page;
+}
+
+// Copy the part of segment [start, start + len) in the page, from bytes. The
+// page is written at kernel address dst
+static void _copySegment(const char* bytes, uint32_t start, uint32_t len,
+    uint32_t page, char* dst) {
+  if (!_intersect(start, len, page)) return;
+  uint32_t from = start > page ? start : page;
+  uint32_t to = start + (len - 1);
+  if (to > page + (PAGE_SIZE - 1)) to = page + (PAGE_SIZE - 1);
+  memcpy(dst + (from - page), bytes + (from - start), to - from + 1);
+}
+
+static const exec2obj_userapp_TOC_entry* _findFile(const char* filename) {
+  for (int i = 0; i < exec2obj_userapp_count; i++) {
+    if (strcmp(exec2obj_userapp_TOC[i].execname, filename) == 0) {
+      return &exec2obj_userapp_TOC[i];
+    }
+  }
+  return NULL;
+}
+
+static execImage* _findImage(const char* filename) {
+  for (execImage* img = images; img != NULL; img = img->next) {
+    if (strcmp(img->name, filename) == 0) return img;
+  }
+  return NULL;
+}
+
+// Whether any frame of the image is referred by someone other than cache
+static bool _imageInUse(execImage* img) {
+  for (int i = 0; i < img->pageCount; i++) {
+    if (img->frames[i] && isUserMemPageShared(img->frames[i])) return true;
+  }
+  return false;
+}
+
+// Must run with imageLock write locked. Drop the image from cache, with the
+// references to its frames
+static void _evictImage(execImage* img) {
+  execImage** pos = &images;
+  while (*pos != img) pos = &(*pos)->next;
+  *pos = img->next;
+
+  int freed = 0;
+  for (int i = 0; i < img->pageCount; i++) {
+    if (img->frames[i]) img->frames[freed++] = img->frames[i];
+  }
+  assert(freed == img->frameCount);
+  freeUserMemPages(img->frames, freed);
+  cachedFrames -= freed;
+  evictedImages++;
+
+  sfree(img->frames, sizeof(uint32_t) * (img->pageCount + 1));
+  sfree(img->writable, sizeof(bool) * (img->pageCount + 1));
+  sfree(img, sizeof(execImage));
+}
+
+// Must run with imageLock write locked. Evict the least recently used image,
+// idle ones first if onlyIdle is false, or only idle ones otherwise. Return
+// false if there's nothing to evict
+static bool _evictOne(bool onlyIdle) {
+  execImage* victim = NULL;
+  bool victimIdle = false;
+  for (execImage* img = images; img != NULL; img = img->next) {
+    bool idle = !_imageInUse(img);
+    if (onlyIdle && !idle) continue;
+    if (!victim || (idle && !victimIdle) ||
+        (idle == victimIdle && img->lastUse < victim->lastUse)) {
+      victim = img;
+      victimIdle = idle;
+    }
+  }
+  if (!victim) return false;
+  _evictImage(victim);
+  return true;
+}
+
+// Map frame to vaddr in pd readonly (copy-on-write if writable), and drop the
+// frame previously mapped there. After that, vaddr is not in TLB
+static void _installPage(PageDirectory pd, uint32_t vaddr, uint32_t frame,
+    bool writable) {
+  PTE* pte = searchPTEntryPageDirectory(pd, vaddr);
+  uint32_t oldFrame = 0;
+  if (pte) {
+    oldFrame = PE_DECODE_ADDR(*pte);
+    *pte = PE_PRESENT(1) | PE_WRITABLE(0) | PE_USERMODE(1) |
+           PE_WRITETHROUGH_CACHE(0) | PE_DISABLE_CACHE(0) | frame;
+    // Only a replaced mapping can be in TLB
+    invalidateTLB(vaddr);
+  } else {
+    createMapPageDirectory(pd, vaddr, frame, true, false);
+    pte = searchPTEntryPageDirectory(pd, vaddr);
+  }
+  *pte |= PE_COW(writable);
+  if (oldFrame) freeUserMemPage(oldFrame);
+}
+
+// Must run with imageLock write locked. Build the image into pd, and put it in
+// cache. Return NULL if the elf is broken, or out of memory
+static execImage* _buildImage(const char* filename, simple_elf_t* elf,
+    PageDirectory pd) {
+  const exec2obj_userapp_TOC_entry* file = _findFile(filename);
+  if (!file) return NULL;
+
+  // segments to copy from file
+  uint32_t segStart[3] = {elf->e_txtstart, elf->e_rodatstart, elf->e_datstart};
+  uint32_t segLen[3] = {elf->e_txtlen, elf->e_rodatlen, elf->e_datlen};
+  uint32_t segOff[3] = {elf->e_txtoff, elf->e_rodatoff, elf->e_datoff};
+
+  uint32_t startAddr = 0xffffffff, endAddr = 0;
+  for (int i = 0; i < 3; i++) {
+    if (segLen[i] == 0) continue;
+    if (segOff[i] + segLen[i] > file->execlen) return NULL;
+    uint32_t segStartPage = PE_DECODE_ADDR(segStart[i]);
+    uint32_t segEndPage = PE_DECODE_ADDR(segStart[i] + (segLen[i] - 1));
+    if (segStartPage < startAddr) startAddr = segStartPage;
+    if (segEndPage + PAGE_SIZE > endAddr) endAddr = segEndPage + PAGE_SIZE;
+  }
+  if (endAddr == 0) startAddr = 0;
+
+  execImage* img = smalloc(sizeof(execImage));
+  if (!img) return NULL;
+  img->name = file->execname;
+  img->startAddr = startAddr;
+  img->pageCount = (endAddr - startAddr) / PAGE_SIZE;
+  img->frames = smalloc(sizeof(uint32_t) * (img->pageCount + 1));
+  img->writable = smalloc(sizeof(bool) * (img->pageCount + 1));
+  if (!img->frames || !img->writable) {
+    if (img->frames) {
+      sfree(img->frames, sizeof(uint32_t) * (img->pageCount + 1));
+    }
+    if (img->writable) {
+      sfree(img->writable, sizeof(bool) * (img->pageCount + 1));
+    }
+    sfree(img, sizeof(execImage));
+    return NULL;
+  }
+
+  // Decide which pages to have, and get all the frames in one batch
+  int framesNeeded = 0;
+  for (int i = 0; i < img->pageCount; i++) {
+    uint32_t page = startAddr + i * PAGE_SIZE;
+    bool present = _intersect(elf->e_bssstart, elf->e_bsslen, page);
+    for (int j = 0; j < 3; j++) {
+      present = present || _intersect(segStart[j], segLen[j], page);
+    }
+    // Just a mark for now, the frame comes later
+    img->frames[i] = present;
+    img->writable[i] = _intersect(elf->e_datstart, elf->e_datlen, page) ||
+                       _intersect(elf->e_bssstart, elf->e_bsslen, page);
+    if (present) framesNeeded++;
+  }
+  // Make room for it, and drop idle images if memory is short
+  while (cachedFrames + framesNeeded > IMAGE_CACHE_MAX_FRAMES &&
+         _evictOne(false)) {
+    continue;
+  }
+  uint32_t* newFrames = smalloc(sizeof(uint32_t) * (framesNeeded + 1));
+  bool gotFrames = newFrames && getUserMemPages(newFrames, framesNeeded);
+  while (newFrames && !gotFrames && _evictOne(true)) {
+    gotFrames = getUserMemPages(newFrames, framesNeeded);
+  }
+  if (!gotFrames) {
+    if (newFrames) sfree(newFrames, sizeof(uint32_t) * (framesNeeded + 1));
+    sfree(img->frames, sizeof(uint32_t) * (img->pageCount + 1));
+    sfree(img->writable, sizeof(bool) * (img->pageCount + 1));
+    sfree(img, sizeof(execImage));
+    return NULL;
+  }
+
+  // No more failure from here
+  if (img->pageCount > 0) {
+    splitLargePageDirectory(pd, STRIP_PD_INDEX(startAddr),
+        STRIP_PD_INDEX(endAddr - 1));
+  }
+  int usedFrames = 0;
+  for (int i = 0; i < img->pageCount; i++) {
+    if (!img->frames[i]) continue;
+    uint32_t page = startAddr + i * PAGE_SIZE;
+    img->frames[i] = newFrames[usedFrames++];
+
+    // Fill the frame through kmap before it's mapped anywhere
+    LocalLockR();
+    char* dst = kmap(KMAP_DST, img->frames[i]);
+    memset(dst, 0, PAGE_SIZE);
+    for (int j = 0; j < 3; j++) {
+      _copySegment(file->execbytes + segOff[j], segStart[j], segLen[j], page,
+          dst);
+    }
+    kunmap(KMAP_DST);
+    LocalUnlockR();
+    _installPage(pd, page, img->frames[i], img->writable[i]);
+
+    // One reference for the cache, one for pd
+    referUserMemPage(img->frames[i]);
+  }
+  assert(usedFrames == framesNeeded);
+  sfree(newFrames, sizeof(uint32_t) * (framesNeeded + 1));
+
+  cachedFrames += framesNeeded;
+  img->frameCount = framesNeeded;
+  img->lastUse = __sync_add_and_fetch(&useClock, 1);
+  img->next = images;
+  images = img;
+  return img;
+}
+
+// Map a cached image to pd
+static void _mapImage(execImage* img, PageDirectory pd) {
+  // Only for LRU, so a racy write by other readers is fine
+  img->lastUse = __sync_add_and_fetch(&useClock, 1);
+  if (img->pageCount > 0) {
+    splitLargePageDirectory(pd, STRIP_PD_INDEX(img->startAddr),
+        STRIP_PD_INDEX(img->startAddr + img->pageCount * PAGE_SIZE - 1));
+  }
+  for (int i = 0; i < img->pageCount; i++) {
+    if (!img->frames[i]) continue;
+    referUserMemPage(img->frames[i]);
+    _installPage(pd, img->startAddr + i * PAGE_SIZE, img->frames[i],
+        img->writable[i]);
+  }
+}
+
+bool mapExecImage(const char* filename, simple_elf_t* elfMetadata,
+    PageDirectory pd, uint32_t* imageStart, uint32_t* imageEnd) {
+  kmutexRLock(&imageLock);
+  execImage* img = _findImage(filename);
+  if (img) {
+    _mapImage(img, pd);
+    kmutexRUnlock(&imageLock);
+  } else {
+    kmutexRUnlock(&imageLock);
+    kmutexWLock(&imageLock);
+    // Someone may have built it when I'm waiting
+    img = _findImage(filename);
+    if (img) {
+      _mapImage(img, pd);
+    } else {
+      img = _buildImage(filename, elfMetadata, pd);
+    }
+    kmutexWUnlock(&imageLock);
+    if (!img) return false;
+  }
+  *imageStart = img->startAddr;
+  *imageEnd = img->startAddr + img->pageCount * PAGE_SIZE;
+  return true;
+}
+
+// Only for debug, so no lock to be used inside LocalLock
+void reportImageCache() {
+  lprintf("├ Executable Image Cache");
+  for (execImage* img = images; img != NULL; img = img->next) {
+    lprintf("│ ├ %s: %d pages from 0x%08lx", img->name, img->pageCount,
+        img->startAddr);
+  }
+  lprintf("│ ├ Evicted Images: %d", evictedImages);
+  lprintf("│ └ Cached User Memory Page: %d (max %d)", cachedFrames,
+      IMAGE_CACHE_MAX_FRAMES);
+}
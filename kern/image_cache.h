@@ -0,0 +1,43 @@
+/** @file image_cache.h
+ *
+ *  @brief Cache of loaded executable images
+ *
+ *  The first exec of a program builds the pages of its text, rodata and data
+ *  segments straight from the RAM disk. The cache keeps one reference to each
+ *  of those frames, and every later exec of the same program just refers to
+ *  them: readonly pages are shared by everyone, and writable pages are mapped
+ *  copy-on-write (see cow.h).
+ *
+ *  Programs in RAM disk never change, so an image never goes stale. But the
+ *  cache holds at most IMAGE_CACHE_MAX_FRAMES frames, beyond which least
+ *  recently used images are evicted, and idle images are dropped when building
+ *  a new one runs out of memory.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <stdint.h>
+#include <elf_410.h>
+
+#include "bool.h"
+#include "vm.h"
+
+// Init code, should be called in bootstrap
+void initImageCache();
+
+// Map the image of filename (whose elf header is elfMetadata) into pd, build
+// and cache the image if it's the first time. pd must be active, and it's okay
+// to have existing mappings in the image range, they are replaced.
+// Pages of the image are [*imageStart, *imageEnd), the bss part inside them
+// are already zero, and the caller should take care of the rest of bss.
+// Return false if out of memory, and some of the pages may have been replaced
+bool mapExecImage(const char* filename, simple_elf_t* elfMetadata,
+    PageDirectory pd, uint32_t* imageStart, uint32_t* imageEnd);
+
+// For debug, report cached images. It's not protected by lock
+void reportImageCache();
+
+#endif
@@ -16,6 +16,7 @@
 #include "bool.h"
 #include "vm.h"
 #include "hv.h"
+#include "region.h"
 
 // Below are the definition of argument package, which is a package to hold
 // the initial argv from exec.
@@ -42,11 +43,14 @@ void printArgPackage(ArgPackage* pkg);
 // To be more concise, it describe the range of stack and range of heap
 // [stackLow, stackHigh] is the stack range
 // [heapLow, heapLow + heapSize) is the heap range (may be zero size)
+// regions is the region tree of the whole user space (see region.h), which is
+// protected by memlock of the process
 typedef struct {
   uint32_t stackHigh;
   uint32_t stackLow;
   uint32_t heapLow;
   uint32_t heapSize;
+  region* regions;
 } ProcessMemoryMeta;
 
 /* --- Prototypes --- */
@@ -66,14 +70,15 @@ int getbytes( const char *filename, int offset, int size, char *buf );
 // The function is good to go as long as CPU own current thread. The process
 // MUST only contains the current thread.
 //
-// The function is idempotent, i.e., it can be called multiple times, with
-// some other pages in the page table. Existing page mappings will be preserved
-// and new mappings will be created if needed
+// Every piece of memory loaded is registered in memMeta->regions, which should
+// be empty on call. On failure, the caller should free both the user space and
+// the regions loaded so far (see freeUserspace)
 //
 // - filename: the file to load
 // - pd: current page directory (the caller must ensure the pd is activated
 //       otherwise the memory is not accessible)
-// - memMeta: if success, memMeta will contain the info for stack and heap
+// - memMeta: if success, memMeta will contain the info for stack and heap,
+//            and regions of the program
 // - eip: if success, eip will be the entry of the program in memory
 // - esp: if success, esp is the current top of stack (with initial parameter
 //       for _main set)
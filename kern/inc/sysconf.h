@@ -15,4 +15,63 @@
 // 3 for shell
 #define INIT_PID 2
 
+// The PID for IDLE process. Its thread only runs when nothing else can
+#define IDLE_PID 1
+
+// MLFQ scheduler (see sched_mlfq.c): number of priority levels, time slice (in
+// timer ticks) of the top level, which doubles on each level below, and the
+// period (in timer ticks) to boost everyone back to top level
+#define MLFQ_LEVELS 4
+#define MLFQ_BASE_QUANTUM 1
+#define MLFQ_BOOST_PERIOD 100
+
+// When defined, idle thread stays in kernel instead of running idle program.
+// When nothing else is runnable, it stretches the timer period to the next
+// timeout and halts the CPU, instead of spinning on every tick
+#define TICKLESS_IDLE
+
+// Number of free user frames cached by each CPU in front of the global free
+// frame stack (see pm.c). Refill and flush move half of it at a time
+#define PM_MAGAZINE_SIZE 64
+
+// Number of zeroed free frames kept for ZFOD upgrade, refilled by idle thread
+// (see pm.c)
+#define PM_ZERO_POOL_SIZE 256
+
+// Max number of frames the executable image cache (see image_cache.c) holds.
+// Least recently used images are evicted beyond that
+#define IMAGE_CACHE_MAX_FRAMES 1024
+
+// Number of free objects cached by each CPU in every slab cache (see slab.h).
+// A new slab carves half of it at a time
+#define SLAB_MAGAZINE_SIZE 16
+
+// Kernel heap (see malloc_wrappers.c): blocks up to MALLOC_ARENA_MAX_SIZE
+// bytes are served by per-CPU size class arenas instead of lmm, and each CPU
+// caches up to MALLOC_ARENA_CACHE_SIZE free blocks of every class
+#define MALLOC_ARENA_MAX_SIZE 2048
+#define MALLOC_ARENA_CACHE_SIZE 32
+
+// Number of pages a TLB batch (see vm.h) invalidates one by one. Beyond that,
+// the batch reloads %cr3 to flush the whole TLB instead
+#define VM_TLB_FLUSH_THRESHOLD 32
+
+// Number of compiled guest page directories (by guest cr3 and mode) cached by
+// each virtual machine (see hv_hpcall_vm.c)
+#define HV_SHADOW_PD_CACHE_SIZE 4
+
+// Max number of virtual CPUs of a virtual machine (see hvlife.h), each run by
+// one host thread
+#define HV_MAX_VCPUS 4
+
+// When defined, a pending delayed virtual interrupt is delivered as soon as the
+// guest enables interrupts (hv_enable_interrupts or hv_iret with IF), instead
+// of waiting for the next own timer tick (see hvinterrupt.h)
+#define HV_BATCHED_INT_DELIVERY
+
+// When defined, new_pages of 4MiB aligned base and length maps them by 4MiB
+// large pages (allocated eagerly, see syscall_memory.c) if possible, instead of
+// ZFOD 4k pages
+#define NEW_PAGES_LARGE_PAGE
+
 #endif
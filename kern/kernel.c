@@ -40,28 +40,67 @@
 #include "timeout.h"
 #include "kernel_stack_protection.h"
 #include "virtual_console.h"
+#include "timer_driver.h"
 
 #include "hv.h"
+#include "image_cache.h"
 
 extern void initMemManagement();
 
 // Dummy timer event, can visualize whether the interrupt is on.
+// tk may leap by more than one when the timer is stretched by tickless idle
 void _tickback(unsigned int tk) {
   KERNEL_STACK_CHECK;
-  onTickEvent();
+  static unsigned int lastTick = 0;
+  onTickEvent(tk - lastTick);
+  lastTick = tk;
   #ifdef CONTEXT_SWTICH_ON_RIGHT_KEY
     if (tk % 1000 == 0) {
       lprintf("tick");
     }
   #else
-    tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+    tcb* currentThread = getRunningThread();
     if (currentThread && !currentThread->descheduling) {
-      yieldToNext();
+      if (tickScheduler(currentThread)) {
+        yieldToNext();
+      }
       hv_CallMeOnTick(&currentThread->process->hyperInfo);
     }
   #endif
 }
 
+#ifdef TICKLESS_IDLE
+// The idle loop, runs in kernel mode. When there's nothing else to run, it
+// first refills the zeroed page pool (see pm.c) one page at a time, then
+// stretches timer to the next timeout deadline and halts until any interrupt.
+// While halting, it's marked descheduling so that interrupts only wake others
+// up instead of switching to them, and switching away always happens here,
+// after the normal timer period is restored.
+static void RunIdle(tcb* idleThread) {
+  while (true) {
+    LocalLockR();
+    if (!onlyIdleInXLX()) {
+      LocalUnlockR();
+      yieldToNext();
+      continue;
+    }
+    if (needZeroedUserMemPages()) {
+      // Nothing else to run, prepare one zeroed page for ZFOD before halting
+      LocalUnlockR();
+      zeroUserMemPage();
+      continue;
+    }
+    idleThread->descheduling = true;
+    setTimerPeriod(ticksToNextTimeout() > MAX_TIMER_PERIOD ?
+        MAX_TIMER_PERIOD : ticksToNextTimeout());
+    LocalUnlockAndHaltR();
+    // Waked up by some interrupt
+    idleThread->descheduling = false;
+    setTimerPeriod(1);
+  }
+}
+#endif
+
 // The init function that runs inside first kernel stack.
 // It is a special entry after swtichTheWorld, so it will do conventional
 // clean-ups (turn on interrupt, disown last thread)
@@ -79,16 +118,21 @@ void RunInit(const char* filename, pcb* firstProc, tcb* firstThread) {
   if (forkProcess(firstThread) == 0) {
     // new thread, Will go into ring3
 
-    tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+    tcb* currentThread = getRunningThread();
 
     // This is INIT thread, assert it
     assert(currentThread->process->id == INIT_PID);
     execProcess(currentThread, filename, NULL);
     panic("RunInit: fail to run the 1st process");
   } else {
-    // parent thread, Will go into ring3
-    tcb* currentThread = findTCB(getLocalCPU()->runningTID);
-    execProcess(currentThread, "idle", NULL);
+    tcb* currentThread = getRunningThread();
+    #ifdef TICKLESS_IDLE
+      // parent thread, stays in kernel as idle
+      RunIdle(currentThread);
+    #else
+      // parent thread, Will go into ring3
+      execProcess(currentThread, "idle", NULL);
+    #endif
     panic("RunInit: fail to run the 1st process");
   }
 }
@@ -137,6 +181,7 @@ int kernel_main(mbinfo_t *mbinfo, int argc, char **argv, char **envp) {
     lprintf("Drivers installed");
 
     claimUserMem();
+    initImageCache();
     enablePaging();
 
     initProcess();
@@ -25,7 +25,7 @@
 #include "cpu.h"
 
 void checkKernelStackOverflow() {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   if (!currentThread) return;
   uint32_t retAddr = (uint32_t)get_esp();
   if (retAddr < currentThread->kernelStackPage ||
@@ -92,7 +92,7 @@ int getcharBlocking(int vcn) {
     assert(vc->i.eventWaiter == NULL);
 
     // okay, it's time to sleep
-    tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+    tcb* currentThread = getRunningThread();
     vc->i.eventWaiter = currentThread;
     vc->i.waitingForAnyChar = true;
     currentThread->descheduling = true;
@@ -144,7 +144,7 @@ int getStringBlocking(int vcn, char* space, int maxlen) {
     assert(vc->i.eventWaiter == NULL);
 
     // okay, it's time to sleep
-    tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+    tcb* currentThread = getRunningThread();
     vc->i.eventWaiter = currentThread;
     vc->i.waitingForAnyChar = false;
     currentThread->descheduling = true;
@@ -190,7 +190,7 @@ void onKeyboardAsync(int ch, int augChar) {
     return;
   }
 
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   #ifdef CONTEXT_SWTICH_ON_RIGHT_KEY
     if (ch == KHE_ARROW_RIGHT) {
       if (currentThread && !currentThread->descheduling) {
@@ -215,7 +215,7 @@ void onKeyboardAsync(int ch, int augChar) {
           &local->owned, THREAD_NOT_OWNED, THREAD_OWNED_BY_THREAD))
         ;
       local->status = THREAD_RUNNABLE;
-      addToXLX(local);
+      addToXLXOnWakeup(local);
       if (currentThread && !currentThread->descheduling) {
         swtichToThread_Prelocked(local);
       } else {
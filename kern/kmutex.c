@@ -87,7 +87,7 @@ void kmutexRLockRecord(kmutex* km, kmutexStatus* status) {
     }
     // put myself into read wait list, then deschedule myself
     waiterLinklist wl;
-    wl.thread = findTCB(getLocalCPU()->runningTID);
+    wl.thread = getRunningThread();
     wl.next = km->readerWL;
     km->readerWL = &wl;
     ((tcb*)wl.thread)->descheduling = true;
@@ -100,7 +100,7 @@ void kmutexRLockRecord(kmutex* km, kmutexStatus* status) {
 }
 
 void kmutexRUnlockRecord(kmutex* km, kmutexStatus* status) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   GlobalLockR(&km->spinMutex);
   if (status) {
     assert(*status == KMUTEX_HAVE_RLOCK);
@@ -155,7 +155,7 @@ void kmutexWLockRecord(kmutex* km, kmutexStatus* status) {
     }
     // put myself into write wait list, then deschedule myself
     waiterLinklist wl;
-    wl.thread = findTCB(getLocalCPU()->runningTID);
+    wl.thread = getRunningThread();
     wl.next = km->writerWL;
     km->writerWL = &wl;
     ((tcb*)wl.thread)->descheduling = true;
@@ -168,7 +168,7 @@ void kmutexWLockRecord(kmutex* km, kmutexStatus* status) {
 }
 
 void kmutexWUnlockRecord(kmutex* km, kmutexStatus* status) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   GlobalLockR(&km->spinMutex);
   if (status) {
     assert(*status == KMUTEX_HAVE_WLOCK);
@@ -22,7 +22,11 @@
 #include "dbgconf.h"
 #include "vm.h"
 #include "pm.h"
+#include "cpu.h"
+#include "cow.h"
 #include "hv.h"
+#include "image_cache.h"
+#include "region.h"
 
 // Only for debug
 void printArgPackage(ArgPackage* pkg) {
@@ -69,23 +73,62 @@ static int cloneMemoryWithPTERange(PageDirectory pd, uint32_t startAddr,
   if (startAddr > endAddr) return 0;
   uint32_t startPageAddr = PE_DECODE_ADDR(startAddr);
   uint32_t endPageAddr = PE_DECODE_ADDR(endAddr);
+
+  // Get all the missing pages in one batch
+  int missingPages = 0;
+  for (uint32_t i = startPageAddr; ; i+=PAGE_SIZE) {
+    if (!searchPTEntryPageDirectory(pd, i)) missingPages++;
+    if (i == endPageAddr) break;
+  }
+  uint32_t* newPages = NULL;
+  // For zero-fill, the first zeroedPages of them needn't memset
+  int zeroedPages = 0;
+  if (missingPages > 0) {
+    newPages = smalloc(sizeof(uint32_t) * missingPages);
+    if (!newPages) return -1;
+    if (sourceStartAddr == 0) {
+      zeroedPages = getZeroedUserMemPages(newPages, missingPages);
+    }
+    if (!getUserMemPages(newPages + zeroedPages, missingPages - zeroedPages)) {
+      // Out of memory! Keep the page table as it is, and return error;
+      freeUserMemPages(newPages, zeroedPages);
+      sfree(newPages, sizeof(uint32_t) * missingPages);
+      return -1;
+    }
+  }
+  int usedPages = 0;
+
   for (uint32_t i = startPageAddr; ; i+=PAGE_SIZE) {
     PTE* pte = searchPTEntryPageDirectory(pd, i);
+    bool preZeroed = false;
     if (!pte) {
-      // The target page does not exist. Find one available page and create
-      // PTE. Also initialize it to all zeros
-      uint32_t newPA = getUserMemPage();
-      if (!newPA) {
-        // Out of memory! Keep the page table as it is, and return error;
-        return -1;
-      }
+      // The target page does not exist. Take one of the pages got above and
+      // create PTE.
+      preZeroed = usedPages < zeroedPages;
+      uint32_t newPA = newPages[usedPages++];
       createMapPageDirectory(pd, i, newPA, true, isWritable);
       pte = searchPTEntryPageDirectory(pd, i);
       assert(pte != NULL);
+    } else {
+      if (!isZFOD(PE_DECODE_ADDR(*pte)) &&
+          (PE_IS_COW(*pte) || isUserMemPageShared(PE_DECODE_ADDR(*pte)))) {
+        // The page is shared with others (forked), get a private one before
+        // writing it
+        if (!breakCOWPage(pte, i)) {
+          // Give back the pages not mapped yet
+          if (newPages) {
+            freeUserMemPages(newPages + usedPages, missingPages - usedPages);
+            sfree(newPages, sizeof(uint32_t) * missingPages);
+          }
+          return -1;
+        }
+      }
+      if (isWritable && !PE_IS_WRITABLE(*pte)) {
+        *pte |= PE_WRITABLE(1);
+        invalidateTLB(i);
+      }
     }
 
-    *pte |= PE_WRITABLE(isWritable);
-
     // The memory range to set in current page is [pgStart, pgEnd]
     uint32_t pgStart = i;
     if (pgStart < startAddr) pgStart = startAddr;
@@ -93,32 +136,47 @@ static int cloneMemoryWithPTERange(PageDirectory pd, uint32_t startAddr,
     if (pgEnd > endAddr) pgEnd = endAddr;
     assert(pgStart <= pgEnd);
 
-    // Temporary allow write
-    PTE savedPTE = *pte;
-    *pte |= PE_WRITABLE(1);
-    invalidateTLB(i);
-
-    if (sourceStartAddr != 0) {
-      // copy contents from source memory
-      memcpy((void*)pgStart,
-             (void*)(pgStart - startAddr + sourceStartAddr),
-             pgEnd - pgStart + 1);
-    } else {
-      // set them all to zero
-      memset((void*)pgStart,
-             0,
-             pgEnd - pgStart + 1);
+    if (sourceStartAddr != 0 || !preZeroed) {
+      // Write the frame through kmap, so the mapping is never touched
+      uint32_t frame = PE_DECODE_ADDR(*pte);
+      if (PE_IS_LARGE(*pte)) frame += i & (LARGE_PAGE_SIZE - 1);
+      LocalLockR();
+      char* page = kmap(KMAP_DST, frame);
+      if (sourceStartAddr != 0) {
+        // copy contents from source memory
+        memcpy(page + (pgStart - i),
+               (void*)(pgStart - startAddr + sourceStartAddr),
+               pgEnd - pgStart + 1);
+      } else {
+        // set them all to zero
+        memset(page + (pgStart - i), 0, pgEnd - pgStart + 1);
+      }
+      kunmap(KMAP_DST);
+      LocalUnlockR();
     }
-    *pte = savedPTE;
-    invalidateTLB(i);
 
     // We must check here instead of for-loop header, for overflow concerns
     if (i == endPageAddr) break;
   }
 
+  assert(usedPages == missingPages);
+  if (newPages) sfree(newPages, sizeof(uint32_t) * missingPages);
   return 0;
 }
 
+// Register [start, end) (rounded to pages) as a region in memMeta, it's okay
+// that end is 0. Nothing is needed if the range is already inside one region,
+// e.g. segments of a virtual machine are inside its guest memory.
+// Return false if it partially overlaps others, or out of memory
+static bool addRegion(ProcessMemoryMeta* memMeta, uint32_t start,
+    uint32_t end, int flags) {
+  uint32_t first = PE_DECODE_ADDR(start);
+  uint32_t last = PE_DECODE_ADDR(end - 1) + (PAGE_SIZE - 1);
+  region* reg = findRegion(memMeta->regions, first);
+  if (reg && reg->last >= last) return true;
+  return insertRegion(&memMeta->regions, first, last, flags) != NULL;
+}
+
 // Set up the initial stack for a new elf so that
 // _main fucntion in crt0.c will have correct view of parameters.
 // argpkg define the argv and caller should dispose it, it can also be NULL,
@@ -180,7 +238,9 @@ int initELFMemory(const char *filename, PageDirectory pd, ArgPackage* argpkg,
   if (fillHyperInfo(&elfMetadata, info)) {
     lprintf("bootstrapping virtual machine...");
     // Allocate the whole virtual memory
-    if (cloneMemoryWithPTERange(pd, GUEST_PHYSICAL_START,
+    if (!addRegion(memMeta, GUEST_PHYSICAL_START,
+                   GUEST_PHYSICAL_START + HYPERVISOR_MEMORY, REGION_GUEST) ||
+        cloneMemoryWithPTERange(pd, GUEST_PHYSICAL_START,
                                 GUEST_PHYSICAL_START + HYPERVISOR_MEMORY,
                                 0,
                                 true) < 0) {
@@ -195,16 +255,35 @@ int initELFMemory(const char *filename, PageDirectory pd, ArgPackage* argpkg,
     printELF(&elfMetadata);
   #endif
 
+  // Normal programs get .text, .data and .rodata from image cache, while virtual
+  // machine has its own copy inside guest memory
+  uint32_t imageStart = 0, imageEnd = 0;
+  if (!info->isHyper) {
+    if (!mapExecImage(filename, &elfMetadata, pd, &imageStart, &imageEnd)) {
+      return -1;
+    }
+    if (imageEnd > imageStart &&
+        !addRegion(memMeta, imageStart, imageEnd, REGION_IMAGE)) {
+      return -1;
+    }
+    #ifdef VERBOSE_PRINT
+      lprintf("Mapped image [0x%08lx, 0x%08lx)", imageStart, imageEnd);
+    #endif
+  }
+
   char* fileContentTmp;
 
   // Init .text
-  if (elfMetadata.e_txtlen > 0) {
+  if (info->isHyper && elfMetadata.e_txtlen > 0) {
     fileContentTmp = smalloc(elfMetadata.e_txtlen);
     assert(
       getbytes(filename, elfMetadata.e_txtoff,
           elfMetadata.e_txtlen, fileContentTmp) == elfMetadata.e_txtlen
     );
-    if (cloneMemoryWithPTERange(pd, elfMetadata.e_txtstart,
+    if (!addRegion(memMeta, elfMetadata.e_txtstart,
+                   elfMetadata.e_txtstart + elfMetadata.e_txtlen,
+                   REGION_IMAGE) ||
+        cloneMemoryWithPTERange(pd, elfMetadata.e_txtstart,
                                 elfMetadata.e_txtstart + elfMetadata.e_txtlen,
                                 (uint32_t)fileContentTmp,
                                 false) < 0) {
@@ -218,13 +297,16 @@ int initELFMemory(const char *filename, PageDirectory pd, ArgPackage* argpkg,
   #endif
 
   // Init .data
-  if (elfMetadata.e_datlen > 0) {
+  if (info->isHyper && elfMetadata.e_datlen > 0) {
     fileContentTmp = smalloc(elfMetadata.e_datlen);
     assert(
       getbytes(filename, elfMetadata.e_datoff,
           elfMetadata.e_datlen, fileContentTmp) == elfMetadata.e_datlen
     );
-    if (cloneMemoryWithPTERange(pd, elfMetadata.e_datstart,
+    if (!addRegion(memMeta, elfMetadata.e_datstart,
+                   elfMetadata.e_datstart + elfMetadata.e_datlen,
+                   REGION_IMAGE) ||
+        cloneMemoryWithPTERange(pd, elfMetadata.e_datstart,
                                 elfMetadata.e_datstart + elfMetadata.e_datlen,
                                 (uint32_t)fileContentTmp,
                                 true) < 0) {
@@ -238,13 +320,16 @@ int initELFMemory(const char *filename, PageDirectory pd, ArgPackage* argpkg,
   }
 
   // Init .rodata
-  if (elfMetadata.e_rodatlen > 0) {
+  if (info->isHyper && elfMetadata.e_rodatlen > 0) {
     fileContentTmp = smalloc(elfMetadata.e_rodatlen);
     assert(
       getbytes(filename, elfMetadata.e_rodatoff,
           elfMetadata.e_rodatlen, fileContentTmp) == elfMetadata.e_rodatlen
     );
-    if (cloneMemoryWithPTERange(pd, elfMetadata.e_rodatstart,
+    if (!addRegion(memMeta, elfMetadata.e_rodatstart,
+                   elfMetadata.e_rodatstart + elfMetadata.e_rodatlen,
+                   REGION_IMAGE) ||
+        cloneMemoryWithPTERange(pd, elfMetadata.e_rodatstart,
                                 elfMetadata.e_rodatstart + elfMetadata.e_rodatlen,
                                 (uint32_t)fileContentTmp,
                                 false) < 0) {
@@ -257,12 +342,26 @@ int initELFMemory(const char *filename, PageDirectory pd, ArgPackage* argpkg,
     #endif
   }
 
-  // Init .bss
+  // Init .bss, the part inside image is already there
   if (elfMetadata.e_bssstart > 0) {
-    if (cloneMemoryWithPTERange(pd, elfMetadata.e_bssstart,
-                                elfMetadata.e_bssstart + elfMetadata.e_bsslen,
+    uint32_t bssStart = elfMetadata.e_bssstart;
+    uint32_t bssEnd = elfMetadata.e_bssstart + elfMetadata.e_bsslen;
+    if (bssStart < imageStart &&
+        (!addRegion(memMeta, bssStart,
+                    bssEnd < imageStart ? bssEnd : imageStart, REGION_BSS) ||
+         cloneMemoryWithPTERange(pd, bssStart,
+                                bssEnd < imageStart ? bssEnd : imageStart,
                                 0,
-                                true) < 0) {
+                                true) < 0)) {
+      return -1;
+    }
+    if (bssEnd > imageEnd &&
+        (!addRegion(memMeta, bssStart > imageEnd ? bssStart : imageEnd,
+                    bssEnd, REGION_BSS) ||
+         cloneMemoryWithPTERange(pd, bssStart > imageEnd ? bssStart : imageEnd,
+                                bssEnd,
+                                0,
+                                true) < 0)) {
       return -1;
     }
     #ifdef VERBOSE_PRINT
@@ -274,7 +373,8 @@ int initELFMemory(const char *filename, PageDirectory pd, ArgPackage* argpkg,
     // Init stack, give it two page
     // the bottom one will hold ArgPackage
     // Since it gets written immediately, we don't use ZFOD here
-    if (cloneMemoryWithPTERange(pd, 0 - (uint32_t)(PAGE_SIZE * 2),
+    if (!addRegion(memMeta, 0 - (uint32_t)(PAGE_SIZE * 2), 0, REGION_STACK) ||
+        cloneMemoryWithPTERange(pd, 0 - (uint32_t)(PAGE_SIZE * 2),
                                 0,    // 0xffffffff + 1
                                 0,
                                 true) < 0) {
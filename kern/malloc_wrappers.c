@@ -5,6 +5,19 @@
  *  CrossCPULock instead of kmutex is used to ensure that since kmutex does not
  *  guarantee interrupt safeness
  *
+ *  Small blocks (no larger than MALLOC_ARENA_MAX_SIZE) don't go to lmm, whose
+ *  first-fit list walk may take long with latch (so interrupts) held. They are
+ *  served by size classes of power of 2 instead. Each class carves whole pages
+ *  from lmm into blocks of its size, and pageClass records which class a page
+ *  belongs to, so any free can tell where its block comes from.
+ *  Each CPU caches free blocks of every class in its own arena, protected by
+ *  LocalLock only. The arena is refilled from/flushed to the global free list
+ *  of the class by half of its capacity in one latch. Pages never go back to
+ *  lmm, so the arena keeps its high-water mark.
+ *
+ *  Aligned allocations always go to lmm, since their callers (e.g. slab.c) may
+ *  give them back piece by piece.
+ *
  *  @author Leiyu Zhao
  */
 
@@ -12,80 +25,298 @@
 #include <malloc.h>
 #include <malloc/malloc_internal.h>
 #include <stdint.h>
+#include <string.h>
+#include <assert.h>
 #include <simics.h>
+#include <x86/asm.h>
+#include <x86/page.h>
 
 #include "cpu.h"
+#include "slab.h"
+#include "common_kern.h"
+#include "sysconf.h"
 
 static CrossCPULock latch;
+// Updated atomically, since arena allocations don't take latch
 static uint32_t kernelMemAlloc;
 
+// Size classes are 16, 32, ..., MALLOC_ARENA_MAX_SIZE bytes
+#define MIN_CLASS_SHIFT 4
+#define CLASS_SIZE(c) (1 << ((c) + MIN_CLASS_SHIFT))
+#define CLASS_COUNT 8
+#if CLASS_SIZE(CLASS_COUNT - 1) != MALLOC_ARENA_MAX_SIZE
+#error "MALLOC_ARENA_MAX_SIZE must be CLASS_SIZE of the last class"
+#endif
+
+// Class (plus 1) of each kernel page, 0 if it's not owned by any class
+static uint8_t pageClass[USER_MEM_START >> PAGE_SHIFT];
+
+// Free blocks are linked by their first word
+typedef struct _freeBlock {
+  struct _freeBlock* next;
+} freeBlock;
+
+typedef struct {
+  int size;
+  freeBlock* head;
+} blockList;
+
+// Per-CPU arena, one list for each class
+typedef struct {
+  blockList lists[CLASS_COUNT];
+} arena;
+
+static arena arenas[CPU_COUNT];
+// Global free lists of each class, and number of pages carved, under latch
+static blockList globalLists[CLASS_COUNT];
+static int classPages[CLASS_COUNT];
+
+// Latency in cycles of allocator calls, by where they are served. The average
+// is taken over a window of recent calls: both window sums are halved when
+// cycles gets large, so that no 64-bit division is needed
+typedef struct {
+  uint32_t calls;
+  uint32_t maxCycles;
+  uint32_t windowCalls;
+  uint32_t windowCycles;
+} latencyCounter;
+
+// Arena counters are per-CPU under LocalLock, lmm ones are under latch
+static latencyCounter arenaLatency[CPU_COUNT];
+static latencyCounter lmmLatency;
+
 void initMemManagement() {
   initCrossCPULock(&latch);
   kernelMemAlloc = 0;
 }
 
+static void _countLatency(latencyCounter* counter, uint64_t start) {
+  uint32_t cycles = (uint32_t)(rdtsc() - start);
+  counter->calls++;
+  if (cycles > counter->maxCycles) counter->maxCycles = cycles;
+  if (counter->windowCycles >= 0x80000000u - cycles) {
+    counter->windowCalls >>= 1;
+    counter->windowCycles >>= 1;
+  }
+  counter->windowCalls++;
+  counter->windowCycles += cycles;
+}
+
+// Class of blocks of size, or -1 if it's too large for arena
+static int _sizeToClass(size_t size) {
+  if (size > MALLOC_ARENA_MAX_SIZE) return -1;
+  int c = 0;
+  while (CLASS_SIZE(c) < size) c++;
+  return c;
+}
+
+// Class of the block, or -1 if it's from lmm
+static int _blockClass(void* buf) {
+  assert((uint32_t)buf < USER_MEM_START);
+  return (int)pageClass[(uint32_t)buf >> PAGE_SHIFT] - 1;
+}
+
+static void _pushBlock(blockList* list, freeBlock* block) {
+  block->next = list->head;
+  list->head = block;
+  list->size++;
+}
+
+static freeBlock* _popBlock(blockList* list) {
+  freeBlock* block = list->head;
+  list->head = block->next;
+  list->size--;
+  return block;
+}
+
+// Must run with latch. Carve a new page into global list of class c. Return
+// false if lmm is out of memory
+static bool _carvePage(int c) {
+  char* page = _smemalign(PAGE_SIZE, PAGE_SIZE);
+  if (!page) return false;
+  pageClass[(uint32_t)page >> PAGE_SHIFT] = c + 1;
+  classPages[c]++;
+  for (int i = 0; i < PAGE_SIZE; i += CLASS_SIZE(c)) {
+    _pushBlock(&globalLists[c], (freeBlock*)(page + i));
+  }
+  return true;
+}
+
+// Get a block of class c from arena, or NULL if out of memory
+static void* _arenaAlloc(int c) {
+  uint64_t start = rdtsc();
+  LocalLockR();
+  int cpuid = getLocalCPU()->id;
+  blockList* list = &arenas[cpuid].lists[c];
+  if (list->size == 0) {
+    GlobalLockR(&latch);
+    for (int i = 0; i < MALLOC_ARENA_CACHE_SIZE / 2; i++) {
+      if (globalLists[c].size == 0 && !_carvePage(c)) break;
+      _pushBlock(list, _popBlock(&globalLists[c]));
+    }
+    GlobalUnlockR(&latch);
+  }
+  void* ret = list->size > 0 ? _popBlock(list) : NULL;
+  _countLatency(&arenaLatency[cpuid], start);
+  LocalUnlockR();
+  return ret;
+}
+
+static void _arenaFree(void* buf, int c) {
+  uint64_t start = rdtsc();
+  LocalLockR();
+  int cpuid = getLocalCPU()->id;
+  blockList* list = &arenas[cpuid].lists[c];
+  if (list->size == MALLOC_ARENA_CACHE_SIZE) {
+    GlobalLockR(&latch);
+    for (int i = 0; i < MALLOC_ARENA_CACHE_SIZE / 2; i++) {
+      _pushBlock(&globalLists[c], _popBlock(list));
+    }
+    GlobalUnlockR(&latch);
+  }
+  _pushBlock(list, buf);
+  _countLatency(&arenaLatency[cpuid], start);
+  LocalUnlockR();
+}
+
 /* safe versions of malloc functions */
 void *malloc(size_t size) {
+  int c = _sizeToClass(size);
+  if (c >= 0) return _arenaAlloc(c);
   GlobalLockR(&latch);
+  uint64_t start = rdtsc();
   void* ret = _malloc(size);
+  _countLatency(&lmmLatency, start);
   GlobalUnlockR(&latch);
   return ret;
 }
 
 void *memalign(size_t alignment, size_t size) {
   GlobalLockR(&latch);
+  uint64_t start = rdtsc();
   void* ret = _memalign(alignment, size);
+  _countLatency(&lmmLatency, start);
   GlobalUnlockR(&latch);
   return ret;
 }
 
 void *calloc(size_t nelt, size_t eltsize) {
-  GlobalLockR(&latch);
-  void* ret = _calloc(nelt, eltsize);
-  GlobalUnlockR(&latch);
+  void* ret = malloc(nelt * eltsize);
+  if (ret) memset(ret, 0, nelt * eltsize);
   return ret;
 }
 
 void *realloc(void *buf, size_t new_size) {
-  GlobalLockR(&latch);
-  void* ret = _realloc(buf, new_size);
-  GlobalUnlockR(&latch);
+  if (!buf) return malloc(new_size);
+  int c = _blockClass(buf);
+  if (c < 0) {
+    GlobalLockR(&latch);
+    uint64_t start = rdtsc();
+    void* ret = _realloc(buf, new_size);
+    _countLatency(&lmmLatency, start);
+    GlobalUnlockR(&latch);
+    return ret;
+  }
+  if (new_size <= CLASS_SIZE(c)) return buf;
+  void* ret = malloc(new_size);
+  if (ret) {
+    memcpy(ret, buf, CLASS_SIZE(c));
+    _arenaFree(buf, c);
+  }
   return ret;
 }
 
 void free(void *buf) {
+  if (!buf) return;
+  int c = _blockClass(buf);
+  if (c >= 0) {
+    _arenaFree(buf, c);
+    return;
+  }
   GlobalLockR(&latch);
+  uint64_t start = rdtsc();
   _free(buf);
+  _countLatency(&lmmLatency, start);
   GlobalUnlockR(&latch);
 }
 
 void *smalloc(size_t size) {
-  GlobalLockR(&latch);
-  void* ret = _smalloc(size);
-  if (ret) kernelMemAlloc += size;
-  GlobalUnlockR(&latch);
+  int c = _sizeToClass(size);
+  void* ret;
+  if (c >= 0) {
+    ret = _arenaAlloc(c);
+  } else {
+    GlobalLockR(&latch);
+    uint64_t start = rdtsc();
+    ret = _smalloc(size);
+    _countLatency(&lmmLatency, start);
+    GlobalUnlockR(&latch);
+  }
+  if (ret) __sync_fetch_and_add(&kernelMemAlloc, size);
   return ret;
 }
 
 void *smemalign(size_t alignment, size_t size) {
   GlobalLockR(&latch);
+  uint64_t start = rdtsc();
   void* ret = _smemalign(alignment, size);
-  if (ret) kernelMemAlloc += size;
+  _countLatency(&lmmLatency, start);
   GlobalUnlockR(&latch);
+  if (ret) __sync_fetch_and_add(&kernelMemAlloc, size);
   return ret;
 }
 
 void sfree(void *buf, size_t size) {
-  GlobalLockR(&latch);
-  _sfree(buf, size);
-  kernelMemAlloc -= size;
-  GlobalUnlockR(&latch);
+  int c = _blockClass(buf);
+  if (c >= 0) {
+    assert(c == _sizeToClass(size));
+    _arenaFree(buf, c);
+  } else {
+    GlobalLockR(&latch);
+    uint64_t start = rdtsc();
+    _sfree(buf, size);
+    _countLatency(&lmmLatency, start);
+    GlobalUnlockR(&latch);
+  }
+  __sync_fetch_and_sub(&kernelMemAlloc, size);
+}
+
+static uint32_t _averageLatency(latencyCounter* counter) {
+  if (counter->windowCalls == 0) return 0;
+  return counter->windowCycles / counter->windowCalls;
 }
 
 // Report still allocated kernel memory. Use it to detect kernel mem leak
 void reportKernelMemAlloc() {
   GlobalLockR(&latch);
   lprintf("├ Kernel Memory Allocator");
-  lprintf("│ └ Bytes allocated: %lu", kernelMemAlloc);
+  // Objects cached by slab caches are counted here as well
+  lprintf("│ ├ Bytes allocated: %lu", kernelMemAlloc);
+
+  // Fragmentation: free memory held by arena can't serve anything else
+  uint32_t arenaBytes = 0, arenaFreeBytes = 0;
+  for (int c = 0; c < CLASS_COUNT; c++) {
+    int freeBlocks = globalLists[c].size;
+    for (int i = 0; i < CPU_COUNT; i++) {
+      freeBlocks += arenas[i].lists[c].size;
+    }
+    arenaBytes += classPages[c] * PAGE_SIZE;
+    arenaFreeBytes += freeBlocks * CLASS_SIZE(c);
+  }
+  uint32_t lmmFreeBytes = lmm_avail(&malloc_lmm, 0);
+  lprintf("│ ├ Arena: %lu pages, %lu bytes free in them",
+      arenaBytes / PAGE_SIZE, arenaFreeBytes);
+  lprintf("│ ├ Heap free: %lu bytes, %lu%% of free memory held by arena",
+      lmmFreeBytes, lmmFreeBytes + arenaFreeBytes == 0 ? 0 :
+      arenaFreeBytes * 100 / (lmmFreeBytes + arenaFreeBytes));
+
+  for (int i = 0; i < CPU_COUNT; i++) {
+    lprintf("│ ├ Arena latency of CPU %d: %lu calls, %lu cycles avg, "
+        "%lu cycles max", i, arenaLatency[i].calls,
+        _averageLatency(&arenaLatency[i]), arenaLatency[i].maxCycles);
+  }
+  lprintf("│ ├ Heap latency: %lu calls, %lu cycles avg, %lu cycles max",
+      lmmLatency.calls, _averageLatency(&lmmLatency), lmmLatency.maxCycles);
+  reportSlabCaches();
   GlobalUnlockR(&latch);
 }
@@ -2,8 +2,27 @@
  *
  *  @brief Physical Memory manager, only for non-kernel space.
  *
- *  All free pages are kept in a stack, and latch serves as a global lock to
- *  protect the data structure
+ *  All free pages are kept in a buddy allocator, and latch serves as a global
+ *  lock to protect the data structure. A free block of order k is 2^k frames
+ *  contiguous and aligned to its size, it's put in the free list of order k,
+ *  and its head frame records k in frameOrder. Freeing a block merges it with
+ *  its buddy as long as the buddy is a free block of the same order.
+ *
+ *  Each page in use also carries a reference count, so that one page can be
+ *  shared among several page directories (copy-on-write fork). The page goes
+ *  back to the buddy allocator when its last reference is dropped.
+ *
+ *  In front of the buddy allocator, each CPU caches a few free frames in its own
+ *  magazine, protected by LocalLock only. Single page get/free mostly hit the
+ *  magazine, and it's refilled from/flushed to the global pool by half of its
+ *  capacity in one latch. Batched get/free take the latch at most once.
+ *
+ *  Besides, a pool of free frames already filled with zero is kept for ZFOD
+ *  upgrade and zero-fill loading, so that they don't need to memset on the
+ *  fault path. Idle thread refills it when there's nothing else to run. Frames
+ *  in the pool are still free: single frame allocations take them once buddy
+ *  allocator runs dry, and they are given back to buddy allocator whenever a
+ *  reservation or contiguous allocation is short of frames.
  *
  *  @author Leiyu Zhao
  */
@@ -21,35 +40,149 @@
 #include "vm.h"
 #include "bool.h"
 #include "cpu.h"
+#include "sysconf.h"
 
 static int physicalFrames;
 static int userPhysicalFrames;
 
-static uint32_t* availableFrameStack;
-static int stackSize;
+// Buddy allocator, all indexed by FRAME_INDEX. freeNext/freePrev link free
+// blocks of the same order by their head frames (-1 for none). frameOrder is
+// the order of the free block headed by that frame, or -1 if it's not a head
+static int* freeNext;
+static int* freePrev;
+static int8_t* frameOrder;
+static int freeListHead[PM_MAX_ORDER + 1];
+static int freeBlocks[PM_MAX_ORDER + 1];
+// Number of free frames in buddy allocator
+static int freeFrames;
 static int reservedSize;
 
+// Reference count of each user frame, indexed by FRAME_INDEX
+static uint32_t* frameRefCount;
+// Number of frames with more than one reference
+static int sharedFrames;
+
+#define FRAME_INDEX(mem) (((mem) - USER_MEM_START) >> PAGE_SHIFT)
+#define FRAME_ADDR(index) (USER_MEM_START + ((uint32_t)(index) << PAGE_SHIFT))
+
 static CrossCPULock latch;
 
+// Per-CPU cache of free frames, frames inside have zero reference
+typedef struct {
+  int size;
+  uint32_t frames[PM_MAGAZINE_SIZE];
+} frameMagazine;
+
+static frameMagazine magazines[CPU_COUNT];
+
+// Pool of zeroed free frames, protected by latch
+static uint32_t zeroedFrames[PM_ZERO_POOL_SIZE];
+static int zeroedSize;
+// Number of pages asked from pool that are served or not
+static int zeroedHits;
+static int zeroedMisses;
+
 static uint32_t ZFODBlock;
 
 bool isZFOD(uint32_t addr) {
   return addr == ZFODBlock;
 }
 
+// Must run with latch.
+static void _insertFreeBlock(int index, int order) {
+  frameOrder[index] = order;
+  freePrev[index] = -1;
+  freeNext[index] = freeListHead[order];
+  if (freeListHead[order] >= 0) freePrev[freeListHead[order]] = index;
+  freeListHead[order] = index;
+  freeBlocks[order]++;
+}
+
+// Must run with latch.
+static void _removeFreeBlock(int index, int order) {
+  assert(frameOrder[index] == order);
+  frameOrder[index] = -1;
+  if (freePrev[index] >= 0) {
+    freeNext[freePrev[index]] = freeNext[index];
+  } else {
+    freeListHead[order] = freeNext[index];
+  }
+  if (freeNext[index] >= 0) freePrev[freeNext[index]] = freePrev[index];
+  freeBlocks[order]--;
+}
+
+// Must run with latch. Take one block of 2^order frames out of buddy allocator,
+// splitting a larger one if needed. Return the head frame index, or -1 if no
+// block is large enough. Reservation is not checked here.
+static int _buddyAlloc(int order) {
+  int current = order;
+  while (current <= PM_MAX_ORDER && freeListHead[current] < 0) current++;
+  if (current > PM_MAX_ORDER) return -1;
+
+  int index = freeListHead[current];
+  _removeFreeBlock(index, current);
+  // Give the upper halves back until the block is as small as asked
+  while (current > order) {
+    current--;
+    _insertFreeBlock(index + (1 << current), current);
+  }
+  freeFrames -= 1 << order;
+  return index;
+}
+
+// Must run with latch. Put the block of 2^order frames back, and merge it with
+// its buddies all the way up
+static void _buddyFree(int index, int order) {
+  freeFrames += 1 << order;
+  while (order < PM_MAX_ORDER) {
+    int buddy = index ^ (1 << order);
+    if (buddy + (1 << order) > userPhysicalFrames ||
+        frameOrder[buddy] != order) {
+      break;
+    }
+    _removeFreeBlock(buddy, order);
+    if (buddy < index) index = buddy;
+    order++;
+  }
+  _insertFreeBlock(index, order);
+}
+
 void claimUserMem() {
   initCrossCPULock(&latch);
   physicalFrames = machine_phys_frames();
   userPhysicalFrames = physicalFrames - USER_MEM_START / PAGE_SIZE;
-  availableFrameStack = smalloc(sizeof(uint32_t) * userPhysicalFrames);
+  freeNext = smalloc(sizeof(int) * userPhysicalFrames);
+  freePrev = smalloc(sizeof(int) * userPhysicalFrames);
+  frameOrder = smalloc(sizeof(int8_t) * userPhysicalFrames);
+  frameRefCount = smalloc(sizeof(uint32_t) * userPhysicalFrames);
+  if (!freeNext || !freePrev || !frameOrder || !frameRefCount) {
+    panic("claimUserMem: no kernel space for frame tracker.");
+  }
+  memset(frameRefCount, 0, sizeof(uint32_t) * userPhysicalFrames);
+  memset(frameOrder, -1, sizeof(int8_t) * userPhysicalFrames);
+  sharedFrames = 0;
 
-  uint32_t basicUserAddr = USER_MEM_START;
-  for (int i=0; i<userPhysicalFrames; i++) {
-    availableFrameStack[i] = basicUserAddr;
-    basicUserAddr += PAGE_SIZE;
+  for (int i = 0; i <= PM_MAX_ORDER; i++) {
+    freeListHead[i] = -1;
+    freeBlocks[i] = 0;
   }
-  stackSize = userPhysicalFrames;
+  freeFrames = 0;
   reservedSize = 0;
+  zeroedSize = 0;
+  zeroedHits = 0;
+  zeroedMisses = 0;
+  // Cut all frames into blocks as large as possible. USER_MEM_START is aligned
+  // to the largest block, so is every block here
+  for (int i = 0; i < userPhysicalFrames; ) {
+    int order = PM_MAX_ORDER;
+    while ((i & ((1 << order) - 1)) != 0 ||
+           i + (1 << order) > userPhysicalFrames) {
+      order--;
+    }
+    _insertFreeBlock(i, order);
+    freeFrames += 1 << order;
+    i += 1 << order;
+  }
 
   ZFODBlock = getUserMemPage();
   assert(ZFODBlock != 0);
@@ -58,27 +191,118 @@ void claimUserMem() {
   lprintf("Claim all user space frames, %d available", userPhysicalFrames);
 }
 
+// Must run with latch. Get at most count single frames from buddy allocator
+// without touching reserved ones, then from zeroed pool if buddy allocator is
+// short. Return the number of frames got
+static int _popGlobal(uint32_t* frames, int count) {
+  int got = count < freeFrames - reservedSize ?
+            count : freeFrames - reservedSize;
+  for (int i = 0; i < got; i++) {
+    frames[i] = FRAME_ADDR(_buddyAlloc(0));
+  }
+  // Zeroed frames are not in freeFrames, so they never back reservation
+  while (got < count && zeroedSize > 0) {
+    frames[got++] = zeroedFrames[--zeroedSize];
+  }
+  return got;
+}
+
+// Must run with latch.
+static void _pushGlobal(const uint32_t* frames, int count) {
+  for (int i = 0; i < count; i++) {
+    _buddyFree(FRAME_INDEX(frames[i]), 0);
+  }
+}
+
+// Must run with LocalLock. Return 0 if both magazine and global stack are empty
+static uint32_t _magazinePop() {
+  frameMagazine* mag = &magazines[getLocalCPU()->id];
+  if (mag->size == 0) {
+    GlobalLockR(&latch);
+    mag->size = _popGlobal(mag->frames, PM_MAGAZINE_SIZE / 2);
+    GlobalUnlockR(&latch);
+    if (mag->size == 0) return 0;
+  }
+  return mag->frames[--mag->size];
+}
+
+// Must run with LocalLock.
+static void _magazinePush(uint32_t mem) {
+  frameMagazine* mag = &magazines[getLocalCPU()->id];
+  if (mag->size == PM_MAGAZINE_SIZE) {
+    mag->size -= PM_MAGAZINE_SIZE / 2;
+    GlobalLockR(&latch);
+    _pushGlobal(mag->frames + mag->size, PM_MAGAZINE_SIZE / 2);
+    GlobalUnlockR(&latch);
+  }
+  mag->frames[mag->size++] = mem;
+}
+
+// Must run with LocalLock and latch. Give all frames cached by current CPU back
+// to global stack, so that they can back ZFOD reservation
+static void _magazineDrain() {
+  frameMagazine* mag = &magazines[getLocalCPU()->id];
+  _pushGlobal(mag->frames, mag->size);
+  mag->size = 0;
+}
+
+// Must run with latch. Give all zeroed frames back to buddy allocator
+static void _zeroedPoolDrain() {
+  _pushGlobal(zeroedFrames, zeroedSize);
+  zeroedSize = 0;
+}
+
 uint32_t getUserMemPageZFOD() {
+  return getUserMemPagesZFOD(1);
+}
+
+uint32_t getUserMemPagesZFOD(int count) {
+  assert(count > 0);
+  LocalLockR();
   GlobalLockR(&latch);
-  if (stackSize == reservedSize) {
+  if (freeFrames - reservedSize < count) {
+    // Reservation is backed by global pool only, take cached frames back
+    _magazineDrain();
+    _zeroedPoolDrain();
+  }
+  if (freeFrames - reservedSize < count) {
     GlobalUnlockR(&latch);
+    LocalUnlockR();
     return 0;
   }
-  reservedSize++;
+  reservedSize += count;
   GlobalUnlockR(&latch);
+  LocalUnlockR();
   return ZFODBlock;
 }
 
-uint32_t upgradeUserMemPageZFOD(uint32_t mem) {
+void freeUserMemPagesZFOD(int count) {
+  if (count == 0) return;
+  GlobalLockR(&latch);
+  assert(reservedSize >= count);
+  reservedSize -= count;
+  GlobalUnlockR(&latch);
+}
+
+uint32_t upgradeUserMemPageZFOD(uint32_t mem, bool* zeroed) {
   // There must be at lease one reserved for me!
   GlobalLockR(&latch);
   assert(reservedSize > 0);
-  uint32_t res = availableFrameStack[--reservedSize];
-  // Put swap it with the stack top, so that the stack top can be valid, and
-  // upgraded block gets outside stack
-
-  availableFrameStack[reservedSize] = availableFrameStack[--stackSize];
-  availableFrameStack[stackSize] = res;
+  reservedSize--;
+  uint32_t res;
+  if (zeroedSize > 0) {
+    res = zeroedFrames[--zeroedSize];
+    zeroedHits++;
+    *zeroed = true;
+  } else {
+    int index = _buddyAlloc(0);
+    // Reservation guarantees a free frame
+    assert(index >= 0);
+    res = FRAME_ADDR(index);
+    zeroedMisses++;
+    *zeroed = false;
+  }
+  frameRefCount[FRAME_INDEX(res)] = 1;
 
   GlobalUnlockR(&latch);
   return res;
@@ -86,34 +310,199 @@ uint32_t upgradeUserMemPageZFOD(uint32_t mem) {
 
 // zero for out-of-memory
 uint32_t getUserMemPage() {
-  GlobalLockR(&latch);
-  if (stackSize == reservedSize) {
+  LocalLockR();
+  uint32_t res = _magazinePop();
+  // Nobody else knows the frame yet, no need for latch
+  if (res) frameRefCount[FRAME_INDEX(res)] = 1;
+  LocalUnlockR();
+  return res;
+}
+
+bool getUserMemPages(uint32_t* frames, int count) {
+  assert(count >= 0);
+  LocalLockR();
+  frameMagazine* mag = &magazines[getLocalCPU()->id];
+  int got = 0;
+  while (got < count && mag->size > 0) {
+    frames[got++] = mag->frames[--mag->size];
+  }
+  if (got < count) {
+    GlobalLockR(&latch);
+    int popped = _popGlobal(frames + got, count - got);
+    if (got + popped < count) {
+      // All or nothing
+      _pushGlobal(frames, got + popped);
+      GlobalUnlockR(&latch);
+      LocalUnlockR();
+      return false;
+    }
     GlobalUnlockR(&latch);
+  }
+  for (int i = 0; i < count; i++) {
+    frameRefCount[FRAME_INDEX(frames[i])] = 1;
+  }
+  LocalUnlockR();
+  return true;
+}
+
+uint32_t getUserMemPagesContiguous(int order) {
+  assert(order >= 0 && order <= PM_MAX_ORDER);
+  LocalLockR();
+  GlobalLockR(&latch);
+  int index = -1;
+  if (freeFrames - reservedSize >= (1 << order)) {
+    index = _buddyAlloc(order);
+    if (index < 0) {
+      // Frames cached in magazine or zeroed pool may complete a block, try
+      // again
+      _magazineDrain();
+      _zeroedPoolDrain();
+      index = _buddyAlloc(order);
+    }
+  }
+  GlobalUnlockR(&latch);
+  if (index < 0) {
+    LocalUnlockR();
     return 0;
   }
-  uint32_t res = availableFrameStack[--stackSize];
+  for (int i = 0; i < (1 << order); i++) {
+    frameRefCount[index + i] = 1;
+  }
+  LocalUnlockR();
+  return FRAME_ADDR(index);
+}
+
+int getZeroedUserMemPages(uint32_t* frames, int count) {
+  assert(count >= 0);
+  GlobalLockR(&latch);
+  int got = count < zeroedSize ? count : zeroedSize;
+  for (int i = 0; i < got; i++) {
+    frames[i] = zeroedFrames[--zeroedSize];
+    frameRefCount[FRAME_INDEX(frames[i])] = 1;
+  }
+  zeroedHits += got;
+  zeroedMisses += count - got;
   GlobalUnlockR(&latch);
-  return res;
+  return got;
 }
 
-void freeUserMemPage(uint32_t mem) {
-  assert(IS_PAGE_ALIGNED(mem));
+bool needZeroedUserMemPages() {
+  // Just a hint, no latch
+  return zeroedSize < PM_ZERO_POOL_SIZE && freeFrames - reservedSize > 0;
+}
+
+bool zeroUserMemPage() {
+  uint32_t frame;
   GlobalLockR(&latch);
-  if (ZFODBlock == mem) {
-    // return a ZFOD blocked, just de-reserve
-    assert(reservedSize > 0);
-    reservedSize--;
+  // Only from buddy allocator, not the pool itself
+  if (zeroedSize >= PM_ZERO_POOL_SIZE || freeFrames - reservedSize <= 0 ||
+      _popGlobal(&frame, 1) == 0) {
+    GlobalUnlockR(&latch);
+    return false;
+  }
+  GlobalUnlockR(&latch);
+
+  // Zero it without the latch, so others allocate as usual
+  LocalLockR();
+  memset(kmap(KMAP_DST, frame), 0, PAGE_SIZE);
+  kunmap(KMAP_DST);
+  LocalUnlockR();
+
+  GlobalLockR(&latch);
+  if (zeroedSize < PM_ZERO_POOL_SIZE) {
+    zeroedFrames[zeroedSize++] = frame;
   } else {
-    availableFrameStack[stackSize++] = mem;
+    _pushGlobal(&frame, 1);
+  }
+  GlobalUnlockR(&latch);
+  return true;
+}
+
+void referUserMemPage(uint32_t mem) {
+  assert(IS_PAGE_ALIGNED(mem));
+  // ZFOD block is shared by nature, it's referred by reservation instead
+  assert(mem != ZFODBlock);
+  GlobalLockR(&latch);
+  assert(frameRefCount[FRAME_INDEX(mem)] > 0);
+  if (++frameRefCount[FRAME_INDEX(mem)] == 2) {
+    sharedFrames++;
   }
   GlobalUnlockR(&latch);
 }
 
+bool isUserMemPageShared(uint32_t mem) {
+  if (mem == ZFODBlock) return true;
+  GlobalLockR(&latch);
+  bool res = frameRefCount[FRAME_INDEX(mem)] > 1;
+  GlobalUnlockR(&latch);
+  return res;
+}
+
+void freeUserMemPage(uint32_t mem) {
+  freeUserMemPages(&mem, 1);
+}
+
+void freeUserMemPages(const uint32_t* frames, int count) {
+  bool latched = false;
+  LocalLockR();
+  for (int i = 0; i < count; i++) {
+    uint32_t mem = frames[i];
+    assert(IS_PAGE_ALIGNED(mem));
+    uint32_t* refCount = &frameRefCount[FRAME_INDEX(mem)];
+    if (ZFODBlock == mem) {
+      // return a ZFOD blocked, just de-reserve
+      if (!latched) GlobalLockR(&latch);
+      latched = true;
+      assert(reservedSize > 0);
+      reservedSize--;
+    } else if (*refCount == 1) {
+      // The only reference is the caller's, nobody else can refer it
+      // concurrently, so no need for latch
+      *refCount = 0;
+      _magazinePush(mem);
+    } else {
+      if (!latched) GlobalLockR(&latch);
+      latched = true;
+      assert(*refCount > 0);
+      (*refCount)--;
+      if (*refCount == 1) {
+        sharedFrames--;
+      } else if (*refCount == 0) {
+        // The other reference is dropped after we check
+        _magazinePush(mem);
+      }
+    }
+  }
+  if (latched) GlobalUnlockR(&latch);
+  LocalUnlockR();
+}
+
 void reportUserMem() {
   GlobalLockR(&latch);
+  int cached = 0;
+  for (int i = 0; i < CPU_COUNT; i++) {
+    cached += magazines[i].size;
+  }
   lprintf("├ Physical Memory Tracker");
   lprintf("│ ├ Total User Memory Page: %d", userPhysicalFrames);
   lprintf("│ ├ ZFOD User Memory Page: %d", reservedSize);
-  lprintf("│ └ Available User Memory Page: %d", stackSize - reservedSize);
+  lprintf("│ ├ Shared User Memory Page: %d", sharedFrames);
+  lprintf("│ ├ Cached User Memory Page: %d", cached);
+  lprintf("│ ├ Zeroed User Memory Page: %d (hit %d, miss %d)", zeroedSize,
+      zeroedHits, zeroedMisses);
+  lprintf("│ ├ Available User Memory Page: %d",
+      freeFrames - reservedSize + cached + zeroedSize);
+  // Fragmentation: how much free memory sits outside the largest free block
+  int largest = PM_MAX_ORDER;
+  while (largest >= 0 && freeBlocks[largest] == 0) largest--;
+  int largestFrames = largest >= 0 ? (1 << largest) : 0;
+  lprintf("│ ├ Largest Free Block: %d pages", largestFrames);
+  lprintf("│ ├ Fragmentation: %d%%", freeFrames == 0 ? 0 :
+      100 - largestFrames * 100 / freeFrames);
+  lprintf("│ └ Free Blocks");
+  for (int i = 0; i <= PM_MAX_ORDER; i++) {
+    lprintf("│   %s Order %d (%d pages): %d", i == PM_MAX_ORDER ? "└" : "├",
+        i, 1 << i, freeBlocks[i]);
+  }
   GlobalUnlockR(&latch);
 }
@@ -25,24 +25,78 @@ void claimUserMem();
 // or 0 if there's no free space available
 uint32_t getUserMemPage();
 
+// Batched getUserMemPage, fill frames with count pages in one locked
+// operation. All or nothing: return false and get nothing if there's no enough
+// free space
+bool getUserMemPages(uint32_t* frames, int count);
+
 // similar to getUserMemPage, but the caller should know that this is a fake
 // shared page with all contents equal to zero. Caller should register this as
 // a readonly page, and ask for upgrade when anyone wants to write it.
 uint32_t getUserMemPageZFOD();
 
+// Largest order of contiguous pages, 2^10 pages = 4MiB
+#define PM_MAX_ORDER 10
+
+// Get 2^order physically contiguous pages, aligned to their total size. Return
+// the start address of the first one, or 0 if there's no such free block.
+// Each of them is referred on its own, i.e. it's the same as getting them one
+// by one, and they should be freed one by one
+uint32_t getUserMemPagesContiguous(int order);
+
+// Batched getUserMemPageZFOD, reserve count ZFOD pages at once. All or nothing.
+// Return the ZFOD page (the same for all of them), or 0 if out of memory. Each
+// of them should be upgraded or freed on its own
+uint32_t getUserMemPagesZFOD(int count);
+
+// Give back count ZFOD reservations that are never mapped to any page, the
+// same as freeing the ZFOD page count times
+void freeUserMemPagesZFOD(int count);
+
 // Given a physical page that's returned by getUserMemPageZFOD(), return a
-// real page that's dedicated and all-zero'd. Caller should replace the old page
-// with the new one in page table.
+// real page that's dedicated. Caller should replace the old page with the new
+// one in page table, and fill it with zero unless *zeroed is set (it comes from
+// zeroed pool).
 // Upgrade never fail.
-uint32_t upgradeUserMemPageZFOD(uint32_t mem);
+uint32_t upgradeUserMemPageZFOD(uint32_t mem, bool* zeroed);
+
+// Take at most count pages from zeroed pool, the same as getUserMemPage but
+// all of them are already zero. Return the number of pages got
+int getZeroedUserMemPages(uint32_t* frames, int count);
+
+// Whether zeroed pool wants more pages. Only a hint
+bool needZeroedUserMemPages();
+
+// Zero one free page and put it in zeroed pool. Return false if the pool is
+// full or there's no free page.
+// Meant for idle thread, the page is zeroed through kmap
+bool zeroUserMemPage();
 
 // return true if the current phyisical address is ZFOD'd that's not upgraded
 bool isZFOD(uint32_t addr);
 
+// Take one more reference of a page got by getUserMemPage, so that it can be
+// mapped by several page directories at the same time (e.g. copy-on-write).
+// Every reference should be dropped by its own freeUserMemPage
+void referUserMemPage(uint32_t mem);
+
+// return true if the physical page is referred by more than one mapping, so
+// that it must be copied before anyone writes it
+bool isUserMemPageShared(uint32_t mem);
+
 // Free one user page that is previously got by calling getUserMemPage or
 // getUserMemPageZFOD. After that you cannot use the page anymore
+// For a shared page, it only drops one reference, and the page goes back to
+// free pool when the last reference is dropped
 void freeUserMemPage(uint32_t mem);
 
+// Batched freeUserMemPage, free count pages in one locked operation
+void freeUserMemPages(const uint32_t* frames, int count);
+
+// Suggested number of frames for callers to collect on stack before calling
+// freeUserMemPages
+#define PM_FREE_BATCH 32
+
 // Report user space usage, use this to detect memory leak
 void reportUserMem();
 
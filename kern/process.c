@@ -20,142 +20,196 @@
 #include "bool.h"
 #include "vm.h"
 #include "cpu.h"
+#include "slab.h"
 #include "dbgconf.h"
 
-static pcb* pcbList;
-static tcb* tcbList;
+// PCB and TCB are indexed by id in two chained hash tables. Since ids are
+// allocated sequentially, masking the id spreads them evenly across buckets,
+// so each lookup only walks a chain of (#alive / #bucket) entries.
+// The bucket count must be power of 2
+#define PCB_HASH_BUCKETS 1024
+#define TCB_HASH_BUCKETS 4096
+
+// Each bucket has its own lock, which protects the chain and the ephemeral
+// access fields of everything in it. So lookups never take latch, and only
+// contend with those hashed to the same bucket.
+// Lock order: latch (if needed) before bucket lock
+typedef struct {
+  pcb* head;
+  CrossCPULock lock;
+} pcbBucket;
+
+typedef struct {
+  tcb* head;
+  CrossCPULock lock;
+} tcbBucket;
+
+#define PCB_BUCKET(pid) (&pcbTable[(pid) & (PCB_HASH_BUCKETS - 1)])
+#define TCB_BUCKET(tid) (&tcbTable[(tid) & (TCB_HASH_BUCKETS - 1)])
+
+static pcbBucket pcbTable[PCB_HASH_BUCKETS];
+static tcbBucket tcbTable[TCB_HASH_BUCKETS];
+// Updated atomically
 static int pidNext;
 static int tidNext;
 
+// Protects the scheduling class
 static CrossCPULock latch;
 
+// TCB, PCB and kernel stacks come and go with every thread, so they are cached
+// by type (see slab.h)
+static slabCache pcbCache;
+static slabCache tcbCache;
+static slabCache kernelStackCache;
+
+// Must run with the bucket lock of pid
 static pcb** _findPCB(int pid) {
-  GlobalLockR(&latch);
   pcb** ptr;
-  for (ptr = &pcbList; *ptr != NULL; ptr = &(*ptr)->next ) {
+  for (ptr = &PCB_BUCKET(pid)->head; *ptr != NULL; ptr = &(*ptr)->next ) {
     if ((*ptr)->id == pid) break;
   }
-  GlobalUnlockR(&latch);
   return ptr;
 }
 
 pcb* findPCB(int pid) {
-  GlobalLockR(&latch);
+  pcbBucket* bucket = PCB_BUCKET(pid);
+  GlobalLockR(&bucket->lock);
   pcb* ret = *_findPCB(pid);
-  GlobalUnlockR(&latch);
+  GlobalUnlockR(&bucket->lock);
   return ret;
 }
 
+// Must run with the bucket lock of proc, which is released here
 static void _removePCB(pcb* proc) {
+  pcbBucket* bucket = PCB_BUCKET(proc->id);
   pcb** ptrToProcToDelete = _findPCB(proc->id);
   assert(*ptrToProcToDelete != NULL); // Must find it
   #ifdef VERBOSE_PRINT
   lprintf("Removing process #%d", proc->id);
   #endif
   *ptrToProcToDelete = proc->next;
+  GlobalUnlockR(&bucket->lock);
   // Goodbye, my process
-  sfree(proc, sizeof(pcb));
+  slabFree(&pcbCache, proc);
 }
 
 void removePCB(pcb* proc) {
-  GlobalLockR(&latch);
+  pcbBucket* bucket = PCB_BUCKET(proc->id);
+  GlobalLockR(&bucket->lock);
   proc->_hasAbandoned = true;
   if (proc->_ephemeralRefCount == 0) {
     _removePCB(proc);
+    return;
   }
-  GlobalUnlockR(&latch);
+  GlobalUnlockR(&bucket->lock);
 }
 
 pcb* findPCBWithEphemeralAccess(int pid) {
-  GlobalLockR(&latch);
-  pcb* ret = findPCB(pid);
+  pcbBucket* bucket = PCB_BUCKET(pid);
+  GlobalLockR(&bucket->lock);
+  pcb* ret = *_findPCB(pid);
   if (ret) ret->_ephemeralRefCount++;
-  GlobalUnlockR(&latch);
+  GlobalUnlockR(&bucket->lock);
   return ret;
 }
 
 void releaseEphemeralAccessProcess(pcb* proc) {
-  GlobalLockR(&latch);
+  pcbBucket* bucket = PCB_BUCKET(proc->id);
+  GlobalLockR(&bucket->lock);
   assert(proc->_ephemeralRefCount > 0);
   proc->_ephemeralRefCount--;
   if (proc->_ephemeralRefCount == 0 && proc->_hasAbandoned) {
     _removePCB(proc);
+    return;
   }
-  GlobalUnlockR(&latch);
+  GlobalUnlockR(&bucket->lock);
 }
 
 pcb* newPCB() {
-  GlobalLockR(&latch);
-  pcb* npcb = (pcb*)smalloc(sizeof(pcb));
+  pcb* npcb = (pcb*)slabAlloc(&pcbCache);
   if (!npcb) {
     panic("newPCB: fail to get space for new PCB.");
   }
-  npcb->id = pidNext++;
-  npcb->next = pcbList;
-  pcbList = npcb;
-
+  npcb->id = __sync_fetch_and_add(&pidNext, 1);
   npcb->_ephemeralRefCount = 0;
   npcb->_hasAbandoned = false;
-  GlobalUnlockR(&latch);
+
+  pcbBucket* bucket = PCB_BUCKET(npcb->id);
+  GlobalLockR(&bucket->lock);
+  npcb->next = bucket->head;
+  bucket->head = npcb;
+  GlobalUnlockR(&bucket->lock);
   return npcb;
 }
 
 /*****************************************************************************/
 
-static dualLinklist xlx;  // express links
+// Scheduling class that manages XLX (express links)
+static schedClass* sched = &mlfqSchedClass;
 
+// Must run with the bucket lock of tid
 static tcb** _findTCB(int tid) {
-  GlobalLockR(&latch);
   tcb** ptr;
-  for (ptr = &tcbList; *ptr != NULL; ptr = &(*ptr)->next ) {
+  for (ptr = &TCB_BUCKET(tid)->head; *ptr != NULL; ptr = &(*ptr)->next ) {
     if ((*ptr)->id == tid) break;
   }
-  GlobalUnlockR(&latch);
   return ptr;
 }
 
 tcb* findTCB(int tid) {
-  GlobalLockR(&latch);
+  tcbBucket* bucket = TCB_BUCKET(tid);
+  GlobalLockR(&bucket->lock);
   tcb* ret = *_findTCB(tid);
-  GlobalUnlockR(&latch);
+  GlobalUnlockR(&bucket->lock);
   return ret;
 }
 
 tcb* findTCBWithEphemeralAccess(int tid) {
-  GlobalLockR(&latch);
-  tcb* ret = findTCB(tid);
+  tcbBucket* bucket = TCB_BUCKET(tid);
+  GlobalLockR(&bucket->lock);
+  tcb* ret = *_findTCB(tid);
   if (ret) ret->_ephemeralRefCount++;
-  GlobalUnlockR(&latch);
+  GlobalUnlockR(&bucket->lock);
   return ret;
 }
 
 tcb* newTCB() {
-  GlobalLockR(&latch);
-  tcb* ntcb = (tcb*)smalloc(sizeof(tcb));
+  tcb* ntcb = (tcb*)slabAlloc(&tcbCache);
   if (!ntcb) {
     panic("newTCB: fail to get space for new TCB.");
   }
   ntcb->owned = THREAD_NOT_OWNED;
   ntcb->status = THREAD_UNINITIALIZED;
-  ntcb->id = tidNext++;
-  ntcb->next = tcbList;
-  tcbList = ntcb;
-
+  ntcb->id = __sync_fetch_and_add(&tidNext, 1);
   ntcb->_ephemeralRefCount = 0;
   ntcb->_hasAbandoned = false;
   ntcb->_xlx.next = ntcb->_xlx.prev = NULL;
   ntcb->_xlx.data = ntcb;
+  GlobalLockR(&latch);
+  sched->initThread(ntcb);
   GlobalUnlockR(&latch);
+
+  tcbBucket* bucket = TCB_BUCKET(ntcb->id);
+  GlobalLockR(&bucket->lock);
+  ntcb->next = bucket->head;
+  bucket->head = ntcb;
+  GlobalUnlockR(&bucket->lock);
   return ntcb;
 }
 
+tcb* getRunningThread() {
+  return getLocalCPU()->runningThread;
+}
+
+pcb* getRunningProcess() {
+  return getLocalCPU()->runningProcess;
+}
+
 void removeFromXLX(tcb* thread) {
   GlobalLockR(&latch);
   assert(thread->_xlx.next != NULL);
   assert(thread->_xlx.prev != NULL);
-  thread->_xlx.next->prev = thread->_xlx.prev;
-  thread->_xlx.prev->next = thread->_xlx.next;
-  thread->_xlx.next = thread->_xlx.prev = NULL;
+  sched->dequeue(thread);
   GlobalUnlockR(&latch);
 }
 
@@ -163,61 +217,68 @@ void addToXLX(tcb* thread) {
   GlobalLockR(&latch);
   assert(thread->_xlx.next == NULL);
   assert(thread->_xlx.prev == NULL);
-  thread->_xlx.next = xlx.next;
-  thread->_xlx.prev = &xlx;
-  thread->_xlx.next->prev = &thread->_xlx;
-  thread->_xlx.prev->next = &thread->_xlx;
+  sched->enqueue(thread, false);
   GlobalUnlockR(&latch);
 }
 
-tcb* dequeueXLX() {
+void addToXLXOnWakeup(tcb* thread) {
   GlobalLockR(&latch);
-  dualLinklist* last = xlx.prev;
-  if (last == &xlx) {
-    GlobalUnlockR(&latch);
-    return NULL;
-  }
-  assert(last->data != NULL);
-  tcb* t = (tcb*)last->data;
-  removeFromXLX(t);
+  assert(thread->_xlx.next == NULL);
+  assert(thread->_xlx.prev == NULL);
+  sched->enqueue(thread, true);
   GlobalUnlockR(&latch);
-  return t;
 }
 
-tcb* roundRobinNextTCBWithEphemeralAccess(tcb* thread,
+tcb* nextTCBWithEphemeralAccess(tcb* current, tcb* former,
     bool needToReleaseFormer) {
   GlobalLockR(&latch);
-  tcb* retTCB = thread;
-  while (retTCB == thread) {
-    if (retTCB->_xlx.prev == &xlx && retTCB->_xlx.next == &xlx) {
-      // retTCB is the only runnable. return it
-      break;
-    }
-    // refind one
-    retTCB = roundRobinNextTCB(retTCB);
-    if (retTCB == NULL) {
-      GlobalUnlockR(&latch);
-      return thread;
-    }
-  }
-  if (retTCB != thread) {
+  tcb* retTCB = sched->next(current, former);
+  if (retTCB != current) {
     // ephemeral refer to this thread
+    tcbBucket* bucket = TCB_BUCKET(retTCB->id);
+    GlobalLockR(&bucket->lock);
     retTCB->_ephemeralRefCount++;
-    if (needToReleaseFormer) {
-      releaseEphemeralAccess(thread);
-    }
+    GlobalUnlockR(&bucket->lock);
+  }
+  if (needToReleaseFormer) {
+    releaseEphemeralAccess(former);
   }
   GlobalUnlockR(&latch);
   return retTCB;
 }
 
-// Must work with latch aquired
+void pickedNextTCB(tcb* thread) {
+  GlobalLockR(&latch);
+  if (thread->_xlx.next) {
+    sched->picked(thread);
+  }
+  GlobalUnlockR(&latch);
+}
+
+bool tickScheduler(tcb* current) {
+  GlobalLockR(&latch);
+  bool ret = sched->tick(current);
+  GlobalUnlockR(&latch);
+  return ret;
+}
+
+bool onlyIdleInXLX() {
+  GlobalLockR(&latch);
+  bool ret = sched->onlyIdle();
+  GlobalUnlockR(&latch);
+  return ret;
+}
+
+// Must work with latch and the bucket lock of thread aquired, the latter is
+// released here
 // Process module is not responsible for freeing kernel stack, relevant process
 // etc. Refer to Zeus for those jobs
 static void _removeTCB(tcb* thread) {
+  tcbBucket* bucket = TCB_BUCKET(thread->id);
   tcb** ptrToThreadToDelete = _findTCB(thread->id);
   assert(*ptrToThreadToDelete != NULL); // Must find it
   *ptrToThreadToDelete = thread->next;
+  GlobalUnlockR(&bucket->lock);
 
   if (thread->_xlx.next) {
     removeFromXLX(thread);
@@ -226,44 +287,61 @@ static void _removeTCB(tcb* thread) {
   lprintf("Removing thread #%d", thread->id);
   #endif
   // Goodbye, my thread
-  sfree(thread, sizeof(tcb));
+  slabFree(&tcbCache, thread);
 }
 
+uint32_t newKernelStack() {
+  return (uint32_t)slabAlloc(&kernelStackCache);
+}
+
+void freeKernelStack(uint32_t stack) {
+  slabFree(&kernelStackCache, (void*)stack);
+}
+
+// Latch is taken first, since removing it may take it off XLX
 void releaseEphemeralAccess(tcb* thread) {
+  tcbBucket* bucket = TCB_BUCKET(thread->id);
   GlobalLockR(&latch);
+  GlobalLockR(&bucket->lock);
   assert(thread->_ephemeralRefCount > 0);
   thread->_ephemeralRefCount--;
   if (thread->_ephemeralRefCount == 0 && thread->_hasAbandoned) {
     _removeTCB(thread);
+  } else {
+    GlobalUnlockR(&bucket->lock);
   }
   GlobalUnlockR(&latch);
 }
 
 void removeTCB(tcb* thread) {
+  tcbBucket* bucket = TCB_BUCKET(thread->id);
   GlobalLockR(&latch);
+  GlobalLockR(&bucket->lock);
   thread->_hasAbandoned = true;
   if (thread->_ephemeralRefCount == 0) {
     _removeTCB(thread);
+  } else {
+    GlobalUnlockR(&bucket->lock);
   }
   GlobalUnlockR(&latch);
 }
 
-tcb* roundRobinNextTCB(tcb* thread) {
-  GlobalLockR(&latch);
-  thread = dequeueXLX();
-  assert(thread != NULL);  // must have at least one runnable (i.e. idle)
-  addToXLX(thread);
-  GlobalUnlockR(&latch);
-  return thread;
-}
-
 void initProcess() {
   initCrossCPULock(&latch);
-  pcbList = NULL;
-  tcbList = NULL;
+  for (int i = 0; i < PCB_HASH_BUCKETS; i++) {
+    pcbTable[i].head = NULL;
+    initCrossCPULock(&pcbTable[i].lock);
+  }
+  for (int i = 0; i < TCB_HASH_BUCKETS; i++) {
+    tcbTable[i].head = NULL;
+    initCrossCPULock(&tcbTable[i].lock);
+  }
   pidNext = tidNext = 1;
+  initSlabCache(&pcbCache, "PCB", sizeof(pcb), 0, NULL);
+  initSlabCache(&tcbCache, "TCB", sizeof(tcb), 0, NULL);
+  initSlabCache(&kernelStackCache, "Kernel Stack", PAGE_SIZE, PAGE_SIZE, NULL);
 
-  xlx.prev = xlx.next = &xlx;
+  sched->init();
 }
 
 /*****************************************************************************/
@@ -291,37 +369,62 @@ void reportProcessAndThread() {
   GlobalLockR(&latch);
     lprintf("├ Process List");
   int totCount = 0;
-  for (pcb* proc = pcbList; proc != NULL; proc = proc->next ) {
-    totCount++;
-    lprintf("│ ├ [%4d <- %4d] (%s) fTID:%d, nThr:%d, wCh:%d %s",
-                        proc->id,
-                        proc->parentPID,
-                        ProcessStatusToString(proc->status),
-                        proc->firstTID,
-                        proc->numThread,
-                        proc->unwaitedChildProc,
-                        proc->hyperInfo.isHyper ? "(VirtualMachine)" : "");
+  for (int i = 0; i < PCB_HASH_BUCKETS; i++) {
+    GlobalLockR(&pcbTable[i].lock);
+    for (pcb* proc = pcbTable[i].head; proc != NULL; proc = proc->next ) {
+      totCount++;
+      lprintf("│ ├ [%4d <- %4d] (%s) fTID:%d, nThr:%d, wCh:%d %s",
+                          proc->id,
+                          proc->parentPID,
+                          ProcessStatusToString(proc->status),
+                          proc->firstTID,
+                          proc->numThread,
+                          proc->unwaitedChildProc,
+                          proc->hyperInfo.isHyper ? "(VirtualMachine)" : "");
+      HyperInfo* info = &proc->hyperInfo;
+      if (info->isHyper && HYPER_STATUS_READY(info->status)) {
+        uint32_t hits = 0, verified = 0, misses = 0, compiled = 0;
+        uint32_t protectFaults = 0;
+        for (int j = 0; j < info->vcpuCount; j++) {
+          hits += info->vcpus[j].shadowHits;
+          verified += info->vcpus[j].shadowVerified;
+          misses += info->vcpus[j].shadowMisses;
+          compiled += info->vcpus[j].shadowPTCompiled;
+          protectFaults += info->vcpus[j].shadowProtectFaults;
+        }
+        lprintf("│ │ ├ vCPUs: %d started, %d alive",
+                info->vcpuCount, info->vcpuAlive);
+        lprintf("│ │ ├ Shadow PD: %lu hits, %lu verified, %lu misses, "
+                "%lu PT compiled, %lu protection faults",
+                hits, verified, misses, compiled, protectFaults);
+        lprintf("│ │ ├ Delayed Int: %lu queued, %lu delivered, %lu dropped, "
+                "%lu pending max", info->intQueued, info->intDelivered,
+                info->intDropped, info->intMaxPending);
+        lprintf("│ │ └ Event Ring: %s, %lu events, %lu dropped, %lu signals",
+                info->ringFrame ? "on" : "off", info->ringEvents,
+                info->ringDropped, info->ringSignals);
+      }
+    }
+    GlobalUnlockR(&pcbTable[i].lock);
   }
     lprintf("│ └ Total %d processes", totCount);
 
     lprintf("├ Thread List");
   totCount = 0;
-  for (tcb* thr = tcbList; thr != NULL; thr = thr->next ) {
-    totCount++;
-    lprintf("│ ├ [%4d <- %4d] (%s) isOwned:%s",
-                        thr->id,
-                        thr->process->id,
-                        ThreadStatusToString(thr->status),
-                        thr->owned == THREAD_NOT_OWNED ? "F" : "T");
+  for (int i = 0; i < TCB_HASH_BUCKETS; i++) {
+    GlobalLockR(&tcbTable[i].lock);
+    for (tcb* thr = tcbTable[i].head; thr != NULL; thr = thr->next ) {
+      totCount++;
+      lprintf("│ ├ [%4d <- %4d] (%s) isOwned:%s",
+                          thr->id,
+                          thr->process->id,
+                          ThreadStatusToString(thr->status),
+                          thr->owned == THREAD_NOT_OWNED ? "F" : "T");
+    }
+    GlobalUnlockR(&tcbTable[i].lock);
   }
     lprintf("│ └ Total %d threads", totCount);
 
-    lprintf("├ Express Links");
-  totCount = 0;
-  for (dualLinklist* lk = xlx.next; lk != &xlx; lk = lk->next ) {
-    totCount++;
-    lprintf("│ ├ Threads #%d", ((tcb*)lk->data)->id);
-  }
-    lprintf("│ └ Total %d threads", totCount);
+  sched->report();
   GlobalUnlockR(&latch);
 }
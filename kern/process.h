@@ -7,16 +7,20 @@
  *  it's add/delete/find, and a global lock is used to only protect its present
  *  data sturcture.
  *
- *  XLX (eXpress LinX) is maintained to provide fast round-robin service. This
+ *  XLX (eXpress LinX) is maintained to provide fast scheduling service. This
  *  module is oblivious to what should be kept in XLX. Instead, the caller does
  *  it, call corresponding api when changing thread status. Generally, threads
  *  in status (INIT, RUNNABLE, RUNNING, DEAD) are kept in XLX. And the rest
- *  (mostly BLOCKED/BLOCKED_USER) is out of XLX.
+ *  (mostly BLOCKED/BLOCKED_USER) is out of XLX. How XLX is organized and in
+ *  what order threads are picked is up to the scheduling class (see
+ *  sched_class.h)
  *
  *  Besides those, this module is NOT RESPONSIBLE for any synchronization and
  *  race-prevention between different user of tcb/pcb.
  *
- *  TCB and PCB are kept in two linked list.
+ *  TCB and PCB are kept in two hash tables indexed by id, so that finding one
+ *  by id (which every syscall does) takes constant time. Each bucket has its
+ *  own lock, so lookups don't serialize on the scheduler latch.
  *  Besides common GET to TCB/PCB, ephemeral access GET is exposed. When the
  *  caller is not owning it, and knows the threads/process may terminate anytime
  *  (which is the case of one thread accessing another, context switch, etc.),
@@ -35,6 +39,7 @@
 #include "cpu.h"
 #include "kmutex.h"
 #include "hv.h"
+#include "sched_class.h"
 
 /*************************Process Control Blok (PCB)****************************
  * PCB control all the states of one process (task in Pebble kernel)
@@ -67,7 +72,7 @@ typedef struct _pcb {
   /* BEGIN: main chain cares */
   // id of the process
   int id;
-  // next pcb in the main chain. Shouldn't be used by outsider
+  // next pcb in the same hash bucket. Shouldn't be used by outsider
   struct _pcb* next;
   /* END: main chain cares */
 
@@ -84,6 +89,11 @@ typedef struct _pcb {
   HyperInfo hyperInfo;
   // Not really readonly, but in multithreaded mode it's not modifiable
   int vcNumber;
+  // Only for a vfork() child before exec: the parent thread blocked for me,
+  // whose page directory I'm running on, and my own page directory to be used
+  // on exec. Both are NULL otherwise
+  void* vforkParent; // tcb*
+  PageDirectory vforkPD;
   /* END: Read only after creation */
 
   /* BEGIN: Section C */
@@ -210,7 +220,7 @@ struct _tcb {
   /* BEGIN: main chain cares */
   // id of the thread
   int id;
-  // the next tcb in the main chain
+  // the next tcb in the same hash bucket
   struct _tcb* next;
   /* END: main chain cares */
 
@@ -245,6 +255,9 @@ struct _tcb {
   uint32_t customArg;
   uint32_t faultStack;
 
+  // The virtual CPU it runs for a hypervisor, or NULL
+  hvVCPU* vcpu;
+
   /* BEGIN: Section B */
 
   CrossCPULock dmlock;    // lock used for makerunnable & deschedule
@@ -258,8 +271,14 @@ struct _tcb {
 
   // XLX cares
   dualLinklist _xlx;
+  // Scheduling class cares
+  schedEntity _sched;
 };
 
+// The page directory a thread runs on: its vCPU's for a hypervisor thread,
+// process pd otherwise
+#define THREAD_PD(thr) ((thr)->vcpu ? (thr)->vcpu->pd : (thr)->process->pd)
+
 #define THREAD_NOT_OWNED -1
 #define THREAD_OWNED_BY_CPU 1
 #define THREAD_OWNED_BY_THREAD 2
@@ -286,16 +305,37 @@ tcb* newTCB();
 tcb* findTCB(int tid);
 tcb* findTCBWithEphemeralAccess(int tid);
 void removeTCB(tcb* thread);
-// Will always return a runnable thread (maybe the thread passedin itself) due
-// to the existence of IDLE thread.
-tcb* roundRobinNextTCB(tcb* thread);
+
+// One page of kernel stack for a thread. newKernelStack returns 0 if out of
+// memory
+uint32_t newKernelStack();
+void freeKernelStack(uint32_t stack);
+// Scan XLX in the order given by scheduling class, and return the one after
+// former (the scan starts over when former is current). Return current when
+// nothing else is left to scan. The returned thread, when not current, is
+// ephemerally accessed.
 // When needToReleaseFormer = true, the former thread will be released
-tcb* roundRobinNextTCBWithEphemeralAccess(tcb* thread,
+tcb* nextTCBWithEphemeralAccess(tcb* current, tcb* former,
     bool needToReleaseFormer);
+// Tell scheduling class that thread is picked by the scan to run
+void pickedNextTCB(tcb* thread);
+// Account a timer tick to the running thread, return true if it should yield
+bool tickScheduler(tcb* current);
+// Return true if there's nothing runnable other than idle
+bool onlyIdleInXLX();
 void releaseEphemeralAccess(tcb* thread);
 
+// The thread/process running on current CPU, or NULL before the first thread
+// is switched to. They're cached in CPU record by context switch, so unlike
+// findTCB/findPCB, no lookup (nor lock) is needed
+tcb* getRunningThread();
+pcb* getRunningProcess();
+
 void removeFromXLX(tcb* thread);
 void addToXLX(tcb* thread);
+// The same as addToXLX, but thread is waked up from waiting for some event
+// (keyboard, sleep) and may get higher priority
+void addToXLXOnWakeup(tcb* thread);
 
 // for debug
 void reportProcessAndThread();
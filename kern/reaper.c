@@ -46,23 +46,60 @@
 #include "sysconf.h"
 #include "dbgconf.h"
 #include "kernel_stack_protection.h"
+#include "zeus.h"
+
+typedef struct {
+  uint32_t frames[PM_FREE_BATCH];
+  int count;
+} freeBatch;
 
 static uint32_t freeUserspace_EachPage(int pdIndex, int ptIndex, PTE* ptentry,
-    uint32_t _) {
-  uint32_t physicalPage = PE_DECODE_ADDR(*ptentry);
+    uint32_t token) {
+  freeBatch* batch = (freeBatch*)token;
+  // A large page is made of PT_SIZE contiguous frames
+  int frames = PE_IS_LARGE(*ptentry) ? PT_SIZE : 1;
+  for (int i = 0; i < frames; i++) {
+    batch->frames[batch->count++] = PE_DECODE_ADDR(*ptentry) + i * PAGE_SIZE;
+    if (batch->count == PM_FREE_BATCH) {
+      freeUserMemPages(batch->frames, batch->count);
+      batch->count = 0;
+    }
+  }
   *ptentry &= ~PE_PRESENT(1);
-  freeUserMemPage(physicalPage);
 
-  return 0;
+  return token;
 }
 
-// Reclaim all the user space memory refered in the page directory.
-void freeUserspace(PageDirectory pd) {
-  traverseEntryPageDirectory(pd,
-                             STRIP_PD_INDEX(USER_MEM_START),
-                             STRIP_PD_INDEX(0xffffffff),
+typedef struct {
+  PageDirectory pd;
+  freeBatch batch;
+} freeUserspaceToken;
+
+static uint32_t freeUserspace_EachRange(uint32_t startPDIndex,
+    uint32_t endPDIndex, uint32_t token) {
+  freeUserspaceToken* ft = (freeUserspaceToken*)token;
+  traverseEntryPageDirectory(ft->pd,
+                             startPDIndex,
+                             endPDIndex,
                              freeUserspace_EachPage,
-                             0);
+                             (uint32_t)&ft->batch);
+  return token;
+}
+
+static uint32_t countReserved_EachRegion(region* reg, uint32_t count) {
+  return count + reg->reserved;
+}
+
+// see reaper.h. Only page tables under regions are visited
+void freeUserspace(PageDirectory pd, region** regions) {
+  freeUserspaceToken ft;
+  ft.pd = pd;
+  ft.batch.count = 0;
+  traverseRegionPDRange(*regions, freeUserspace_EachRange, (uint32_t)&ft);
+  freeUserMemPages(ft.batch.frames, ft.batch.count);
+  // Pages never touched are just reservations
+  freeUserMemPagesZFOD(traverseRegion(*regions, countReserved_EachRegion, 0));
+  destroyRegionTree(regions);
 }
 
 // Go through a zombie chain, get its last next pointer reference, and count
@@ -193,8 +230,14 @@ void turnToZombie(pcb* targetProc) {
 // Must guarantee there's no thread alive anymore
 void reapProcess(pcb* targetProc) {
   KERNEL_STACK_CHECK;
-  freeUserspace(targetProc->pd);
-  freePageDirectory(targetProc->pd);
+  if (targetProc->vforkParent) {
+    // A vfork() child dies before exec, the page directory is my parent's
+    freePageDirectory(targetProc->vforkPD);
+    resumeVforkParent(targetProc);
+  } else {
+    freeUserspace(targetProc->pd, &targetProc->memMeta.regions);
+    freePageDirectory(targetProc->pd);
+  }
   turnToZombie(targetProc);
 }
 
@@ -227,6 +270,6 @@ void reapThread(tcb* targetThread) {
     reapProcess(targetThread->process);
   }
 
-  sfree((void*)targetThread->kernelStackPage, PAGE_SIZE);
+  freeKernelStack(targetThread->kernelStackPage);
   removeTCB(targetThread);
 }
@@ -12,8 +12,11 @@
 #define REAPER_H
 
 #include "vm.h"
+#include "region.h"
 
-void freeUserspace(PageDirectory pd);
+// Reclaim all user memory of the regions in pd, including their ZFOD
+// reservations, and destroy the region tree. Page tables are kept
+void freeUserspace(PageDirectory pd, region** regions);
 
 void reapThread(tcb* targetThread);
 
@@ -0,0 +1,237 @@
+/** @file region.c
+ *
+ *  @brief Region tree describing the user address space of a process
+ *
+ *  The tree is a treap keyed by start address. Since regions never overlap,
+ *  ordering by start is also ordering by last, so the region containing an
+ *  address is always on the path of a plain binary search.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdio.h>
+#include <simics.h>
+#include <malloc.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "common_kern.h"
+#include "vm.h"
+#include "bool.h"
+#include "region.h"
+
+// Priorities only keep the treap balanced, so a racy xorshift is good enough
+static uint32_t prioritySeed = 2463534242u;
+
+static uint32_t _nextPriority() {
+  prioritySeed ^= prioritySeed << 13;
+  prioritySeed ^= prioritySeed >> 17;
+  prioritySeed ^= prioritySeed << 5;
+  return prioritySeed;
+}
+
+// Split tree into regions starting before key (*l) and the rest (*r)
+static void _split(region* tree, uint32_t key, region** l, region** r) {
+  if (!tree) {
+    *l = *r = NULL;
+  } else if (tree->start < key) {
+    _split(tree->right, key, &tree->right, r);
+    *l = tree;
+  } else {
+    _split(tree->left, key, l, &tree->left);
+    *r = tree;
+  }
+}
+
+// Merge two trees, all regions in l are before those in r
+static region* _merge(region* l, region* r) {
+  if (!l) return r;
+  if (!r) return l;
+  if (l->priority > r->priority) {
+    l->right = _merge(l->right, r);
+    return l;
+  }
+  r->left = _merge(l, r->left);
+  return r;
+}
+
+// Return the region with the largest start no more than addr, or NULL
+static region* _floor(region* tree, uint32_t addr) {
+  region* res = NULL;
+  while (tree) {
+    if (tree->start <= addr) {
+      res = tree;
+      tree = tree->right;
+    } else {
+      tree = tree->left;
+    }
+  }
+  return res;
+}
+
+region* findRegion(region* tree, uint32_t addr) {
+  region* res = _floor(tree, addr);
+  if (res && res->last >= addr) return res;
+  return NULL;
+}
+
+bool isRegionOverlapped(region* tree, uint32_t start, uint32_t last) {
+  assert(start <= last);
+  // The only candidate is the last region starting no later than last
+  region* candidate = _floor(tree, last);
+  return candidate && candidate->last >= start;
+}
+
+region* insertRegion(region** tree, uint32_t start, uint32_t last, int flags) {
+  if (isRegionOverlapped(*tree, start, last)) return NULL;
+  region* reg = smalloc(sizeof(region));
+  if (!reg) return NULL;
+  reg->start = start;
+  reg->last = last;
+  reg->flags = flags;
+  reg->reserved = 0;
+  reg->zfod = 0;
+  reg->priority = _nextPriority();
+  reg->left = reg->right = NULL;
+
+  region *l, *r;
+  _split(*tree, start, &l, &r);
+  *tree = _merge(_merge(l, reg), r);
+  return reg;
+}
+
+void removeRegion(region** tree, uint32_t start) {
+  region *l, *m, *r;
+  _split(*tree, start, &l, &r);
+  // start is the start of some region, which cannot be 0xffffffff
+  _split(r, start + 1, &m, &r);
+  if (m) {
+    assert(m->left == NULL && m->right == NULL);
+    sfree(m, sizeof(region));
+  }
+  *tree = _merge(l, r);
+}
+
+typedef struct {
+  uint32_t cursor;
+  uint32_t high;
+  uint32_t len;
+  // Nothing is free after cursor, it's needed since cursor can't go beyond
+  // 0xffffffff
+  bool exhausted;
+} holeSearch;
+
+// In-order walk, return true once a hole is found at search->cursor or there's
+// no hole at all
+static bool _findHole(region* tree, holeSearch* search) {
+  if (!tree) return false;
+  if (_findHole(tree->left, search)) return true;
+  if (tree->last >= search->cursor) {
+    if (tree->start > search->high) return true;
+    if (tree->start > search->cursor &&
+        tree->start - search->cursor >= search->len) {
+      return true;
+    }
+    if (tree->last == 0xffffffff) {
+      search->exhausted = true;
+      return true;
+    }
+    search->cursor = tree->last + 1;
+  }
+  return _findHole(tree->right, search);
+}
+
+bool findRegionHole(region* tree, uint32_t low, uint32_t high, uint32_t len,
+    uint32_t* start) {
+  assert(len > 0);
+  holeSearch search;
+  search.cursor = low;
+  search.high = high;
+  search.len = len;
+  search.exhausted = false;
+  _findHole(tree, &search);
+  if (search.exhausted || search.cursor > high ||
+      high - search.cursor < len - 1) {
+    return false;
+  }
+  *start = search.cursor;
+  return true;
+}
+
+bool cloneRegionTree(region* src, region** dst) {
+  *dst = NULL;
+  if (!src) return true;
+  region* reg = smalloc(sizeof(region));
+  if (!reg) return false;
+  *reg = *src;
+  if (!cloneRegionTree(src->left, &reg->left)) {
+    reg->right = NULL;
+    destroyRegionTree(&reg);
+    return false;
+  }
+  if (!cloneRegionTree(src->right, &reg->right)) {
+    destroyRegionTree(&reg);
+    return false;
+  }
+  *dst = reg;
+  return true;
+}
+
+void destroyRegionTree(region** tree) {
+  if (!*tree) return;
+  destroyRegionTree(&(*tree)->left);
+  destroyRegionTree(&(*tree)->right);
+  sfree(*tree, sizeof(region));
+  *tree = NULL;
+}
+
+uint32_t traverseRegion(region* tree,
+    uint32_t (*onRegion)(region*, uint32_t),
+    uint32_t initialToken) {
+  if (!tree) return initialToken;
+  initialToken = traverseRegion(tree->left, onRegion, initialToken);
+  initialToken = onRegion(tree, initialToken);
+  return traverseRegion(tree->right, onRegion, initialToken);
+}
+
+typedef struct {
+  bool pending;
+  uint32_t startPDIndex;
+  uint32_t endPDIndex;
+  uint32_t (*onRange)(uint32_t, uint32_t, uint32_t);
+  uint32_t token;
+} pdRangeMerger;
+
+static uint32_t _mergePDRange(region* reg, uint32_t token) {
+  pdRangeMerger* merger = (pdRangeMerger*)token;
+  uint32_t startPDIndex = STRIP_PD_INDEX(reg->start);
+  uint32_t endPDIndex = STRIP_PD_INDEX(reg->last);
+  if (merger->pending && startPDIndex <= merger->endPDIndex) {
+    // Sharing the page directory entry with the previous one
+    merger->endPDIndex = endPDIndex;
+    return token;
+  }
+  if (merger->pending) {
+    merger->token = merger->onRange(
+        merger->startPDIndex, merger->endPDIndex, merger->token);
+  }
+  merger->pending = true;
+  merger->startPDIndex = startPDIndex;
+  merger->endPDIndex = endPDIndex;
+  return token;
+}
+
+uint32_t traverseRegionPDRange(region* tree,
+    uint32_t (*onRange)(uint32_t, uint32_t, uint32_t),
+    uint32_t initialToken) {
+  pdRangeMerger merger;
+  merger.pending = false;
+  merger.onRange = onRange;
+  merger.token = initialToken;
+  traverseRegion(tree, _mergePDRange, (uint32_t)&merger);
+  if (merger.pending) {
+    merger.token = merger.onRange(
+        merger.startPDIndex, merger.endPDIndex, merger.token);
+  }
+  return merger.token;
+}
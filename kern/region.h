@@ -0,0 +1,93 @@
+/** @file region.h
+ *
+ *  @brief Region tree describing the user address space of a process
+ *
+ *  Every piece of user memory of a process belongs to exactly one region:
+ *  the program image, bss, stack, guest memory of a virtual machine, and each
+ *  new_pages() allocation. Regions never overlap, and they are kept in a treap
+ *  ordered by start address, so lookup, insertion, removal and overlap checks
+ *  are all O(log n) expected.
+ *
+ *  A region may be lazily populated: its pages are not in page table at all
+ *  until someone touches them, and they are backed by ZFOD reservations kept
+ *  in the region (see ZFODUpgrader in fault.c).
+ *
+ *  The tree is not thread safe, it's protected by memlock of the process.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdint.h>
+
+#include "bool.h"
+
+// What the region is for
+#define REGION_IMAGE      (1 << 0)
+#define REGION_BSS        (1 << 1)
+#define REGION_STACK      (1 << 2)
+#define REGION_GUEST      (1 << 3)
+#define REGION_NEW_PAGES  (1 << 4)
+// new_pages() region mapped by 4MiB large pages
+#define REGION_LARGE      (1 << 5)
+
+typedef struct _region {
+  uint32_t start;
+  // Last byte of the region (inclusive), so that it can end at 0xffffffff
+  uint32_t last;
+  int flags;
+  // Number of pages not in page table yet, each of them takes one ZFOD
+  // reservation. zfod is the ZFOD page returned by the reservation
+  int reserved;
+  uint32_t zfod;
+
+  // Treap internals
+  uint32_t priority;
+  struct _region* left;
+  struct _region* right;
+} region;
+
+// Insert [start, last] to the tree, and return the new region with nothing
+// reserved. Return NULL if it overlaps any region in the tree, or out of memory
+region* insertRegion(region** tree, uint32_t start, uint32_t last, int flags);
+
+// Remove the region starting at start from the tree, and free it. Nothing
+// happens if there's no such region. The caller should take care of its pages
+// and reservations
+void removeRegion(region** tree, uint32_t start);
+
+// Return the region containing addr, or NULL if addr is not in any region
+region* findRegion(region* tree, uint32_t addr);
+
+// Whether [start, last] overlaps any region in the tree
+bool isRegionOverlapped(region* tree, uint32_t start, uint32_t last);
+
+// Find the lowest free range of len bytes inside [low, high], and put its start
+// in *start. len must be positive. Return false if there's no such range
+bool findRegionHole(region* tree, uint32_t low, uint32_t high, uint32_t len,
+    uint32_t* start);
+
+// Deep copy the tree to *dst, including reservation numbers (the caller should
+// reserve them for the copy). Return false if out of memory, and *dst is NULL
+bool cloneRegionTree(region* src, region** dst);
+
+// Free all regions in the tree, and set it to empty
+void destroyRegionTree(region** tree);
+
+// Visit all regions by the order of address. initialToken is passed on each
+// onRegion call, so this function acts as fold() on onRegion
+uint32_t traverseRegion(region* tree,
+    uint32_t (*onRegion)(region*, uint32_t),
+    uint32_t initialToken);
+
+// Visit page directory index ranges [startPDIndex, endPDIndex] covered by
+// regions, by the order of address. Neighbouring regions in the same page
+// directory entry are merged, so that each index is visited at most once. It
+// acts as fold() on onRange, just like traverseRegion
+uint32_t traverseRegionPDRange(region* tree,
+    uint32_t (*onRange)(uint32_t, uint32_t, uint32_t),
+    uint32_t initialToken);
+
+#endif
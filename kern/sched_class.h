@@ -0,0 +1,74 @@
+/** @file sched_class.h
+ *
+ *  @brief Pluggable scheduling class
+ *
+ *  A scheduling class decides the order that runnable threads are picked. It
+ *  owns XLX (the set of threads in status INIT, RUNNABLE, RUNNING and DEAD,
+ *  see process.h), and keeps them in whatever structure it likes through the
+ *  _xlx link and _sched entity in each tcb.
+ *
+ *  All callbacks are invoked by process.c with its latch held, so the class
+ *  itself needs no locking. A thread is in XLX if and only if its _xlx.next is
+ *  not NULL, and the class must keep this true.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#ifndef SCHED_CLASS_H
+#define SCHED_CLASS_H
+
+#include <stdint.h>
+
+#include "bool.h"
+
+struct _tcb;
+
+// Per-thread bookkeeping for the scheduling class
+typedef struct {
+  // the priority level the thread is on
+  int level;
+  // timer ticks left in the current time slice
+  int ticksLeft;
+  // the boost epoch that level is counted in
+  uint32_t epoch;
+} schedEntity;
+
+typedef struct {
+  const char* name;
+
+  // Initialize the class, called once in initProcess()
+  void (*init)();
+
+  // Initialize the entity of a newly created thread
+  void (*initThread)(struct _tcb* thread);
+
+  // Put thread into XLX. wakeup is true when the thread comes back from
+  // waiting for some event (keyboard, sleep), and may deserve a boost
+  void (*enqueue)(struct _tcb* thread, bool wakeup);
+
+  // Take thread out of XLX
+  void (*dequeue)(struct _tcb* thread);
+
+  // Scan XLX in the order of preference, and return the thread after former,
+  // current is never returned during the scan. The scan starts over when
+  // former is current, and current is returned when everything is scanned.
+  struct _tcb* (*next)(struct _tcb* current, struct _tcb* former);
+
+  // Thread is picked from the scan to run next
+  void (*picked)(struct _tcb* thread);
+
+  // Account one timer tick to the running thread, return true if it should
+  // yield the CPU now
+  bool (*tick)(struct _tcb* current);
+
+  // Return true if no thread other than idle is in XLX
+  bool (*onlyIdle)();
+
+  // For debug
+  void (*report)();
+} schedClass;
+
+// Multi-level feedback queue, see sched_mlfq.c
+extern schedClass mlfqSchedClass;
+
+#endif
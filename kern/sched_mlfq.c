@@ -0,0 +1,233 @@
+/** @file sched_mlfq.c
+ *
+ *  @brief Multi-level feedback queue scheduling class
+ *
+ *  Threads in XLX are kept in MLFQ_LEVELS round robin queues, plus one extra
+ *  queue at the bottom just for idle. The rules are:
+ *  - A thread is always picked from the highest non-empty level, and the
+ *    picked one goes to the tail of its queue. So idle only runs when all
+ *    other queues are empty (or others are not ready to run)
+ *  - New threads, and threads waked up from keyboard or sleep start at the
+ *    top level with a fresh time slice
+ *  - A thread using up its time slice is demoted by one level, and the slice
+ *    doubles on each level below
+ *  - Every MLFQ_BOOST_PERIOD ticks, all threads are boosted back to top level
+ *    to avoid starvation. The boost splices the queues in O(MLFQ_LEVELS), and
+ *    a thread that has not been touched since the boost is lazily counted on
+ *    top level by comparing its epoch
+ *
+ *  All functions run inside process.c latch (see sched_class.h).
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdio.h>
+#include <simics.h>
+#include <malloc.h>
+#include <assert.h>
+
+#include "common_kern.h"
+#include "bool.h"
+#include "process.h"
+#include "sysconf.h"
+#include "sched_class.h"
+
+#define IDLE_LEVEL MLFQ_LEVELS
+#define QUANTUM_OF(level) (MLFQ_BASE_QUANTUM << (level))
+
+// One sentinel for each queue, plus the one for idle
+static dualLinklist queues[MLFQ_LEVELS + 1];
+// Bit i is set iff queues[i] is not empty, for O(1) highest level lookup
+static uint32_t nonEmptyMask;
+static uint32_t epoch;
+static int ticksToBoost;
+
+static bool isIdle(tcb* thread) {
+  return thread->process->id == IDLE_PID;
+}
+
+static bool queueEmpty(int level) {
+  return queues[level].next == &queues[level];
+}
+
+// The first non-empty level at or below level, IDLE_LEVEL + 1 if none
+static int firstNonEmptyLevel(int level) {
+  uint32_t mask = nonEmptyMask >> level << level;
+  if (mask == 0) return IDLE_LEVEL + 1;
+  return __builtin_ctz(mask);
+}
+
+// Bring the entity up to date with the latest boost, and return its level
+static int levelOf(tcb* thread) {
+  schedEntity* se = &thread->_sched;
+  if (se->level != IDLE_LEVEL && se->epoch != epoch) {
+    se->level = 0;
+    se->ticksLeft = QUANTUM_OF(0);
+    se->epoch = epoch;
+  }
+  return se->level;
+}
+
+static void appendToQueue(tcb* thread, int level) {
+  dualLinklist* q = &queues[level];
+  thread->_xlx.next = q;
+  thread->_xlx.prev = q->prev;
+  thread->_xlx.next->prev = &thread->_xlx;
+  thread->_xlx.prev->next = &thread->_xlx;
+  nonEmptyMask |= 1 << level;
+}
+
+static void unlinkFromQueue(tcb* thread, int level) {
+  thread->_xlx.next->prev = thread->_xlx.prev;
+  thread->_xlx.prev->next = thread->_xlx.next;
+  thread->_xlx.next = thread->_xlx.prev = NULL;
+  if (queueEmpty(level)) {
+    nonEmptyMask &= ~(1 << level);
+  }
+}
+
+// Move everything in queues[1..MLFQ_LEVELS-1] to the tail of queues[0]
+static void boostAll() {
+  for (int i = 1; i < MLFQ_LEVELS; i++) {
+    if (queueEmpty(i)) continue;
+    dualLinklist* first = queues[i].next;
+    dualLinklist* last = queues[i].prev;
+    first->prev = queues[0].prev;
+    queues[0].prev->next = first;
+    last->next = &queues[0];
+    queues[0].prev = last;
+    queues[i].next = queues[i].prev = &queues[i];
+    nonEmptyMask &= ~(1 << i);
+    nonEmptyMask |= 1;
+  }
+  epoch++;
+}
+
+static void mlfqInit() {
+  for (int i = 0; i <= IDLE_LEVEL; i++) {
+    queues[i].next = queues[i].prev = &queues[i];
+    queues[i].data = NULL;
+  }
+  nonEmptyMask = 0;
+  epoch = 0;
+  ticksToBoost = MLFQ_BOOST_PERIOD;
+}
+
+static void mlfqInitThread(tcb* thread) {
+  thread->_sched.level = 0;
+  thread->_sched.ticksLeft = QUANTUM_OF(0);
+  thread->_sched.epoch = epoch;
+}
+
+static void mlfqEnqueue(tcb* thread, bool wakeup) {
+  schedEntity* se = &thread->_sched;
+  if (isIdle(thread)) {
+    se->level = IDLE_LEVEL;
+  } else if (wakeup) {
+    mlfqInitThread(thread);
+  }
+  appendToQueue(thread, levelOf(thread));
+}
+
+static void mlfqDequeue(tcb* thread) {
+  unlinkFromQueue(thread, levelOf(thread));
+}
+
+static tcb* mlfqNext(tcb* current, tcb* former) {
+  int level;
+  dualLinklist* node;
+  if (former == current || former->_xlx.next == NULL) {
+    // Start over. It also happens when former is gone during the scan
+    level = firstNonEmptyLevel(0);
+    node = level <= IDLE_LEVEL ? queues[level].next : NULL;
+  } else {
+    level = levelOf(former);
+    node = former->_xlx.next;
+  }
+
+  // Idle is the last resort, only when current cannot go on
+  bool canPickIdle =
+      current->status != THREAD_RUNNING || current->descheduling;
+  while (level <= IDLE_LEVEL) {
+    if (node == &queues[level]) {
+      level = firstNonEmptyLevel(level + 1);
+      if (level > IDLE_LEVEL) break;
+      node = queues[level].next;
+      continue;
+    }
+    tcb* thread = (tcb*)node->data;
+    if (thread != current && (level != IDLE_LEVEL || canPickIdle)) {
+      return thread;
+    }
+    node = node->next;
+  }
+  return current;
+}
+
+static void mlfqPicked(tcb* thread) {
+  // Round robin inside the level
+  int level = levelOf(thread);
+  unlinkFromQueue(thread, level);
+  appendToQueue(thread, level);
+}
+
+static bool mlfqTick(tcb* current) {
+  if (--ticksToBoost <= 0) {
+    ticksToBoost = MLFQ_BOOST_PERIOD;
+    boostAll();
+  }
+  if (current->_xlx.next == NULL) {
+    // Not in XLX, it's leaving CPU anyway
+    return false;
+  }
+
+  int level = levelOf(current);
+  if (level == IDLE_LEVEL) {
+    // Give it up as soon as anyone else shows up
+    return firstNonEmptyLevel(0) < IDLE_LEVEL;
+  }
+  schedEntity* se = &current->_sched;
+  if (--se->ticksLeft <= 0) {
+    // Used up the whole slice, demote it
+    int newLevel = level + 1 < MLFQ_LEVELS ? level + 1 : level;
+    unlinkFromQueue(current, level);
+    se->level = newLevel;
+    se->ticksLeft = QUANTUM_OF(newLevel);
+    appendToQueue(current, newLevel);
+    return true;
+  }
+  // Preempt it if some one with higher priority is waiting
+  return firstNonEmptyLevel(0) < level;
+}
+
+static bool mlfqOnlyIdle() {
+  return firstNonEmptyLevel(0) >= IDLE_LEVEL;
+}
+
+static void mlfqReport() {
+  lprintf("├ Scheduler (%s)", mlfqSchedClass.name);
+  int totCount = 0;
+  for (int i = 0; i <= IDLE_LEVEL; i++) {
+    for (dualLinklist* lk = queues[i].next; lk != &queues[i]; lk = lk->next) {
+      totCount++;
+      lprintf("│ ├ Level %d%s: Threads #%d, slice left %d",
+          i, i == IDLE_LEVEL ? "(idle)" : "",
+          ((tcb*)lk->data)->id, ((tcb*)lk->data)->_sched.ticksLeft);
+    }
+  }
+  lprintf("│ └ Total %d threads, next boost in %d ticks",
+      totCount, ticksToBoost);
+}
+
+schedClass mlfqSchedClass = {
+  .name = "MLFQ",
+  .init = mlfqInit,
+  .initThread = mlfqInitThread,
+  .enqueue = mlfqEnqueue,
+  .dequeue = mlfqDequeue,
+  .next = mlfqNext,
+  .picked = mlfqPicked,
+  .tick = mlfqTick,
+  .onlyIdle = mlfqOnlyIdle,
+  .report = mlfqReport
+};
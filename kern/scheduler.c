@@ -1,12 +1,12 @@
 /** @file scheduler.c
  *
- *  @brief Round robin scheduler
+ *  @brief Scheduler
  *
  *  Exposes yieldToNext, which is called in almost all context switch case
  *  (except targeted awakening) to switch to the next runnable thread.
  *
  *  It fetches runnable threads from XLX (see process.h), which skips BLOCKED
- *  threads
+ *  threads, in the order given by scheduling class (see sched_class.h)
  *
  *  It also triggers reaper when a dead thread is found.
  *
@@ -46,13 +46,12 @@ extern void dumpAll();
 // shut itself down (thread data structure does not exist anymore)
 // We must be super careful about this.
 bool yieldToNext() {
-  int currentTID = getLocalCPU()->runningTID;
-  if (currentTID == -1) {
+  tcb* currentThread = getRunningThread();
+  if (!currentThread) {
     return false;
   }
 
   // Don't have to acquire lock, pickNextRunnableThread will do it!
-  tcb* currentThread = findTCB(currentTID);
   tcb* nextThread = pickNextRunnableThread(currentThread);
   if (nextThread == NULL) {
     // No other thread, run myself. If myself is not runnalbe (impossible if
@@ -81,8 +80,8 @@ tcb* pickNextRunnableThread(tcb* currentThread) {
   tcb* nextThread = currentThread;
   bool needToReleaseFormer = false;
   while (true) {
-    nextThread = roundRobinNextTCBWithEphemeralAccess(
-        nextThread, needToReleaseFormer);
+    nextThread = nextTCBWithEphemeralAccess(
+        currentThread, nextThread, needToReleaseFormer);
     if (nextThread == currentThread) {
       // We've gone through everything, no one else is good to go.
       // No need to release ephemeral access, it will not acquire when the next
@@ -128,6 +127,7 @@ tcb* pickNextRunnableThread(tcb* currentThread) {
     }
 
     // OK it's you man!
+    pickedNextTCB(nextThread);
     return nextThread;
   }
 }
@@ -1,12 +1,12 @@
 /** @file scheduler.h
  *
- *  @brief Round robin scheduler
+ *  @brief Scheduler
  *
  *  Exposes yieldToNext, which is called in almost all context switch case
  *  (except targeted awakening) to switch to the next runnable thread.
  *
  *  It fetches runnable threads from XLX (see process.h), which skips BLOCKED
- *  threads
+ *  threads, in the order given by scheduling class (see sched_class.h)
  *
  *  It also triggers reaper when a dead thread is found.
  *
@@ -0,0 +1,112 @@
+/** @file slab.c
+ *
+ *  @brief Object caches for kernel objects allocated all the time
+ *
+ *  See slab.h for how objects are cached. Slabs themselves are not tracked:
+ *  once carved, each object lives on its own, and goes back to the heap alone
+ *  when its magazine overflows.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdio.h>
+#include <simics.h>
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "slab.h"
+#include "sysconf.h"
+
+static slabCache* caches = NULL;
+
+void initSlabCache(slabCache* cache, const char* name, size_t size,
+    size_t align, void (*ctor)(void*)) {
+  if (align < sizeof(void*)) align = sizeof(void*);
+  assert((align & (align - 1)) == 0);
+  cache->name = name;
+  cache->align = align;
+  cache->objSize = (size + align - 1) & ~(align - 1);
+  cache->ctor = ctor;
+  memset(cache->magazines, 0, sizeof(cache->magazines));
+  cache->next = caches;
+  caches = cache;
+}
+
+// Must run with LocalLock. If the magazine is full, the older half of it goes
+// back to heap first
+static void _magazinePush(slabCache* cache, slabMagazine* mag, void* obj) {
+  if (mag->size == SLAB_MAGAZINE_SIZE) {
+    int half = SLAB_MAGAZINE_SIZE / 2;
+    for (int i = 0; i < half; i++) {
+      sfree(mag->objs[i], cache->objSize);
+    }
+    memmove(mag->objs, mag->objs + half, sizeof(void*) * (mag->size - half));
+    mag->size -= half;
+    mag->flushes++;
+  }
+  mag->objs[mag->size++] = obj;
+}
+
+void* slabAlloc(slabCache* cache) {
+  LocalLockR();
+  slabMagazine* mag = &cache->magazines[getLocalCPU()->id];
+  if (mag->size > 0) {
+    void* obj = mag->objs[--mag->size];
+    mag->inUse++;
+    mag->hits++;
+    LocalUnlockR();
+    return obj;
+  }
+  LocalUnlockR();
+
+  // Magazine is empty. Carve a new slab and construct it without LocalLock,
+  // it may take a while
+  char* slab = smemalign(cache->align, cache->objSize * SLAB_OBJECTS);
+  if (!slab) return NULL;
+  if (cache->ctor) {
+    for (int i = 0; i < SLAB_OBJECTS; i++) {
+      cache->ctor(slab + i * cache->objSize);
+    }
+  }
+
+  // Take the first object, and keep the rest
+  LocalLockR();
+  mag = &cache->magazines[getLocalCPU()->id];
+  for (int i = 1; i < SLAB_OBJECTS; i++) {
+    _magazinePush(cache, mag, slab + i * cache->objSize);
+  }
+  mag->inUse++;
+  mag->slabs++;
+  LocalUnlockR();
+  return slab;
+}
+
+void slabFree(slabCache* cache, void* obj) {
+  assert(obj != NULL);
+  LocalLockR();
+  slabMagazine* mag = &cache->magazines[getLocalCPU()->id];
+  _magazinePush(cache, mag, obj);
+  mag->inUse--;
+  LocalUnlockR();
+}
+
+void reportSlabCaches() {
+  lprintf("│ └ Slab Caches");
+  for (slabCache* cache = caches; cache != NULL; cache = cache->next) {
+    int cached = 0, inUse = 0, hits = 0, slabs = 0, flushes = 0;
+    for (int i = 0; i < CPU_COUNT; i++) {
+      slabMagazine* mag = &cache->magazines[i];
+      cached += mag->size;
+      inUse += mag->inUse;
+      hits += mag->hits;
+      slabs += mag->slabs;
+      flushes += mag->flushes;
+    }
+    lprintf("│   %s %s (%lu bytes): %d in use, %d cached, "
+        "%d slabs, %d hits, %d flushes",
+        cache->next ? "├" : "└", cache->name, (unsigned long)cache->objSize,
+        inUse, cached, slabs, hits, flushes);
+  }
+}
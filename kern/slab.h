@@ -0,0 +1,68 @@
+/** @file slab.h
+ *
+ *  @brief Object caches for kernel objects allocated all the time
+ *
+ *  A slab cache hands out objects of one type. Objects are carved from kernel
+ *  heap by slabs of SLAB_OBJECTS objects, so that one heap allocation (and one
+ *  heap latch) serves many of them, and each object is constructed only once
+ *  when its slab is carved.
+ *
+ *  Each CPU keeps free objects in its own magazine of the cache, protected by
+ *  LocalLock only, so most allocations and frees never touch the heap. When
+ *  a magazine overflows, the older half of it goes back to the heap one by one
+ *  (lmm takes back any part of a block), so a cache never pins more than one
+ *  magazine of free objects per CPU.
+ *
+ *  Objects are cached in constructed state: whoever frees an object must leave
+ *  it the way the constructor does (e.g. a page table is cleared before freed).
+ *
+ *  @author Leiyu Zhao
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#include "cpu.h"
+#include "sysconf.h"
+
+#define SLAB_OBJECTS (SLAB_MAGAZINE_SIZE / 2)
+
+typedef struct {
+  int size;
+  void* objs[SLAB_MAGAZINE_SIZE];
+  // Statistics of this CPU. inUse may go negative if objects are freed on
+  // another CPU, only the sum makes sense
+  int inUse;
+  int hits;
+  int slabs;
+  int flushes;
+} slabMagazine;
+
+typedef struct _slabCache {
+  const char* name;
+  // Object size, rounded up to align
+  size_t objSize;
+  size_t align;
+  void (*ctor)(void*);
+  slabMagazine magazines[CPU_COUNT];
+  // All caches are linked for report
+  struct _slabCache* next;
+} slabCache;
+
+// Init the cache of objects with size and align (power of 2), ctor may be NULL.
+// Caches are created in bootstrap, before anything runs in parallel
+void initSlabCache(slabCache* cache, const char* name, size_t size,
+    size_t align, void (*ctor)(void*));
+
+// Get a constructed object, or NULL if out of memory
+void* slabAlloc(slabCache* cache);
+
+// Give back an object got from the same cache, in constructed state
+void slabFree(slabCache* cache, void* obj);
+
+// For debug, report all caches. It's not protected by lock
+void reportSlabCaches();
+
+#endif
@@ -14,6 +14,7 @@
 #include <malloc.h>
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "common_kern.h"
 #include "pm.h"
@@ -21,46 +22,52 @@
 #include "bool.h"
 #include "process.h"
 
+// Validation goes page by page, so the cost is per page instead of per byte.
+// Pages not populated yet in a region are good, they get populated on the
+// first touch (see ZFODUpgrader in fault.c)
 static bool verifyUserSpaceAddrGivenPD(uint32_t startAddr, uint32_t endAddr,
-    bool mustWritable, PageDirectory mypd) {
-  if (startAddr < USER_MEM_START) {
-    // Part of the space is in kernel, invalid
+    bool mustWritable, PageDirectory mypd, region* regions) {
+  if (startAddr < USER_MEM_START || endAddr < startAddr) {
+    // Part of the space is in kernel, or wraps around, invalid
     return false;
   }
-  uint32_t lastVerifiedPageNum = 0;
-  for (uint32_t i = startAddr; ; i++) {
-    uint32_t myPageNum = PE_DECODE_ADDR(i);
-    if (myPageNum != lastVerifiedPageNum) {
-      lastVerifiedPageNum = myPageNum;
-
-      if (myPageNum < USER_MEM_START) {
-        return false;
-      }
-
-      PTE* targetPTE = searchPTEntryPageDirectory(mypd, lastVerifiedPageNum);
-      if (!targetPTE) {
+  uint32_t endPageNum = PE_DECODE_ADDR(endAddr);
+  for (uint32_t pageNum = PE_DECODE_ADDR(startAddr); ; pageNum += PAGE_SIZE) {
+    PTE* targetPTE = searchPTEntryPageDirectory(mypd, pageNum);
+    if (!targetPTE) {
+      region* reg = findRegion(regions, pageNum);
+      if (!reg || reg->reserved == 0) {
         // The page does not exist at all
         return false;
       }
+      // Not populated yet, and the rest of region is good as well
+      if (reg->last >= endAddr) break;
+      pageNum = reg->last + 1 - PAGE_SIZE;
+      continue;
+    }
 
-      if (mustWritable && !PE_IS_WRITABLE(*targetPTE) && !isZFOD(PE_DECODE_ADDR(*targetPTE))) {
-        // We want a writable page, but it's not writable for user
-        return false;
-      }
+    if (mustWritable && !PE_IS_WRITABLE(*targetPTE) &&
+        !isZFOD(PE_DECODE_ADDR(*targetPTE)) && !PE_IS_COW(*targetPTE)) {
+      // We want a writable page, but it's not writable for user. ZFOD and
+      // copy-on-write pages will get writable on the first write
+      return false;
     }
 
-    if (i == endAddr) {
-      // We cannot use for loop to detect overrange. endAddr may be 0xffffffff!
-      break;
+    if (PE_IS_LARGE(*targetPTE)) {
+      // The whole large page is good, jump to its last 4k page
+      pageNum |= LARGE_PAGE_SIZE - PAGE_SIZE;
     }
+    // We cannot use for loop to detect overrange. endAddr may be 0xffffffff!
+    if (pageNum >= endPageNum) break;
   }
   return true;
 }
 
 bool verifyUserSpaceAddr(
     uint32_t startAddr, uint32_t endAddr, bool mustWritable) {
-  PageDirectory mypd = findPCB(getLocalCPU()->runningPID)->pd;
-  return verifyUserSpaceAddrGivenPD(startAddr, endAddr, mustWritable, mypd);
+  tcb* thr = getRunningThread();
+  return verifyUserSpaceAddrGivenPD(startAddr, endAddr, mustWritable,
+      THREAD_PD(thr), thr->process->memMeta.regions);
 }
 
 // It is not atomic, another thread may use syscall to change the memory.
@@ -71,23 +78,53 @@ bool sGetInt(uint32_t addr, int* target) {
   return true;
 }
 
+bool sSetInt(uint32_t addr, int value) {
+  if (!verifyUserSpaceAddr(addr, addr - 1 + sizeof(int), true)) return false;
+  *((int*)addr) = value;
+  return true;
+}
+
+bool sCopyFromUser(void* target, uint32_t addr, int len) {
+  if (len <= 0) return len == 0;
+  if (!verifyUserSpaceAddr(addr, addr + (len - 1), false)) return false;
+  memcpy(target, (void*)addr, len);
+  return true;
+}
+
+bool sCopyToUser(uint32_t addr, const void* source, int len) {
+  if (len <= 0) return len == 0;
+  if (!verifyUserSpaceAddr(addr, addr + (len - 1), true)) return false;
+  memcpy((void*)addr, source, len);
+  return true;
+}
+
+// The array is verified page by page: whenever an element reaches beyond what's
+// verified, verify the page(s) it lies in. The whole range of size elements
+// must not wrap around, so no element ever wraps to (kernel) address 0
 #define sGetTypeArray(FuncName, TYPE) \
   int FuncName(uint32_t addr, TYPE* target, int size) { \
-    PageDirectory mypd = findPCB(getLocalCPU()->runningPID)->pd; \
-    int lastVerifiedPageNum = 0; \
-    for (int i = 0; i < size * sizeof(TYPE); i++) { \
-      if (lastVerifiedPageNum != PE_DECODE_ADDR(addr + i) && \
-          !verifyUserSpaceAddrGivenPD(addr + i, addr + i, false, mypd)) { \
-        return -1; \
+    tcb* thr = getRunningThread(); \
+    if (size <= 0) return size; \
+    if ((uint32_t)(size - 1) > (0xffffffff - addr) / sizeof(TYPE)) return -1; \
+    bool verified = false; \
+    uint32_t verifiedEnd = 0; \
+    for (int i = 0; i < size; i++) { \
+      uint32_t elemAddr = addr + i * sizeof(TYPE); \
+      uint32_t elemEnd = elemAddr + sizeof(TYPE) - 1; \
+      if (elemAddr < addr || elemEnd < elemAddr) return -1; \
+      if (!verified || elemEnd > verifiedEnd) { \
+        if (!verifyUserSpaceAddrGivenPD(elemAddr, elemEnd, false, \
+            THREAD_PD(thr), thr->process->memMeta.regions)) { \
+          return -1; \
+        } \
+        verifiedEnd = PE_DECODE_ADDR(elemEnd) + (PAGE_SIZE - 1); \
+        verified = true; \
       } \
-      lastVerifiedPageNum = PE_DECODE_ADDR(addr + i); \
  \
-      if (i % sizeof(TYPE) == 0) { \
-        TYPE tmp = *((TYPE*)(addr + i)); \
-        if (target) target[i / sizeof(TYPE)] = tmp; \
-        if (tmp == 0) { \
-          return i / sizeof(TYPE); \
-        } \
+      TYPE tmp = *((TYPE*)elemAddr); \
+      if (target) target[i] = tmp; \
+      if (tmp == 0) { \
+        return i; \
       } \
     } \
     return size; \
@@ -21,6 +21,15 @@ bool verifyUserSpaceAddr(
 // get an integer from addr to target. return true if success
 bool sGetInt(uint32_t addr, int* target);
 
+// set an integer to addr, which must be writable. return true if success
+bool sSetInt(uint32_t addr, int value);
+
+// Bulk copy between user space and kernel, the user range is validated once
+// (page by page) before copying. Return false, and copy nothing, if any part of
+// the user range is invalid (or not writable for sCopyToUser)
+bool sCopyFromUser(void* target, uint32_t addr, int len);
+bool sCopyToUser(uint32_t addr, const void* source, int len);
+
 // get a NUL-terminated string from addr to target, return its size
 // return -1 on failure
 // return non-neg value indicating the number of chars get (exclude the
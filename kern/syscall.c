@@ -10,6 +10,7 @@
 #include <malloc.h>
 #include <assert.h>
 #include <syscall_int.h>
+#include <hvcall.h>
 
 #include "x86/asm.h"
 #include "x86/cr.h"
@@ -20,6 +21,15 @@
 #include "bool.h"
 #include "cpu.h"
 #include "source_untrusted.h"
+#include "asm_wrapper.h"
+#include "process.h"
+#include "hvlife.h"
+
+// MSRs used by SYSENTER. SYSEXIT goes to SYSENTER_CS + 16 (which is
+// SEGSEL_USER_CS) and uses SYSENTER_CS + 24 (which is SEGSEL_USER_DS) as %ss
+#define IA32_SYSENTER_CS 0x174
+#define IA32_SYSENTER_ESP 0x175
+#define IA32_SYSENTER_EIP 0x176
 
 #define MAKE_SYSCALL_IDT(syscallName, syscallIntNumber) \
   do { \
@@ -76,9 +86,40 @@ void initSyscall() {
   MAKE_SYSCALL_IDT(halt, HALT_INT);
   MAKE_SYSCALL_IDT(misbehave, MISBEHAVE_INT);
 
+  MAKE_SYSCALL_IDT(spawn, SPAWN_INT);
+  MAKE_SYSCALL_IDT(vfork, VFORK_INT);
+
+  // The stack is set on every context switch
+  set_msr(IA32_SYSENTER_CS, SEGSEL_KERNEL_CS);
+  set_msr(IA32_SYSENTER_ESP, 0);
+  set_msr(IA32_SYSENTER_EIP, (uint32_t)fastSyscall_Handler);
+
   lprintf("Registered all system call handler.");
 }
 
+void setFastSyscallStack(uint32_t esp) {
+  set_msr(IA32_SYSENTER_ESP, esp);
+}
+
+int fastSyscall_Internal(int syscallNumber, SyscallParams params) {
+  tcb* currentThread = getRunningThread();
+  if (currentThread->process->hyperInfo.isHyper) {
+    // SYSEXIT can only go back to flat segments, which is not what guest is
+    // running on. Guest should use INT.
+    exitHyperWithStatus(&currentThread->process->hyperInfo, currentThread,
+        GUEST_CRASH_STATUS);
+  }
+  switch (syscallNumber) {
+    case GETTID_INT: return gettid_Internal(params);
+    case GET_TICKS_INT: return get_ticks_Internal(params);
+    case YIELD_INT: return yield_Internal(params);
+    case SLEEP_INT: return sleep_Internal(params);
+    case DESCHEDULE_INT: return deschedule_Internal(params);
+    case MAKE_RUNNABLE_INT: return make_runnable_Internal(params);
+    default: return -1;
+  }
+}
+
 static void reigsterHypervisorOnlyHandler() {
   // 65~116, 128~134
   MAKE_SYSCALL_IDT_HYPERVISOR_ONLY(hvHd_65, 65);
@@ -53,9 +53,23 @@ DECLARE_SYSCALL_WRAPPER(readfile);
 DECLARE_SYSCALL_WRAPPER(halt);
 DECLARE_SYSCALL_WRAPPER(misbehave);
 
+DECLARE_SYSCALL_WRAPPER(spawn);
+DECLARE_SYSCALL_WRAPPER(vfork);
+
+// Fast syscall entry by SYSENTER, see syscall_handler.S. It only serves the
+// syscalls that never touch the user registers saved on kernel stack (so no
+// fork, exec, swexn, etc.), and returns -1 for others. Syscall number is the
+// same as the INT number.
+void fastSyscall_Handler();
+int fastSyscall_Internal(int syscallNumber, SyscallParams params);
+
 // Install syscall handler. Must be called in kernel setup
 void initSyscall();
 
+// Set the kernel stack SYSENTER goes to, should be called on context switch
+// together with set_esp0
+void setFastSyscallStack(uint32_t esp);
+
 // Parsing process is not atomic: some memory may be freed by other thread, so
 // memlock should be acquired, unless you know that there's only one thread
 bool parseSingleParam(SyscallParams params, int* result);
@@ -32,7 +32,7 @@
 
 int new_console_Internal(SyscallParams params) {
   // We own currentThread
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   // Precheck: the process has only one thread
   kmutexRLock(&currentThread->process->mutex);
   if (currentThread->process->numThread > 1) {
@@ -54,7 +54,7 @@ int new_console_Internal(SyscallParams params) {
 }
 
 int readline_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
 
   int len;
   uint32_t bufAddr;
@@ -100,14 +100,13 @@ int readline_Internal(SyscallParams params) {
   kmutexWLockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
   // Revalidate, the page table may be removed when waiting for keyboard
-  if (!verifyUserSpaceAddr(bufAddr, bufAddr + len - 1, true)) {
+  if (!verifyUserSpaceAddr(bufAddr, bufAddr + len - 1, true) ||
+      !sCopyToUser(bufAddr, buf, actualLen)) {
     kmutexWUnlockRecord(&currentThread->process->memlock,
         &currentThread->memLockStatus);
     sfree(buf, len);
     return -1;
   }
-
-  memcpy((void*)bufAddr, buf, actualLen);
   sfree(buf, len);
   kmutexWUnlockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
@@ -116,7 +115,7 @@ int readline_Internal(SyscallParams params) {
 }
 
 int getchar_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   occupyKeyboard(currentThread->process->vcNumber);
   int actualLen = getcharBlocking(currentThread->process->vcNumber);
   releaseKeyboard(currentThread->process->vcNumber);
@@ -125,7 +124,7 @@ int getchar_Internal(SyscallParams params) {
 }
 
 int print_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
 
   int len;
   uint32_t bufAddr;
@@ -158,9 +157,9 @@ int print_Internal(SyscallParams params) {
     return -1;
   }
 
-  int actualLen = sGetString(bufAddr, source, len);
-  if (actualLen == -1) {
-    // invalid string
+  // One bulk copy, validated page by page
+  if (!sCopyFromUser(source, bufAddr, len)) {
+    // invalid buffer
     sfree(source, len);
     kmutexRUnlockRecord(&currentThread->process->memlock,
         &currentThread->memLockStatus);
@@ -169,13 +168,16 @@ int print_Internal(SyscallParams params) {
   kmutexRUnlockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
 
+  // Stop at the first '\0', as sGetString does
+  int actualLen = 0;
+  while (actualLen < len && source[actualLen] != '\0') actualLen++;
   putbytes(currentThread->process->vcNumber, source, actualLen);
   sfree(source, len);
   return 0;
 }
 
 int set_term_color_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   int color;
   kmutexRLockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
@@ -192,7 +194,7 @@ int set_term_color_Internal(SyscallParams params) {
 }
 
 int set_cursor_pos_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   int row, col;
   kmutexRLockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
@@ -216,7 +218,7 @@ int set_cursor_pos_Internal(SyscallParams params) {
 
 int get_cursor_pos_Internal(SyscallParams params) {
   int row, col;
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   get_cursor(currentThread->process->vcNumber, &row, &col);
 
   int rowAddr, colAddr;
@@ -234,15 +236,13 @@ int get_cursor_pos_Internal(SyscallParams params) {
         &currentThread->memLockStatus);
     return -1;
   }
-  if (!verifyUserSpaceAddr(rowAddr, rowAddr + sizeof(int) - 1, true) ||
-      !verifyUserSpaceAddr(colAddr, colAddr + sizeof(int) - 1, true)) {
+  if (!verifyUserSpaceAddr(colAddr, colAddr + sizeof(int) - 1, true) ||
+      !sSetInt(rowAddr, row) || !sSetInt(colAddr, col)) {
     // row/col destination is not writable
     kmutexWUnlockRecord(&currentThread->process->memlock,
         &currentThread->memLockStatus);
     return -1;
   }
-  *((int*)rowAddr) = row;
-  *((int*)colAddr) = col;
   kmutexWUnlockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
 
@@ -32,6 +32,7 @@
 #include "keyboard_event.h"
 #include "virtual_console.h"
 #include "page.h"
+#include "image_cache.h"
 
 #define MISBEHAVE_NUM_SHOW_EVERYTHING 701
 
@@ -40,6 +41,7 @@ void dumpAll() {
   LocalLockR();
   lprintf("LevyOS Kernel Status──────────────────────────────────");
   reportUserMem();
+  reportImageCache();
   reportProcessAndThread();
   reportCPU();
   reportKernelMemAlloc();
@@ -49,7 +51,7 @@ void dumpAll() {
 }
 
 int misbehave_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   int num;
   kmutexRLockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
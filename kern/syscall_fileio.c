@@ -32,7 +32,7 @@
 #define MAX_ACCEPTABLE_FILENAME_LEN 256
 
 int readfile_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
 
   int len, offset;
   uint32_t filename, buf;
@@ -134,7 +134,8 @@ int readfile_Internal(SyscallParams params) {
       // use byteToRead as check length instead of byteRead. Since this is what
       // user thinks it should be valid
       if (!verifyUserSpaceAddr(buf + offset,
-                               buf + offset + byteToRead - 1, true)) {
+                               buf + offset + byteToRead - 1, true) ||
+          !sCopyToUser(buf + offset, bufferKernel, actualRead)) {
         // user space is not available to write
         kmutexWUnlockRecord(&currentThread->process->memlock,
             &currentThread->memLockStatus);
@@ -142,7 +143,6 @@ int readfile_Internal(SyscallParams params) {
         sfree(bufferKernel, FILE_IO_BUFFER);
         return -1;
       }
-      memcpy((void*)(buf + offset), bufferKernel, actualRead);
       kmutexWUnlockRecord(&currentThread->process->memlock,
           &currentThread->memLockStatus);
 
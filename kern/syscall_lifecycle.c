@@ -23,9 +23,10 @@
 #include "zeus.h"
 #include "loader.h"
 #include "source_untrusted.h"
+#include "virtual_console.h"
 
 int task_vanish_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   lprintf("WARNING: Dummy task vanish is called by thread #%d of proc #%d. "
           "We just spin",
           currentThread->id, currentThread->process->id);
@@ -47,7 +48,7 @@ int halt_Internal(SyscallParams params) {
 
 int fork_Internal(SyscallParams params) {
   // We own currentThread
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   // Precheck: the process has only one thread
   kmutexRLock(&currentThread->process->mutex);
   if (currentThread->process->numThread > 1) {
@@ -61,7 +62,7 @@ int fork_Internal(SyscallParams params) {
 
 int wait_Internal(SyscallParams params) {
   // We own currentThread
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
 
   uint32_t statusPtr;
   kmutexRLockRecord(&currentThread->process->memlock,
@@ -89,13 +90,12 @@ int wait_Internal(SyscallParams params) {
     // We need to double check, we dont know what happened when we sleep
     kmutexWLockRecord(&currentThread->process->memlock,
         &currentThread->memLockStatus);
-    if (!verifyUserSpaceAddr(statusPtr, statusPtr + sizeof(int) - 1, true)) {
+    if (!sSetInt(statusPtr, retAddr)) {
       // the address is not writable
       kmutexWUnlockRecord(&currentThread->process->memlock,
           &currentThread->memLockStatus);
       return -1;
     }
-    *((int*)statusPtr) = retAddr;
     kmutexWUnlockRecord(&currentThread->process->memlock,
         &currentThread->memLockStatus);
   }
@@ -105,14 +105,14 @@ int wait_Internal(SyscallParams params) {
 
 int vanish_Internal(SyscallParams params) {
   // We own currentThread
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   // one way trip
   terminateThread(currentThread);
   return 0;
 }
 
 int set_status_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
 
   int status;
   kmutexRLockRecord(&currentThread->process->memlock,
@@ -132,24 +132,12 @@ int set_status_Internal(SyscallParams params) {
   return 0;
 }
 
-int exec_Internal(SyscallParams params) {
-  // We own currentThread
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
-  // Precheck: the process has only one thread
-  kmutexRLock(&currentThread->process->mutex);
-  if (currentThread->process->numThread > 1) {
-    kmutexRUnlock(&currentThread->process->mutex);
-    // We reject a multithread process to fork
-    return -1;
-  }
-  kmutexRUnlock(&currentThread->process->mutex);
-
-  // Then we needn't the lock, since we know that the process only have this
-  // thread
-
+// Copy execname (param 0) and argvec (param 1) to a new smalloc'd ArgPackage.
+// Return NULL if any of them is invalid
+static ArgPackage* loadArgPackage(SyscallParams params) {
   ArgPackage* pkg = (ArgPackage*)smalloc(sizeof(ArgPackage));
   if (!pkg) {
-    panic("exec_Internal: no kernel space");
+    panic("loadArgPackage: no kernel space");
   }
 
   // Verify and load execName
@@ -157,13 +145,13 @@ int exec_Internal(SyscallParams params) {
   if (!parseMultiParam(params, 0, &execName)) {
     // the pointer syscall package itself is invalid
     sfree(pkg, sizeof(ArgPackage));
-    return -1;
+    return NULL;
   }
   int execLen = sGetString((uint32_t)execName, pkg->c[0], ARGPKG_MAX_ARG_LEN);
   if (execLen == ARGPKG_MAX_ARG_LEN || execLen == -1) {
     // the string is too long, or is invalid
     sfree(pkg, sizeof(ArgPackage));
-    return -1;
+    return NULL;
   }
 
   // Verify and load argvec
@@ -171,25 +159,26 @@ int exec_Internal(SyscallParams params) {
   if (!parseMultiParam(params, 1, &argvec)) {
     // the pointer syscall package itself is invalid
     sfree(pkg, sizeof(ArgPackage));
-    return -1;
+    return NULL;
   }
+  // Take a kernel copy of argvec, so it's validated only once
+  uint32_t argPtrs[ARGPKG_MAX_ARG_COUNT];
   int argvecLen = sGeUIntArray(
-      (uint32_t)argvec, NULL, ARGPKG_MAX_ARG_COUNT - 1);
+      (uint32_t)argvec, argPtrs, ARGPKG_MAX_ARG_COUNT - 1);
   if (argvecLen == ARGPKG_MAX_ARG_COUNT - 1 || argvecLen == -1 ||
       argvecLen == 0) {
     // too many args or invalid array or no args (even the 1st one), abort
     sfree(pkg, sizeof(ArgPackage));
-    return -1;
+    return NULL;
   }
   // Fetch every string to arg pakage, skip the first one
   for (int i = 1; i < argvecLen; i++) {
     memset(pkg->c[i], 0, ARGPKG_MAX_ARG_LEN);
-    int argstrLen = sGetString(
-        ((uint32_t*)(argvec))[i] , pkg->c[i], ARGPKG_MAX_ARG_LEN);
+    int argstrLen = sGetString(argPtrs[i], pkg->c[i], ARGPKG_MAX_ARG_LEN);
     if (argstrLen == ARGPKG_MAX_ARG_LEN || argstrLen == -1) {
       // some argument is too long or invalid
       sfree(pkg, sizeof(ArgPackage));
-      return -1;
+      return NULL;
     }
   }
   // Add terminator
@@ -199,6 +188,26 @@ int exec_Internal(SyscallParams params) {
   #ifdef VERBOSE_PRINT
   printArgPackage(pkg);
   #endif
+  return pkg;
+}
+
+int exec_Internal(SyscallParams params) {
+  // We own currentThread
+  tcb* currentThread = getRunningThread();
+  // Precheck: the process has only one thread
+  kmutexRLock(&currentThread->process->mutex);
+  if (currentThread->process->numThread > 1) {
+    kmutexRUnlock(&currentThread->process->mutex);
+    // We reject a multithread process to fork
+    return -1;
+  }
+  kmutexRUnlock(&currentThread->process->mutex);
+
+  // Then we needn't the lock, since we know that the process only have this
+  // thread
+
+  ArgPackage* pkg = loadArgPackage(params);
+  if (!pkg) return -1;
 
   execProcess(currentThread, pkg->c[0], pkg);
 
@@ -206,3 +215,49 @@ int exec_Internal(SyscallParams params) {
   sfree(pkg, sizeof(ArgPackage));
   return -1;
 }
+
+int vfork_Internal(SyscallParams params) {
+  // We own currentThread
+  tcb* currentThread = getRunningThread();
+  // Precheck: the process has only one thread
+  kmutexRLock(&currentThread->process->mutex);
+  if (currentThread->process->numThread > 1) {
+    kmutexRUnlock(&currentThread->process->mutex);
+    // We reject a multithread process to fork
+    return -1;
+  }
+  kmutexRUnlock(&currentThread->process->mutex);
+  return vforkProcess(currentThread);
+}
+
+int spawn_Internal(SyscallParams params) {
+  // We own currentThread
+  tcb* currentThread = getRunningThread();
+  pcb* currentProc = currentThread->process;
+
+  // Other threads may be here, so the memory must be locked
+  kmutexRLockRecord(&currentProc->memlock, &currentThread->memLockStatus);
+  ArgPackage* pkg = loadArgPackage(params);
+  int console;
+  if (!pkg || !parseMultiParam(params, 2, &console)) {
+    kmutexRUnlockRecord(&currentProc->memlock, &currentThread->memLockStatus);
+    if (pkg) sfree(pkg, sizeof(ArgPackage));
+    return -1;
+  }
+  kmutexRUnlockRecord(&currentProc->memlock, &currentThread->memLockStatus);
+
+  // Negative console number for my own console
+  if (console < 0) {
+    kmutexRLock(&currentProc->mutex);
+    console = currentProc->vcNumber;
+    referVirtualConsole(console);
+    kmutexRUnlock(&currentProc->mutex);
+  } else if (!tryReferVirtualConsole(console)) {
+    sfree(pkg, sizeof(ArgPackage));
+    return -1;
+  }
+
+  int ret = spawnProcess(currentThread, pkg, console);
+  sfree(pkg, sizeof(ArgPackage));
+  return ret;
+}
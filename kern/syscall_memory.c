@@ -24,66 +24,159 @@
 #include "vm.h"
 #include "pm.h"
 #include "source_untrusted.h"
+#include "sysconf.h"
+#include "region.h"
 
-#define PAGE_STAMP_USR_HEAD 1
-#define PAGE_STAMP_USR_BODY 2
-
-// Not multithread safe, must protected under process-memlock
-// Register new user page and stamp then in the page table, start from base with
-// length len. base and len must page aligned
-// Maybe partial success, return value = endAddr, so that [base, endAddr) is
-// registered, and the caller may want to rollback
-static uint32_t _registerNewPage(PageDirectory pd, uint32_t base,
+#ifdef NEW_PAGES_LARGE_PAGE
+// Not multithread safe, must protected under process-memlock, and pd must be
+// active. base and len must be 4MiB aligned.
+// Try to register [base, base + len) by 4MiB large pages, which are allocated
+// and zeroed eagerly. All or nothing, return false if any page directory entry
+// in the range is taken, or there's no enough contiguous memory
+static bool _registerNewLargePage(PageDirectory pd, uint32_t base,
     uint32_t len) {
   for (uint32_t currentPage = base; currentPage != base + len;
-      currentPage += PAGE_SIZE) {
-    // overlap is okay!
-    if (searchPTEntryPageDirectory(pd, currentPage)) {
-      // current address is presented, abort!
-      return currentPage;
-    }
-    uint32_t pm = getUserMemPageZFOD();
+      currentPage += LARGE_PAGE_SIZE) {
+    // A page table may be left by pages removed before
+    if (PE_IS_PRESENT(pd[STRIP_PD_INDEX(currentPage)])) return false;
+  }
+  for (uint32_t currentPage = base; currentPage != base + len;
+      currentPage += LARGE_PAGE_SIZE) {
+    uint32_t pm = getUserMemPagesContiguous(PM_MAX_ORDER);
     if (!pm) {
-      // Huh, no free memory available, abort!
-      return currentPage;
+      // Roll back what's been mapped
+      for (uint32_t page = base; page != currentPage;
+          page += LARGE_PAGE_SIZE) {
+        PDE* pde = &pd[STRIP_PD_INDEX(page)];
+        for (int i = 0; i < PT_SIZE; i++) {
+          freeUserMemPage(PE_DECODE_ADDR(*pde) + i * PAGE_SIZE);
+        }
+        *pde = EMPTY_PDE;
+        invalidateTLB(page);
+      }
+      return false;
     }
-    // We are good to go
-    createMapPageDirectory(pd, currentPage, pm, true, false);
-    PTE* createdPTE = searchPTEntryPageDirectory(pd, currentPage);
-    // stamp the page table (use bit 9/10/11)
-    *createdPTE |= PE_ENCODE_CUSTOM(currentPage == base ?
-        PAGE_STAMP_USR_HEAD : PAGE_STAMP_USR_BODY);
-  }
-  return base + len;
+    createLargeMapPageDirectory(pd, currentPage, pm, true, true);
+    memset((void*)currentPage, 0, LARGE_PAGE_SIZE);
+  }
+  return true;
 }
+#endif
 
-// We judge the length by page stamp!
-static bool _unregisterNewPage(PageDirectory pd, uint32_t base) {
-  for (uint32_t currentPage = base; /* NO END! */; currentPage += PAGE_SIZE) {
-    PTE* createdPTE = searchPTEntryPageDirectory(pd, currentPage);
-    if (currentPage == base &&
-        PE_DECODE_CUSTOM(*createdPTE) != PAGE_STAMP_USR_HEAD) {
-      // You liar, it's not the head of user allocated memory
-      return false;
-    }
-    if (currentPage != base &&
-        PE_DECODE_CUSTOM(*createdPTE) != PAGE_STAMP_USR_BODY) {
-      // Oh, we are done!
+// Not multithread safe, must protected under process-memlock
+// Register [base, base + len) as a new region of proc. base and len must be
+// page aligned, and the range must be in user space.
+// The region is lazily populated: all of its pages are reserved as ZFOD in one
+// batch, but nothing goes to page table until it's touched (see ZFODUpgrader
+// in fault.c). All or nothing, nothing is registered on failure.
+// A vfork() child cannot change its address space
+static bool _registerNewPage(pcb* proc, uint32_t base, uint32_t len) {
+  if (proc->vforkParent) {
+    // The region tree belongs to my parent, leave it alone
+    return false;
+  }
+  region* reg = insertRegion(&proc->memMeta.regions, base, base + (len - 1),
+      REGION_NEW_PAGES);
+  if (!reg) {
+    // Overlapping with others, or no kernel memory for the region
+    return false;
+  }
+  #ifdef NEW_PAGES_LARGE_PAGE
+    if (IS_LARGE_PAGE_ALIGNED(base) && IS_LARGE_PAGE_ALIGNED(len) &&
+        _registerNewLargePage(proc->pd, base, len)) {
+      reg->flags |= REGION_LARGE;
       return true;
     }
-    freeUserMemPage(PE_DECODE_ADDR(*createdPTE));
-    *createdPTE = PE_PRESENT(0) | PE_WRITABLE(0) | PE_USERMODE(0) |
-                  PE_WRITETHROUGH_CACHE(0) | PE_DISABLE_CACHE(0) |
-                  PE_SIZE_FLAG(0);
-    invalidateTLB(currentPage);
-  }
-  // No we ain't gonna reach here
-  return false;
+    // Otherwise fall back to ZFOD 4k pages
+  #endif
+  uint32_t zfod = getUserMemPagesZFOD(len / PAGE_SIZE);
+  if (!zfod) {
+    // Huh, no free memory available, abort!
+    removeRegion(&proc->memMeta.regions, base);
+    return false;
+  }
+  reg->reserved = len / PAGE_SIZE;
+  reg->zfod = zfod;
+  return true;
+}
+
+// Return the slot of page in page table (or page directory, for large page),
+// whether it's present or not, and set *step to the size the slot covers. Or
+// return NULL if there's no page table for the page, and *step is the size to
+// skip to the next page table
+static PTE* _pageSlot(PageDirectory pd, uint32_t page, uint32_t* step) {
+  PDE* pde = &pd[STRIP_PD_INDEX(page)];
+  if (PE_IS_LARGE(*pde)) {
+    *step = LARGE_PAGE_SIZE;
+    return pde;
+  }
+  if (!PE_IS_PRESENT(*pde)) {
+    *step = LARGE_PAGE_SIZE - (page & (LARGE_PAGE_SIZE - 1));
+    return NULL;
+  }
+  *step = PAGE_SIZE;
+  return &PDE2PT(*pde)[STRIP_PT_INDEX(page)];
+}
+
+// Not multithread safe, must protected under process-memlock
+// Remove the new_pages() region starting at base. It goes in two passes: the
+// first takes all populated pages off (but keeps their frames in the slot),
+// and flush them from TLB in one batch; then the second gives the frames back
+// in batches. Pages not populated are just reservations
+static bool _unregisterNewPage(pcb* proc, uint32_t base) {
+  PageDirectory pd = proc->pd;
+  if (proc->vforkParent) return false;
+  region* reg = findRegion(proc->memMeta.regions, base);
+  if (!reg || reg->start != base || !(reg->flags & REGION_NEW_PAGES)) {
+    // You liar, it's not the head of user allocated memory
+    return false;
+  }
+
+  TLBBatch tlb;
+  initTLBBatch(&tlb);
+  uint32_t step;
+  for (uint32_t currentPage = base; ; currentPage += step) {
+    PTE* slot = _pageSlot(pd, currentPage, &step);
+    if (slot && PE_IS_PRESENT(*slot)) {
+      *slot &= ~PE_PRESENT(1);
+      addTLBBatch(&tlb, currentPage, 1);
+    }
+    // We cannot use for loop to detect overrange, last may be 0xffffffff
+    if (reg->last - currentPage < step) break;
+  }
+  flushTLBBatch(&tlb);
+
+  uint32_t toFree[PM_FREE_BATCH];
+  int toFreeCount = 0;
+  for (uint32_t currentPage = base; ; currentPage += step) {
+    PTE* slot = _pageSlot(pd, currentPage, &step);
+    if (slot && PE_DECODE_ADDR(*slot) != 0) {
+      // A large page is made of PT_SIZE contiguous frames, and a large page
+      // region is always made of whole large pages
+      int frames = PE_IS_LARGE(*slot) ? PT_SIZE : 1;
+      uint32_t firstFrame = PE_DECODE_ADDR(*slot);
+      *slot = PE_PRESENT(0) | PE_WRITABLE(0) | PE_USERMODE(0) |
+              PE_WRITETHROUGH_CACHE(0) | PE_DISABLE_CACHE(0) |
+              PE_SIZE_FLAG(0);
+      for (int i = 0; i < frames; i++) {
+        toFree[toFreeCount++] = firstFrame + i * PAGE_SIZE;
+        if (toFreeCount == PM_FREE_BATCH) {
+          freeUserMemPages(toFree, toFreeCount);
+          toFreeCount = 0;
+        }
+      }
+    }
+    if (reg->last - currentPage < step) break;
+  }
+  freeUserMemPages(toFree, toFreeCount);
+  freeUserMemPagesZFOD(reg->reserved);
+  removeRegion(&proc->memMeta.regions, base);
+  return true;
 }
 
 int new_pages_Internal(SyscallParams params) {
   // We own currentThread
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
 
   kmutexRLockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
@@ -102,13 +195,25 @@ int new_pages_Internal(SyscallParams params) {
     // invalid length or base
     return -1;
   }
+  // base of NULL asks for any free range of len bytes
+  bool findHole = base == 0;
+  if (!findHole &&
+      (base < USER_MEM_START || base + (len - 1) < base)) {
+    // Part of the space is in kernel, or wraps around
+    return -1;
+  }
 
   kmutexWLockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
-  uint32_t end = _registerNewPage(currentThread->process->pd, base, len);
-  if (end != base + len) {
-    // partial success, we roll back
-    if (end != base) _unregisterNewPage(currentThread->process->pd, base);
+  if (findHole &&
+      !findRegionHole(currentThread->process->memMeta.regions,
+          USER_MEM_START, 0xffffffff, len, &base)) {
+    // No hole large enough
+    kmutexWUnlockRecord(&currentThread->process->memlock,
+        &currentThread->memLockStatus);
+    return -1;
+  }
+  if (!_registerNewPage(currentThread->process, base, len)) {
     kmutexWUnlockRecord(&currentThread->process->memlock,
         &currentThread->memLockStatus);
     return -1;
@@ -116,15 +221,14 @@ int new_pages_Internal(SyscallParams params) {
   // We are done!
   kmutexWUnlockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
-  return 0;
+  // A page aligned base never collides with -1
+  return findHole ? (int)base : 0;
 }
 
-// We take advantage of custom bits in page table entry to mark allocated memory
-// and boundary. PAGE_STAMP_USR_HEAD for the first page allocated in one call,
-// and PAGE_STAMP_USR_BODY for the rest pages allocated in one call.
+// Every new_pages() call makes a region, which remembers where it ends
 int remove_pages_Internal(SyscallParams params) {
   // We own currentThread
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
 
   kmutexRLockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
@@ -145,7 +249,7 @@ int remove_pages_Internal(SyscallParams params) {
 
   kmutexWLockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
-  bool result = _unregisterNewPage(currentThread->process->pd, base);
+  bool result = _unregisterNewPage(currentThread->process, base);
   kmutexWUnlockRecord(&currentThread->process->memlock,
       &currentThread->memLockStatus);
 
@@ -38,12 +38,12 @@ int get_ticks_Internal(SyscallParams params) {
 }
 
 int thread_fork_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   return forkThread(currentThread);
 }
 
 int make_runnable_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   int tid;
 
   kmutexRLockRecord(&currentThread->process->memlock,
@@ -99,7 +99,7 @@ int make_runnable_Internal(SyscallParams params) {
 }
 
 int deschedule_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   uint32_t rejectAddr;
 
   // Use wlock to exclude make runnable
@@ -138,7 +138,7 @@ int deschedule_Internal(SyscallParams params) {
 }
 
 int yield_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   int tid;
 
   kmutexRLockRecord(&currentThread->process->memlock,
@@ -181,7 +181,7 @@ int yield_Internal(SyscallParams params) {
 }
 
 int sleep_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   int ticks;
 
   kmutexRLockRecord(&currentThread->process->memlock,
@@ -202,7 +202,7 @@ int sleep_Internal(SyscallParams params) {
 }
 
 int swexn_Internal(SyscallParams params) {
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   uint32_t esp3, eip, uregAddr;
   int userArg;
 
@@ -1,10 +1,14 @@
 /** @file timeout.c
  *
- *  @brief Timeout manager, now only controls sleep()
+ *  @brief Timeout manager, controls sleep() and any other timed wait
  *
  *  Timeout manager works in similar way to keyboard event handler. It keeps all
- *  waiters (sleepers) in a monotonous queue sorted by wakeup time, and timer
- *  event will dequeue sleeping threads and unblock them,
+ *  pending timeouts in a binary min-heap keyed by wakeup time, and timer event
+ *  will pop expired ones and unblock their threads. So registering and
+ *  cancelling a timeout take O(log N), and each tick takes O(expired * log N)
+ *
+ *  Each timeout remembers its position in the heap, so that it can be
+ *  cancelled without searching.
  *
  *  @author Leiyu Zhao
  */
@@ -24,18 +28,22 @@
 #include "cpu.h"
 #include "process.h"
 #include "scheduler.h"
+#include "timeout.h"
+
+// Initial capacity of the heap, it doubles when it's full
+#define INITIAL_HEAP_CAPACITY 64
 
-typedef struct _timeoutStatus {
-  tcb* thread;
-  uint32_t waitUntil;
-  struct _timeoutStatus* next;
-} timeoutStatus;
+#define HEAP_PARENT(i) (((i) - 1) / 2)
+#define HEAP_LEFT(i) ((i) * 2 + 1)
 
-static timeoutStatus* sleepers;
+static timeoutStatus** heap;
+static int heapSize;
+static int heapCapacity;
 static CrossCPULock latch;
 static uint32_t tickVal;
 
 static void insertTimeoutStatus(timeoutStatus* toInsert);
+static void removeTimeoutStatus(timeoutStatus* toRemove);
 static timeoutStatus* tryRemoveTimeoutStatus();
 static void alarm();
 
@@ -43,27 +51,59 @@ static void alarm();
 void initTimeout() {
   initCrossCPULock(&latch);
   tickVal = 0;
+  heapSize = 0;
+  heapCapacity = INITIAL_HEAP_CAPACITY;
+  heap = smalloc(sizeof(timeoutStatus*) * heapCapacity);
+  if (!heap) {
+    panic("initTimeout: no kernel space for timeout heap.");
+  }
 }
 
-void onTickEvent() {
-  __sync_fetch_and_add(&tickVal, 1);
+void onTickEvent(uint32_t ticks) {
+  __sync_fetch_and_add(&tickVal, ticks);
   alarm();
 }
 
+uint32_t ticksToNextTimeout() {
+  GlobalLockR(&latch);
+  uint32_t ret = 0xffffffff;
+  if (heapSize > 0) {
+    ret = heap[0]->waitUntil > tickVal ? heap[0]->waitUntil - tickVal : 1;
+  }
+  GlobalUnlockR(&latch);
+  return ret;
+}
+
 uint32_t getTicks() {
   return tickVal;
 }
 
+void setTimeout(timeoutStatus* ts, tcb* thread, uint32_t ticks) {
+  ts->thread = thread;
+  ts->waitUntil = tickVal + ticks;
+  insertTimeoutStatus(ts);
+}
+
+bool cancelTimeout(timeoutStatus* ts) {
+  GlobalLockR(&latch);
+  if (ts->_heapIndex < 0) {
+    // Too late, it has been popped by alarm
+    GlobalUnlockR(&latch);
+    return false;
+  }
+  removeTimeoutStatus(ts);
+  GlobalUnlockR(&latch);
+  return true;
+}
+
 void sleepFor(uint32_t ticks) {
   if (ticks == 0) return;
-  tcb* currentThread = findTCB(getLocalCPU()->runningTID);
+  tcb* currentThread = getRunningThread();
   assert(currentThread != NULL);
 
   timeoutStatus ts;
-  ts.thread = currentThread;
-  ts.waitUntil = tickVal + ticks;
   GlobalLockR(&latch);
-  insertTimeoutStatus(&ts);
+  setTimeout(&ts, currentThread, ticks);
   currentThread->descheduling = true;
   currentThread->status = THREAD_BLOCKED;
   removeFromXLX(currentThread);
@@ -89,44 +129,87 @@ static void alarm() {
     timeoutStatus* ts = tryRemoveTimeoutStatus();
     if (!ts) break;
     assert(ts->thread->status == THREAD_BLOCKED);
-    addToXLX(ts->thread);
+    addToXLXOnWakeup(ts->thread);
     ts->thread->status = THREAD_RUNNABLE;
   }
   alarmSingleInstanceGuard = 0;
 }
 
+// All heap operations below must run with latch acquired
+
+static void heapSet(int index, timeoutStatus* ts) {
+  heap[index] = ts;
+  ts->_heapIndex = index;
+}
+
+static void siftUp(int index) {
+  timeoutStatus* ts = heap[index];
+  while (index > 0 && ts->waitUntil < heap[HEAP_PARENT(index)]->waitUntil) {
+    heapSet(index, heap[HEAP_PARENT(index)]);
+    index = HEAP_PARENT(index);
+  }
+  heapSet(index, ts);
+}
+
+static void siftDown(int index) {
+  timeoutStatus* ts = heap[index];
+  while (HEAP_LEFT(index) < heapSize) {
+    int child = HEAP_LEFT(index);
+    if (child + 1 < heapSize &&
+        heap[child + 1]->waitUntil < heap[child]->waitUntil) {
+      child++;
+    }
+    if (ts->waitUntil <= heap[child]->waitUntil) break;
+    heapSet(index, heap[child]);
+    index = child;
+  }
+  heapSet(index, ts);
+}
+
 static void insertTimeoutStatus(timeoutStatus* toInsert) {
   GlobalLockR(&latch);
-  timeoutStatus** fromPtr = &sleepers;
-  while (true) {
-    if (*fromPtr == NULL) {
-      // Now it's the largest waiter
-      break;
+  if (heapSize == heapCapacity) {
+    timeoutStatus** newHeap =
+        smalloc(sizeof(timeoutStatus*) * heapCapacity * 2);
+    if (!newHeap) {
+      panic("insertTimeoutStatus: no kernel space to grow timeout heap.");
     }
-    if (toInsert->waitUntil < (*fromPtr)->waitUntil) {
-      // Okay looks like a good spot, I'm right behind you
-      break;
-    }
-    fromPtr = &(*fromPtr)->next;
+    memcpy(newHeap, heap, sizeof(timeoutStatus*) * heapCapacity);
+    sfree(heap, sizeof(timeoutStatus*) * heapCapacity);
+    heap = newHeap;
+    heapCapacity *= 2;
   }
-  toInsert->next = *fromPtr;
-  *fromPtr = toInsert;
+  heapSet(heapSize++, toInsert);
+  siftUp(toInsert->_heapIndex);
   GlobalUnlockR(&latch);
 }
 
+static void removeTimeoutStatus(timeoutStatus* toRemove) {
+  int index = toRemove->_heapIndex;
+  assert(index >= 0 && index < heapSize && heap[index] == toRemove);
+  toRemove->_heapIndex = -1;
+  heapSize--;
+  if (index == heapSize) return;
+  // Fill the hole with the last one, and restore heap order from there
+  timeoutStatus* moved = heap[heapSize];
+  heapSet(index, moved);
+  siftUp(index);
+  siftDown(moved->_heapIndex);
+}
+
 static timeoutStatus* tryRemoveTimeoutStatus() {
   GlobalLockR(&latch);
-  if (sleepers == NULL) {
+  if (heapSize == 0) {
     GlobalUnlockR(&latch);
     return NULL;
   }
-  if (sleepers->waitUntil > tickVal) {
+  if (heap[0]->waitUntil > tickVal) {
     // the smallest sleeper shouln't be waked.
     GlobalUnlockR(&latch);
     return NULL;
   }
-  timeoutStatus* ret = sleepers;
-  sleepers = sleepers->next;
+  timeoutStatus* ret = heap[0];
+  removeTimeoutStatus(ret);
   GlobalUnlockR(&latch);
   return ret;
 }
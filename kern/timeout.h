@@ -1,6 +1,6 @@
 /** @file timeout.h
  *
- *  @brief Timeout manager, now only controls sleep()
+ *  @brief Timeout manager, controls sleep() and any other timed wait
  *
  *  @author Leiyu Zhao
  */
@@ -8,20 +8,47 @@
 #ifndef TIMEOUT_H
 #define TIMEOUT_H
 
+#include <stdint.h>
+
 #include "bool.h"
+#include "process.h"
+
+// One pending timeout. It's owned by the waiter (usually on its kernel stack)
+// and should stay alive until it fires or is cancelled.
+typedef struct {
+  // the thread to wake up when timeout fires. It must be BLOCKED by then
+  tcb* thread;
+  uint32_t waitUntil;
+  // Position in the heap, -1 when it's not pending. Internal use only
+  int _heapIndex;
+} timeoutStatus;
 
 // initialize timeout module, must be called in kenel INIT
 void initTimeout();
 
-// need to be called on each timer fires. It's reentrant safe, multithread safe,
-// and the caller don't have to call it asynchronously (i.e. call it before ack
-// timer interrupt)
-void onTickEvent();
+// need to be called on each timer fires, with the number of ticks passed since
+// last call. It's reentrant safe, multithread safe, and the caller don't have
+// to call it asynchronously (i.e. call it before ack timer interrupt)
+void onTickEvent(uint32_t ticks);
+
+// Number of ticks until the earliest pending timeout fires, at least 1.
+// 0xffffffff if there's no pending timeout.
+uint32_t ticksToNextTimeout();
 
 // Thread call it to sleep for at least given tics.
 // It will not returned until the period has passed.
 void sleepFor(uint32_t ticks);
 
+// Register a timeout that wakes thread up (see addToXLXOnWakeup) after at least
+// given ticks. The caller is responsible for blocking thread before that, and
+// usually it's done within the same critical section as registering.
+void setTimeout(timeoutStatus* ts, tcb* thread, uint32_t ticks);
+
+// Cancel a pending timeout. Return true if it's cancelled before firing, so
+// the thread will not be waked up by it. Otherwise the timeout has fired (or is
+// firing), and the thread is (or will soon be) waked up by timeout manager.
+bool cancelTimeout(timeoutStatus* ts);
+
 // get the current ticks.
 uint32_t getTicks();
 
@@ -15,34 +15,91 @@
 #include "int_handler.h"
 #include "timer_driver.h"
 #include "x86/asm.h"
+#include "x86/eflags.h"
 #include "x86/interrupt_defines.h"
 #include "x86/seg.h"
 #include "x86/timer_defines.h"
 
+// PIT counts of one 10ms tick
+#define TICK_COUNTS (TIMER_RATE / 100)
+// Channel 0, lo/hi byte, rate generator. Unlike square wave, the count goes
+// down by one per PIT clock, so it tells how long the period has run
+#define TIMER_RATE_GENERATOR 0x34
+// Channel 0, latch the count for read
+#define TIMER_LATCH_COUNT 0x00
+// OCW3 for master PIC to read its interrupt request register on next inb
+#define PIC_READ_IRR 0x0a
+
 static TimerCallback cb;
 static unsigned int epoch;
+// in 10ms, how long it takes for the timer to fire once
+static int period;
+// PIT counts less than one tick, run in periods cut short by setTimerPeriod
+static uint32_t residue;
+
+static void programTimer(int ticks) {
+  int interval = TICK_COUNTS * ticks;
+  outb(TIMER_MODE_IO_PORT, TIMER_RATE_GENERATOR);
+  outb(TIMER_PERIOD_IO_PORT, interval & 0xff);
+  outb(TIMER_PERIOD_IO_PORT, (interval >> 8) & 0xff);
+}
+
+// Must run with interrupts disabled. The period is about to be cut short by
+// a new one: credit the time it has run to epoch, so that an early wakeup from
+// tickless idle doesn't put epoch behind
+static void creditElapsed(int newPeriod) {
+  outb(TIMER_MODE_IO_PORT, TIMER_LATCH_COUNT);
+  uint32_t count = inb(TIMER_PERIOD_IO_PORT);
+  count |= (uint32_t)inb(TIMER_PERIOD_IO_PORT) << 8;
+  uint32_t elapsed = TICK_COUNTS * period - count;
+
+  outb(INT_CTL_PORT, PIC_READ_IRR);
+  if (inb(INT_CTL_PORT) & 1) {
+    // The period has already fired, and the count is from the next one. The
+    // pending interrupt is handled after the new period is set, and only
+    // credits newPeriod of the full period
+    epoch += period - newPeriod;
+  }
+  residue += elapsed;
+  epoch += residue / TICK_COUNTS;
+  residue %= TICK_COUNTS;
+}
 
 // Install the timer driver. For any errors return negative integer;
 // otherwise return 0;
 int install_timer_driver(TimerCallback callback) {
   cb = callback;
   epoch = 0;
-  int intervalFor10ms = TIMER_RATE / 100;
+  period = 1;
+  residue = 0;
   int32_t* idtBase = (int32_t*)idt_base();
   idtBase[TIMER_IDT_ENTRY << 1] = ENCRYPT_IDT_TRAPGATE_LSB(
     0, (int32_t)timerIntHandler, 1, SEGSEL_KERNEL_CS, 1);
   idtBase[(TIMER_IDT_ENTRY << 1) + 1] = ENCRYPT_IDT_TRAPGATE_MSB(
     0, (int32_t)timerIntHandler, 1, SEGSEL_KERNEL_CS, 1);
-  outb(TIMER_MODE_IO_PORT, TIMER_SQUARE_WAVE);
-  outb(TIMER_PERIOD_IO_PORT, intervalFor10ms & 0xff);
-  outb(TIMER_PERIOD_IO_PORT, (intervalFor10ms >> 8) & 0xff);
+  programTimer(period);
   return 0;
 }
 
+int setTimerPeriod(int ticks) {
+  if (ticks < 1) ticks = 1;
+  if (ticks > MAX_TIMER_PERIOD) ticks = MAX_TIMER_PERIOD;
+  if (period == ticks) return ticks;
+  // Don't let timer interrupt see half-programmed PIT. Restore IF afterwards,
+  // since caller may or may not have interrupts disabled
+  uint32_t eflags = get_eflags();
+  disable_interrupts();
+  creditElapsed(ticks);
+  period = ticks;
+  programTimer(period);
+  set_eflags(eflags);
+  return ticks;
+}
+
 // The entry for handling the timer interrupt event from intHandler
 // It will also send ACK after the callback returns
 void timerIntHandlerInternal() {
-  epoch++;
+  epoch += period;
   outb(INT_CTL_PORT, INT_ACK_CURRENT);
   cb(epoch);
 }
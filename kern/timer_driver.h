@@ -13,6 +13,10 @@
 #include <stdio.h>
 
 #include "bool.h"
+#include "x86/timer_defines.h"
+
+// The longest period the 16-bit PIT divisor allows, in 10ms
+#define MAX_TIMER_PERIOD (0xffff / (TIMER_RATE / 100))
 
 // The type for timer callback
 typedef void (*TimerCallback)(unsigned int);
@@ -21,6 +25,14 @@ typedef void (*TimerCallback)(unsigned int);
 // otherwise return 0; The parameter passing in is the callback for each
 // triggers (every 10ms). The callback is synchronous, which means that it
 // mustn't take long.
+// The callback gets the epoch, which is the number of 10ms passed since
+// installed, but it may leap by more than one when timer period is stretched.
 extern int install_timer_driver(TimerCallback callback);
 
+// Stretch the timer to fire every `ticks` * 10ms, it's clamped to
+// [1, MAX_TIMER_PERIOD]. Return the period actually set. Used by tickless idle.
+// The time the old period has run is credited to epoch, so that an early reset
+// doesn't put epoch behind real time.
+int setTimerPeriod(int ticks);
+
 #endif
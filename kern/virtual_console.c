@@ -104,6 +104,23 @@ void referVirtualConsole(int vcNumber) {
   __sync_fetch_and_add(&theVC->ref, 1);
 }
 
+bool tryReferVirtualConsole(int vcNumber) {
+  if (vcNumber < 0 || vcNumber >= MAX_LIVE_VIRTUAL_CONSOLE) return false;
+  // Hold the latch so that the VC is not freed under me
+  GlobalLockR(&latch);
+  virtualConsole* theVC = vcList[vcNumber];
+  bool referred = false;
+  // Never bring back a console whose last reference is gone
+  while (theVC != NULL && !theVC->dead && !referred) {
+    int currentRef = theVC->ref;
+    if (currentRef <= 0) break;
+    referred = __sync_bool_compare_and_swap(
+        &theVC->ref, currentRef, currentRef + 1);
+  }
+  GlobalUnlockR(&latch);
+  return referred;
+}
+
 void dereferVirtualConsole(int vcNumber) {
   GlobalLockR(&latch);
   virtualConsole* theVC = vcList[vcNumber];
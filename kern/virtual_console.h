@@ -8,6 +8,8 @@
 #ifndef VIRTUAL_CONSOLE_H
 #define VIRTUAL_CONSOLE_H
 
+#include "bool.h"
+
 #define MAX_LIVE_VIRTUAL_CONSOLE 10
 
 // init virtual console, must be called by kernel before install drivers
@@ -25,6 +27,10 @@ void switchNextVirtualConsole();
 // Refer to a VC, happens when forking a new process
 void referVirtualConsole(int vcNumber);
 
+// Refer to a VC given by user, which may be invalid or dead. Return whether
+// the reference is taken
+bool tryReferVirtualConsole(int vcNumber);
+
 // Derefer a VC, happens when a process switches to new console or vanish
 void dereferVirtualConsole(int vcNumber);
 
@@ -16,43 +16,70 @@
 #include "dbgconf.h"
 #include "x86/asm.h"
 #include "x86/cr.h"
+#include "x86/eflags.h"
 #include "common_kern.h"
 #include "vm.h"
+#include "cpu.h"
+#include "slab.h"
 #include "bool.h"
 
+// The kernel part of every page directory, built once in enablePaging. They
+// are global so that switching page directory keeps them in TLB. The one
+// covering kmap window is a page table shared by every page directory
+static PDE kernelPDEs[STRIP_PD_INDEX(USER_MEM_START)];
+
+// KMAP_SLOTS pages for each CPU, see kmap()
+static uint32_t kmapWindow;
+
+// Page directories and page tables are both one page of empty entries when
+// cached, so they share one cache
+static slabCache pageTableCache;
+
+static void _clearPageTable(void* pt) {
+  for (int i = 0; i < PT_SIZE; i++) {
+    ((PTE*)pt)[i] = EMPTY_PDE;
+  }
+}
+
 PageDirectory newPageDirectory() {
-  PageDirectory newPD = (PDE*)smemalign(PAGE_SIZE, sizeof(PDE) * PD_SIZE);
+  PageDirectory newPD = (PDE*)slabAlloc(&pageTableCache);
   if (!newPD) {
     panic("newPageDirectory: fail to allocate space for new page directory");
   }
-  for (int i = 0; i < PD_SIZE; i++) {
-    newPD[i] = EMPTY_PDE;
-  }
   return newPD;
 }
 
+void freePageDirectoryOnly(PageDirectory pd) {
+  _clearPageTable(pd);
+  slabFree(&pageTableCache, pd);
+}
+
 void freePageDirectory(PageDirectory pd) {
   for (int i = 0; i < PD_SIZE; i++) {
-    if (PE_IS_PRESENT(pd[i])) {
-      sfree(PDE2PT(pd[i]), sizeof(PTE) * PT_SIZE);
+    // Shared kernel page table is not owned by pd
+    if (i < STRIP_PD_INDEX(USER_MEM_START) && pd[i] == kernelPDEs[i]) {
+      continue;
+    }
+    if (PE_IS_PRESENT(pd[i]) && !PE_IS_LARGE(pd[i])) {
+      freePageTable(PDE2PT(pd[i]));
     }
   }
-  sfree((void*)pd, sizeof(PDE) * PD_SIZE);
+  freePageDirectoryOnly(pd);
 }
 
-static PageTable newPageTable() {
-  PageTable newPT = (PTE*)smemalign(PAGE_SIZE, sizeof(PTE) * PT_SIZE);
+PageTable newPageTable() {
+  PageTable newPT = (PTE*)slabAlloc(&pageTableCache);
   if (!newPT) {
     panic("newPageTable: fail to allocate space for new page table");
   }
-  for (int i = 0; i < PT_SIZE; i++) {
-    newPT[i] = PE_PRESENT(0) | PE_WRITABLE(0) | PE_USERMODE(0) |
-               PE_WRITETHROUGH_CACHE(0) | PE_DISABLE_CACHE(0) |
-               PE_SIZE_FLAG(0) | PT_GLOBAL_FLAG(0);
-  }
   return newPT;
 }
 
+void freePageTable(PageTable pt) {
+  _clearPageTable(pt);
+  slabFree(&pageTableCache, pt);
+}
+
 void createMapPageDirectory(PageDirectory pd, uint32_t vaddr, uint32_t paddr,
     bool isUserMem, bool isWritable) {
   assert(PE_DECODE_ADDR(vaddr) == vaddr);
@@ -63,6 +90,7 @@ void createMapPageDirectory(PageDirectory pd, uint32_t vaddr, uint32_t paddr,
 
   uint32_t pdIndex = STRIP_PD_INDEX(vaddr);
   uint32_t ptIndex = STRIP_PT_INDEX(vaddr);
+  assert(!PE_IS_LARGE(pd[pdIndex]));
   if (!PE_IS_PRESENT(pd[pdIndex])) {
     // Create new page table, use the indicated privilege level
     // Always use writable privilege at page directory level, and specify
@@ -81,6 +109,33 @@ void createMapPageDirectory(PageDirectory pd, uint32_t vaddr, uint32_t paddr,
                          PE_SIZE_FLAG(0) | PT_GLOBAL_FLAG(0) | paddr;
 }
 
+void createLargeMapPageDirectory(PageDirectory pd, uint32_t vaddr,
+    uint32_t paddr, bool isUserMem, bool isWritable) {
+  assert(IS_LARGE_PAGE_ALIGNED(vaddr));
+  assert(IS_LARGE_PAGE_ALIGNED(paddr));
+  uint32_t pdIndex = STRIP_PD_INDEX(vaddr);
+  assert(!PE_IS_PRESENT(pd[pdIndex]));
+  pd[pdIndex] = PE_PRESENT(1) | PE_WRITABLE(isWritable) |
+                PE_USERMODE(isUserMem) | PE_WRITETHROUGH_CACHE(0) |
+                PE_DISABLE_CACHE(0) | PE_SIZE_FLAG(1) | paddr;
+}
+
+void splitLargePageDirectory(PageDirectory pd, uint32_t startPDIndex,
+    uint32_t endPDIndex) {
+  for (int i = startPDIndex; i <= endPDIndex; i++) {
+    if (!PE_IS_PRESENT(pd[i]) || !PE_IS_LARGE(pd[i])) continue;
+    PageTable newPT = newPageTable();
+    // Keep everything but the size flag in each 4k page
+    PTE flags = PTE_CLEAR_ADDR(pd[i]) & ~PE_SIZE_FLAG(1);
+    for (int j = 0; j < PT_SIZE; j++) {
+      newPT[j] = flags | (PE_DECODE_ADDR(pd[i]) + j * PAGE_SIZE);
+    }
+    pd[i] = PE_PRESENT(1) | PE_WRITABLE(1) | (pd[i] & PE_USERMODE(1)) |
+            PE_WRITETHROUGH_CACHE(0) | PE_DISABLE_CACHE(0) |
+            PE_SIZE_FLAG(0) | PT_GLOBAL_FLAG(0) | (uint32_t)newPT;
+  }
+}
+
 PageTable clonePageTable(PageTable old) {
   PageTable newPT = newPageTable();
   memcpy((void*)newPT, (void*)old, sizeof(PTE) * PT_SIZE);
@@ -97,7 +152,7 @@ void clonePageDirectory(PageDirectory src, PageDirectory dst,
             "conflicting page table");
     }
     dst[i] = src[i];
-    if (PE_IS_PRESENT(src[i])) {
+    if (PE_IS_PRESENT(src[i]) && !PE_IS_LARGE(src[i])) {
       PageTable newPT = clonePageTable(PDE2PT(src[i]));
       dst[i] = PDE_CLEAR_PT(src[i]) | (uint32_t)newPT;
     }
@@ -110,6 +165,10 @@ uint32_t traverseEntryPageDirectory(PageDirectory pd,
     uint32_t initialToken) {
   for (int i = startPDIndex; i <= endPDIndex; i++) {
     if (!PE_IS_PRESENT(pd[i])) continue;
+    if (PE_IS_LARGE(pd[i])) {
+      initialToken = onPTE(i, 0, &pd[i], initialToken);
+      continue;
+    }
     PageTable cpt = PDE2PT(pd[i]);
     for (int j = 0; j < PT_SIZE; j++) {
       if (!PE_IS_PRESENT(cpt[j])) continue;
@@ -126,6 +185,7 @@ PTE* searchPTEntryPageDirectory(PageDirectory pd, uint32_t vaddr) {
   uint32_t ptIndex = STRIP_PT_INDEX(vaddr);
 
   if (!PE_IS_PRESENT(pd[pdIndex])) return NULL;
+  if (PE_IS_LARGE(pd[pdIndex])) return &pd[pdIndex];
   if (!PE_IS_PRESENT(PDE2PT(pd[pdIndex])[ptIndex])) return NULL;
   return &PDE2PT(pd[pdIndex])[ptIndex];
 }
@@ -141,17 +201,97 @@ PageDirectory getActivePageDirectory() {
 }
 
 void setKernelMapping(PageDirectory pd) {
-  for (int i = 0; i < USER_MEM_START; i+= PAGE_SIZE) {
-    createMapPageDirectory(pd, i, i, false, true);
+  memcpy(pd, kernelPDEs, sizeof(kernelPDEs));
+}
+
+// Page table entry of a kmap window page, present or not
+static PTE* _kmapPTE(uint32_t addr) {
+  return &PDE2PT(kernelPDEs[STRIP_PD_INDEX(addr)])[STRIP_PT_INDEX(addr)];
+}
+
+// Carve kmap window out of kernel memory. Its large pages are split, with all
+// the direct map kept global, and the window itself left unmapped
+static void initKmap() {
+  uint32_t windowSize = CPU_COUNT * KMAP_SLOTS * PAGE_SIZE;
+  kmapWindow = (uint32_t)smemalign(PAGE_SIZE, windowSize);
+  if (!kmapWindow) {
+    panic("initKmap: fail to allocate kmap window");
+  }
+  splitLargePageDirectory(kernelPDEs, STRIP_PD_INDEX(kmapWindow),
+      STRIP_PD_INDEX(kmapWindow + windowSize - 1));
+  for (uint32_t i = 0; i < windowSize; i += PAGE_SIZE) {
+    *_kmapPTE(kmapWindow + i) =
+        PE_PRESENT(0) | PE_WRITABLE(0) | PE_USERMODE(0);
   }
 }
 
 static PageDirectory initPD;
 void enablePaging() {
+  initSlabCache(&pageTableCache, "Page Table", sizeof(PTE) * PT_SIZE,
+      PAGE_SIZE, _clearPageTable);
+  for (uint32_t i = 0; i < USER_MEM_START; i += LARGE_PAGE_SIZE) {
+    createLargeMapPageDirectory(kernelPDEs, i, i, false, true);
+    kernelPDEs[STRIP_PD_INDEX(i)] |= PT_GLOBAL_FLAG(1);
+  }
+  initKmap();
   // Set up a table with direct map only on kernel addresses
   initPD = newPageDirectory();
   setKernelMapping(initPD);
   activatePageDirectory(initPD);
+  // Kernel direct map uses 4MiB pages
+  set_cr4(get_cr4() | CR4_PSE);
   set_cr0(get_cr0() | CR0_PG | CR0_WP);
+  // Then kernel mappings survive page directory switch
+  set_cr4(get_cr4() | CR4_PGE);
   lprintf("Initial page directory established.");
 }
+
+void initTLBBatch(TLBBatch* batch) {
+  batch->count = 0;
+}
+
+void addTLBBatch(TLBBatch* batch, uint32_t addr, int pageCount) {
+  if (batch->count + pageCount > VM_TLB_FLUSH_THRESHOLD) {
+    // Too many, just flush the whole TLB
+    batch->count = VM_TLB_FLUSH_THRESHOLD + 1;
+    return;
+  }
+  for (int i = 0; i < pageCount; i++) {
+    batch->pages[batch->count++] = addr + i * PAGE_SIZE;
+  }
+}
+
+void flushTLBBatch(TLBBatch* batch) {
+  if (batch->count > VM_TLB_FLUSH_THRESHOLD) {
+    activatePageDirectory(getActivePageDirectory());
+  } else {
+    for (int i = 0; i < batch->count; i++) {
+      invalidateTLB(batch->pages[i]);
+    }
+  }
+  batch->count = 0;
+}
+
+// Virtual address of the slot on current CPU
+static uint32_t _kmapSlot(int slot) {
+  assert(slot >= 0 && slot < KMAP_SLOTS);
+  // Otherwise the mapping may be used on another CPU
+  assert(!(get_eflags() & EFL_IF));
+  return kmapWindow + (getLocalCPU()->id * KMAP_SLOTS + slot) * PAGE_SIZE;
+}
+
+void* kmap(int slot, uint32_t frame) {
+  uint32_t addr = _kmapSlot(slot);
+  PTE* pte = _kmapPTE(addr);
+  assert(!PE_IS_PRESENT(*pte));
+  *pte = PE_PRESENT(1) | PE_WRITABLE(1) | PE_USERMODE(0) |
+         PE_WRITETHROUGH_CACHE(0) | PE_DISABLE_CACHE(0) | PE_DECODE_ADDR(frame);
+  return (void*)addr;
+}
+
+void kunmap(int slot) {
+  uint32_t addr = _kmapSlot(slot);
+  PTE* pte = _kmapPTE(addr);
+  *pte = PE_PRESENT(0) | PE_WRITABLE(0) | PE_USERMODE(0);
+  invalidateTLB(addr);
+}
@@ -16,6 +16,7 @@
 #include <x86/page.h>
 
 #include "bool.h"
+#include "sysconf.h"
 
 typedef uint32_t PTE;
 typedef PTE* PageTable;
@@ -54,12 +55,26 @@ typedef PDE* PageDirectory;
 
 #define PE_DISABLE_CACHE(flag) ((flag) << 4)
 
+// Only for page directory entry: it maps a 4MiB large page instead of
+// pointing to a page table. Requires CR4.PSE
 #define PE_SIZE_FLAG(flag) ((flag) << 7)
+#define PE_IS_LARGE(pe) ((pe) & PE_SIZE_FLAG(1))
+#define LARGE_PAGE_SIZE (PAGE_SIZE * PT_SIZE)
+#define IS_LARGE_PAGE_ALIGNED(addr) (((addr) & (LARGE_PAGE_SIZE - 1)) == 0)
 
+// Global pages are not flushed on page directory switch. Requires CR4.PGE, and
+// only used for kernel mappings which are the same everywhere
 #define PT_GLOBAL_FLAG(flag) ((flag) << 8)
 
-#define PE_ENCODE_CUSTOM(threebit) ((threebit) << 9)
-#define PE_DECODE_CUSTOM(pe) (((pe) >> 9) & 7)
+// Bit 9/10 are free for custom stamps, bit 11 is taken by copy-on-write.
+// What the pages are for is kept in region tree instead (see region.h)
+#define PE_ENCODE_CUSTOM(twobit) ((twobit) << 9)
+#define PE_DECODE_CUSTOM(pe) (((pe) >> 9) & 3)
+
+// A copy-on-write page is mapped readonly, and its frame may be shared with
+// other page directories. Write to it should get a private copy first
+#define PE_COW(flag) ((flag) << 11)
+#define PE_IS_COW(pe) ((pe) & PE_COW(1))
 
 #define PE_DECODE_ADDR(pt) ((pt) & 0xfffff000)
 #define PDE2PT(pde) ((PageTable)PE_DECODE_ADDR(pde))
@@ -79,10 +94,15 @@ void enablePaging();
 PageDirectory newPageDirectory();
 
 // Only free the page directory (and recursively page table), not any physical
-// page associated.
+// page associated. Large pages have no page table to free.
 void freePageDirectory(PageDirectory pd);
 
+// Only free the page directory itself, page tables it refers are left alone
+void freePageDirectoryOnly(PageDirectory pd);
+
 // Given a page directory, set initial kernel memory direct mapping
+// Kernel memory is mapped by global 4MiB large pages, so no page table is
+// needed, and it's just a copy of a few page directory entries
 void setKernelMapping(PageDirectory pd);
 
 // Map one physical page to a virtual page in the directory, given the access
@@ -90,8 +110,23 @@ void setKernelMapping(PageDirectory pd);
 void createMapPageDirectory(PageDirectory pd, uint32_t vaddr, uint32_t paddr,
     bool isUserMem, bool isWritable);
 
+// Map 4MiB physical memory to a 4MiB virtual page by a large page directory
+// entry. Both addresses must be 4MiB aligned, and the page directory entry must
+// be empty (no page table)
+void createLargeMapPageDirectory(PageDirectory pd, uint32_t vaddr,
+    uint32_t paddr, bool isUserMem, bool isWritable);
+
+// Split all large pages in [startPDIndex, endPDIndex] into page tables of 4k
+// pages, with the same physical memory and privileges.
+// Caller should flush TLB if pd is active
+void splitLargePageDirectory(PageDirectory pd, uint32_t startPDIndex,
+    uint32_t endPDIndex);
+
 // return the reference of the page table entry for one virtual address
 // Or NULL if it's not presented in the page directory
+// For address inside a large page, the page directory entry is returned. It
+// carries the same present/write/user bits as a page table entry, but it maps
+// the whole 4MiB page (check by PE_IS_LARGE)
 PTE* searchPTEntryPageDirectory(PageDirectory pd, uint32_t vaddr);
 
 // Adopt the page directory
@@ -100,6 +135,12 @@ void activatePageDirectory(PageDirectory pd);
 // Get what page directory is adopted
 PageDirectory getActivePageDirectory();
 
+// create a page table, with nothing mapped
+PageTable newPageTable();
+
+// Free a page table got from newPageTable, not any physical page associated
+void freePageTable(PageTable pt);
+
 // Clone a page table, associated physical pages are not cloned
 PageTable clonePageTable(PageTable old);
 
@@ -112,6 +153,7 @@ void clonePageDirectory(PageDirectory src, PageDirectory dst,
 // Traverse all presented pages in one page directory, given range
 // [startPDIndex, endPDIndex]. initialToken is a user-given token that can be
 // passed on each onPTE call, so this function acts as fold() on onPTE
+// A large page is visited once, with its page directory entry and ptIndex 0
 uint32_t traverseEntryPageDirectory(PageDirectory pd,
     uint32_t startPDIndex, uint32_t endPDIndex,
     uint32_t (*onPTE)(int, int, PTE*, uint32_t),
@@ -122,4 +164,41 @@ uint32_t traverseEntryPageDirectory(PageDirectory pd,
 // need to called to ensure consistent
 void invalidateTLB(uint32_t addr);
 
+// A batch of TLB invalidation for the active page directory. Paths changing
+// many mappings record the pages here, and flush them all at once in the end.
+// If more than VM_TLB_FLUSH_THRESHOLD pages are recorded, flushing reloads
+// %cr3 instead (kernel pages are global, so they survive).
+// Only mappings getting less privileged (or removed) need to be recorded: a
+// page not present is never cached in TLB. And the frame of a removed mapping
+// must not be freed before the batch is flushed
+typedef struct {
+  // count > VM_TLB_FLUSH_THRESHOLD means the whole TLB is to be flushed
+  int count;
+  uint32_t pages[VM_TLB_FLUSH_THRESHOLD];
+} TLBBatch;
+
+void initTLBBatch(TLBBatch* batch);
+
+// Record pageCount pages from addr to be invalidated. For a large page, one
+// address inside it is enough
+void addTLBBatch(TLBBatch* batch, uint32_t addr, int pageCount);
+
+// Invalidate everything recorded, and empty the batch
+void flushTLBBatch(TLBBatch* batch);
+
+// Temporary kernel mapping. Each CPU owns KMAP_SLOTS kernel pages that can be
+// pointed at any physical frame, so that the kernel reads or writes a frame
+// directly, without going through (or touching) any user mapping. The mapping
+// is only good on current CPU, so it must be made and dropped inside one
+// LocalLock, and every slot is used by one mapping at a time
+#define KMAP_SLOTS 2
+#define KMAP_SRC 0
+#define KMAP_DST 1
+
+// Map frame to the slot, and return its kernel virtual address
+void* kmap(int slot, uint32_t frame);
+
+// Drop the mapping of the slot
+void kunmap(int slot);
+
 #endif
@@ -16,6 +16,7 @@
 #include <malloc.h>
 #include <assert.h>
 #include <string.h>
+#include <elf_410.h>
 
 #include <x86/asm.h>
 #include <x86/eflags.h>
@@ -28,6 +29,7 @@
 #include "process.h"
 #include "vm.h"
 #include "pm.h"
+#include "cow.h"
 #include "loader.h"
 #include "context_switch.h"
 #include "mode_switch.h"
@@ -38,6 +40,8 @@
 #include "hv.h"
 #include "virtual_console.h"
 
+static void enterRing3(tcb* currentThread, uint32_t eip, uint32_t esp);
+
 // Will own it. Will not increase proc's numThread
 tcb* SpawnThread(pcb* proc) {
   LocalLockR();
@@ -49,10 +53,11 @@ tcb* SpawnThread(pcb* proc) {
   LocalUnlockR();
   ntcb->process = proc;
   ntcb->memLockStatus = KMUTEX_NOT_ACQUIRED;
-  ntcb->kernelStackPage = (uint32_t)smalloc(PAGE_SIZE);
+  ntcb->kernelStackPage = newKernelStack();
   ntcb->faultHandler = 0;
   ntcb->customArg = 0;
   ntcb->faultStack = 0;
+  ntcb->vcpu = NULL;
   ntcb->descheduling = false;
   ntcb->lastThread = false;
   initCrossCPULock(&ntcb->dmlock);
@@ -83,6 +88,9 @@ pcb* SpawnProcess(tcb** firstThread) {
   npcb->unwaitedChildProc = 0;
   npcb->prezombieWatcher = NULL;
   npcb->vcNumber = -1;
+  npcb->vforkParent = NULL;
+  npcb->vforkPD = NULL;
+  npcb->memMeta.regions = NULL;
   initCrossCPULock(&npcb->prezombieWatcherLock);
   kmutexInit(&npcb->mutex);
   kmutexInit(&npcb->memlock);
@@ -96,72 +104,61 @@ pcb* SpawnProcess(tcb** firstThread) {
 }
 
 // The callback function for forking a memory layout.
-// It will try to create a new physical page, copy the old one to the new page
-// and adjust page table to refer to new page.
+// Pages are shared with the parent (see markUserspaceCOW), so it only takes one
+// more reference for each physical page, or reserves one more ZFOD page.
 // For any failure (no memory available) the subsequent rebuild will turn to
 // "destory": i.e., simply tear the old page off the current page table, so that
 // when the page table is revoked, all physical pages are dedicated
 static uint32_t rebuildPD_EachPage(int pdIndex, int ptIndex, PTE* ptentry,
-    uint32_t buffer) {
-  if (!buffer) {
-    // There's some failure. We cannot fork anymore, instead, we remove
-    // the reference to physical page (because that belongs to my parent)
-    *ptentry = PTE_CLEAR_ADDR(*ptentry);
-    *ptentry &= ~PE_PRESENT(1);
-    return 0;
-  } else {
-    uint32_t pageAddr = RECONSTRUCT_ADDR(pdIndex, ptIndex);
-    // Move things into buffer, change mapping, flush TLB, put things back
-    memcpy((void*)buffer, (void*)pageAddr, PAGE_SIZE);
-
-    uint32_t newPage;
-    if (isZFOD(PE_DECODE_ADDR(*ptentry))) {
-      newPage = getUserMemPageZFOD();
-    } else {
-      newPage = getUserMemPage();
+    uint32_t succ) {
+  if (succ) {
+    uint32_t page = PE_DECODE_ADDR(*ptentry);
+    if (!isZFOD(page)) {
+      referUserMemPage(page);
+      return succ;
     }
-    if (newPage == 0) {
-      // no enough user space, abort
-      *ptentry = PTE_CLEAR_ADDR(*ptentry);
-      *ptentry &= ~PE_PRESENT(1);
-      return 0;
+    if (getUserMemPageZFOD() != 0) {
+      return succ;
     }
+    // no enough user space, abort
+  }
+  // There's some failure. We cannot fork anymore, instead, we remove
+  // the reference to physical page (because that belongs to my parent)
+  *ptentry = PTE_CLEAR_ADDR(*ptentry);
+  *ptentry &= ~PE_PRESENT(1);
+  return 0;
+}
 
-    *ptentry = PTE_CLEAR_ADDR(*ptentry) | newPage;
-
-    // only writeback when it's a non ZFOD data
-    if (!isZFOD(PE_DECODE_ADDR(*ptentry))) {
-      // Temporary allow write
-      PTE savedPTE = *ptentry;
-      *ptentry |= PE_WRITABLE(1);
-      invalidateTLB(pageAddr);
-
-      memcpy((void*)pageAddr, (void*)buffer, PAGE_SIZE);
-      *ptentry = savedPTE;
-      invalidateTLB(pageAddr);
-    }
+static uint32_t rebuildPD_EachRange(uint32_t startPDIndex,
+    uint32_t endPDIndex, uint32_t token) {
+  uint32_t* succ = (uint32_t*)token;
+  *succ = traverseEntryPageDirectory((PageDirectory)succ[1],
+                                     startPDIndex,
+                                     endPDIndex,
+                                     rebuildPD_EachPage,
+                                     *succ);
+  return token;
+}
 
-    // Done! Passing in the buffer address to go further
-    return buffer;
-  }
+// Reserve ZFOD pages for the pages of region not populated yet. After the
+// first failure, later regions get nothing reserved
+static uint32_t rebuildPD_EachRegion(region* reg, uint32_t succ) {
+  if (reg->reserved == 0) return succ;
+  if (succ && getUserMemPagesZFOD(reg->reserved) != 0) return succ;
+  reg->reserved = 0;
+  return 0;
 }
 
 // mypd must be active pd
-// Rebuild (duplicate the page directoy), return whether success
-// If any failure, all page from parent pd will be discarded and newly allocated
+// Rebuild (share the page directoy), return whether success. Only pages inside
+// regions are visited, and lazily populated regions reserve their own pages.
+// If any failure, all page from parent pd will be discarded and newly referred
 // will be kept, so that it's safe to free
-static bool rebuildPD(PageDirectory mypd) {
-  uint32_t buffer = (uint32_t)smalloc(PAGE_SIZE);
-  if (buffer == 0) {
-    panic("rebuildPD: no kernel space to rebuild page table.");
-  }
-  uint32_t success =
-      traverseEntryPageDirectory(mypd,
-                                 STRIP_PD_INDEX(USER_MEM_START),
-                                 STRIP_PD_INDEX(0xffffffff),
-                                 rebuildPD_EachPage,
-                                 buffer);
-  sfree((void*)buffer, PAGE_SIZE);
+static bool rebuildPD(PageDirectory mypd, region* regions) {
+  // {success, pd}
+  uint32_t token[2] = {1, (uint32_t)mypd};
+  traverseRegionPDRange(regions, rebuildPD_EachRange, (uint32_t)token);
+  uint32_t success = traverseRegion(regions, rebuildPD_EachRegion, token[0]);
   if (!success) {
     lprintf("Fail to rebuild new page directory, no enough user space");
     return false;
@@ -190,6 +187,32 @@ void rebuildKernelStack(uint32_t ebpStartChain, uint32_t delta,
   }
 }
 
+// Clone [startPDIndex, endPDIndex] of the active pd to the new pd in token
+static uint32_t clonePD_EachRange(uint32_t startPDIndex, uint32_t endPDIndex,
+    uint32_t newPD) {
+  clonePageDirectory(getActivePageDirectory(), (PageDirectory)newPD,
+                     startPDIndex, endPDIndex);
+  return newPD;
+}
+
+// Put a thread blocked in forkProcess/spawnProcess/vforkProcess back to run.
+// The thread is blocked and out of scheduler, so no one really owns it, and
+// the spinloop only happens in multicore
+static void wakeBlockedParent(tcb* parentThread) {
+  LocalLockR();
+  while (!__sync_bool_compare_and_swap(
+      &parentThread->owned, THREAD_NOT_OWNED, THREAD_OWNED_BY_THREAD))
+    ;
+  LocalUnlockR();
+
+  #ifdef VERBOSE_PRINT
+  lprintf("Setting %d to runnable", parentThread->id);
+  #endif
+  addToXLX(parentThread);
+  parentThread->status = THREAD_RUNNABLE;
+  parentThread->owned = THREAD_NOT_OWNED;
+}
+
 int forkThread(tcb* currentThread) {
   KERNEL_STACK_CHECK;
   pcb* currentProc = currentThread->process;
@@ -233,16 +256,18 @@ int forkThread(tcb* currentThread) {
 // new process and child tid for old process.
 // Fork is completed in two phase:
 // 1. Fork phase: fork everything:
-//    1.1. Copy all primary members of tcb and pcb
-//    1.2. Shallow copy memory directory
+//    1.1. Copy all primary members of tcb and pcb, and the region tree
+//    1.2. Turn all writable pages copy-on-write, and shallow copy memory
+//         directory (only the part covered by regions)
 //    1.3. Copy register set and kernel stack (use atomic snapshot)
 //    1.4. Adjustion: adjust %esp %ebp and the stack-saved %ebps for the new
 //         kernel stack.
 // Then it freezes the parent process (to avoid memory change), and switch to
 // child process to finish phase 2
-// 2. Rebuild phase: deep copy page directory, this phase is when two process
-//    will have two set of memories. (If COW is implemented, this phase is
-//    scattered in subsequent memory access)
+// 2. Rebuild phase: take references of all shared pages in page directory, and
+//    reserve ZFOD pages for lazily populated regions.
+//    The actual copy is scattered in subsequent memory writes (see COWBreaker
+//    in fault.c), so fork cost depends on page table size only.
 // After phase two, the parent process is re-enable.
 // NOTE: the current process *must* only have the current thread
 // and of course, currentThread must be owned by the CPU
@@ -250,17 +275,25 @@ int forkThread(tcb* currentThread) {
 // partial state copied.
 int forkProcess(tcb* currentThread) {
   KERNEL_STACK_CHECK;
+  pcb* currentProc = currentThread->process;
+  // We are the only thread in the process, so no one is touching the memory
+  region* newRegions;
+  if (!cloneRegionTree(currentProc->memMeta.regions, &newRegions)) {
+    lprintf("Fork fail due to insufficient kernel memory");
+    return -1;
+  }
+
   tcb* newThread;
   pcb* newProc = SpawnProcess(&newThread);
-  pcb* currentProc = currentThread->process;
 
   currentProc->unwaitedChildProc++;
 
   // proc-related
-  clonePageDirectory(currentProc->pd, newProc->pd,
-                     STRIP_PD_INDEX(USER_MEM_START),
-                     STRIP_PD_INDEX(0xffffffff));
+  markUserspaceCOW(currentProc->pd, currentProc->memMeta.regions);
+  traverseRegionPDRange(currentProc->memMeta.regions, clonePD_EachRange,
+                        (uint32_t)newProc->pd);
   newProc->memMeta = currentProc->memMeta;
+  newProc->memMeta.regions = newRegions;
   newProc->parentPID = currentProc->id;
   newProc->retStatus = currentProc->retStatus;
   newProc->vcNumber = currentProc->vcNumber;
@@ -310,7 +343,7 @@ int forkProcess(tcb* currentThread) {
     LocalUnlockR();
 
     // Now it's time to rebuild my page directory
-    if (!rebuildPD(newProc->pd)) {
+    if (!rebuildPD(newProc->pd, newProc->memMeta.regions)) {
       // Due to not enough kernel memory, the Page table fails to be rebuilt
       // And newProc's page directory is in clean state (i.e. share nothing)
       // with parent, and is good to go dead
@@ -325,24 +358,9 @@ int forkProcess(tcb* currentThread) {
       return -1;
     }
 
-    // On single core machine it's nothing
-    // Even on multicore machine, since currentThread is BLOCKED, no one can
-    // really own it, so this is very transient
-    LocalLockR();
-    while (!__sync_bool_compare_and_swap(
-        &currentThread->owned, THREAD_NOT_OWNED, THREAD_OWNED_BY_THREAD))
-      ;
-    LocalUnlockR();
-
     // Before unblock parent process, tell him about our success.
     *ptr_retValueForParentCall = newThread->id;
-
-    #ifdef VERBOSE_PRINT
-    lprintf("Setting %d to runnable", currentThread->id);
-    #endif
-    addToXLX(currentThread);
-    currentThread->status = THREAD_RUNNABLE;
-    currentThread->owned = THREAD_NOT_OWNED;
+    wakeBlockedParent(currentThread);
     return 0;
   }
 }
@@ -358,23 +376,158 @@ int LoadELFToProcess(pcb* proc, tcb* firstThread, const char* fileName,
   return 0;
 }
 
-// Internal implementation of exec(), load a new elf to the current process
-// space. It's idempotent, i.e. can be safely called multiple times on a single
-// process, while the excessive memory will be kept (NOTE: maybe a bug?)
-// NOTE: the current process *must* only have the current thread
-// argpkg can be null, or a smalloc'd array. If it success (no return), argpkg
-// will be disposed correctly; otherwise, the caller should dispose it
-int execProcess(tcb* currentThread, const char* filename, ArgPackage* argpkg) {
+// The internal implementation of vfork. Unlike forkProcess, the child runs on
+// the parent's page directory, and the parent thread is blocked until the
+// child execs (see execProcess) or dies (see reapProcess), so nothing of the
+// address space is copied or even referred.
+// The child must not change the address space (so only exec or vanish)
+// NOTE: the current process *must* only have the current thread, as fork
+int vforkProcess(tcb* currentThread) {
   KERNEL_STACK_CHECK;
+  tcb* newThread;
+  pcb* newProc = SpawnProcess(&newThread);
+  pcb* currentProc = currentThread->process;
+  int newThreadID = newThread->id;
+
+  currentProc->unwaitedChildProc++;
+
+  // proc-related. Keep my own page directory aside until exec
+  newProc->vforkPD = newProc->pd;
+  newProc->pd = currentProc->pd;
+  newProc->vforkParent = currentThread;
+  newProc->memMeta = currentProc->memMeta;
+  newProc->parentPID = currentProc->id;
+  newProc->retStatus = currentProc->retStatus;
+  newProc->vcNumber = currentProc->vcNumber;
+  referVirtualConsole(newProc->vcNumber);
+
+  // thread-related, the same as forkProcess
+  newThread->regs = currentThread->regs;
+  if (!checkpointTheWorld(&newThread->regs,
+      currentThread->kernelStackPage, newThread->kernelStackPage, PAGE_SIZE)) {
+    // This is the old process!
+    newThread->regs.ebp +=
+        newThread->kernelStackPage - currentThread->kernelStackPage;
+    newThread->regs.esp +=
+        newThread->kernelStackPage - currentThread->kernelStackPage;
+    rebuildKernelStack(newThread->regs.ebp,
+        newThread->kernelStackPage - currentThread->kernelStackPage,
+        newThread->kernelStackPage,
+        newThread->kernelStackPage + PAGE_SIZE - 1);
+
+    LocalLockR();
+    currentThread->status = THREAD_BLOCKED;
+    removeFromXLX(currentThread);
+    swtichToThread_Prelocked(newThread);
+    // Now my child has exec'd or died, and my address space is mine again
+    return newThreadID;
+  } else {
+    // This is the new process!
+    currentThread->owned = THREAD_NOT_OWNED;
+    LocalUnlockR();
+    return 0;
+  }
+}
+
+// see zeus.h
+void resumeVforkParent(pcb* proc) {
+  tcb* parentThread = (tcb*)proc->vforkParent;
+  if (!parentThread) return;
+  proc->vforkParent = NULL;
+  proc->vforkPD = NULL;
+  wakeBlockedParent(parentThread);
+}
+
+// The entry of the first thread of a spawned process, after swtichTheWorld.
+// It runs on the new page directory, loads the program and goes into ring3.
+// Whether loading succeeds is told to the parent thread blocked in
+// spawnProcess
+static void RunSpawned(tcb* parentThread, tcb* currentThread,
+    ArgPackage* argpkg, int* ptr_retValueForParentCall) {
+  // From swtichToThread, disown the parent and unlock
+  parentThread->owned = THREAD_NOT_OWNED;
+  LocalUnlockR();
+
+  pcb* currentProc = currentThread->process;
+  pcb* parentProc = parentThread->process;
   uint32_t esp, eip;
-  if (LoadELFToProcess(
-          currentThread->process, currentThread, filename,
+  if (LoadELFToProcess(currentProc, currentThread, argpkg->c[0],
           argpkg, &eip, &esp) < 0) {
+    lprintf("Spawn fail due to insufficient memory");
+    // I'm not a child of my parent, init will take me when I die
+    currentProc->parentPID = -1;
+
+    *ptr_retValueForParentCall = -1;
+    wakeBlockedParent(parentThread);
+    terminateThread(currentThread);
+    panic("Hmmmm I shouldn't get here");
+  }
+
+  // Only now I'm a child that can be waited. Other threads of my parent may
+  // be in wait() already, so this is never taken back
+  kmutexWLock(&parentProc->mutex);
+  parentProc->unwaitedChildProc++;
+  kmutexWUnlock(&parentProc->mutex);
+
+  // argpkg is gone once parent is back
+  *ptr_retValueForParentCall = currentThread->id;
+  wakeBlockedParent(parentThread);
+  enterRing3(currentThread, eip, esp);
+}
+
+// The internal implementation of spawn. Create a process running the program
+// in argpkg (the same as exec) on virtual console vcNumber, which must be
+// already referred for the new process. The new process starts with a fresh
+// page directory, so nothing of the caller is copied, and the caller can have
+// multiple threads.
+// The caller is blocked until the program is loaded. Return the tid of the new
+// process, or -1 on failure. argpkg is owned by the caller in any case
+int spawnProcess(tcb* currentThread, ArgPackage* argpkg, int vcNumber) {
+  KERNEL_STACK_CHECK;
+  // Check before creating anything, so that a wrong name is cheap
+  if (elf_check_header(argpkg->c[0]) != ELF_SUCCESS) {
+    dereferVirtualConsole(vcNumber);
     return -1;
   }
 
-  if (argpkg) sfree(argpkg, sizeof(ArgPackage));
+  tcb* newThread;
+  pcb* newProc = SpawnProcess(&newThread);
+  pcb* currentProc = currentThread->process;
 
+  // It's counted as an unwaited child by itself once the program is loaded
+  // (see RunSpawned)
+  kmutexWLock(&currentProc->mutex);
+  newProc->retStatus = currentProc->retStatus;
+  kmutexWUnlock(&currentProc->mutex);
+  newProc->parentPID = currentProc->id;
+  newProc->vcNumber = vcNumber;
+
+  int retValueForParentCall;
+
+  // Initial kernel stack, calling RunSpawned on switch
+  newThread->regs.eip = (uint32_t)RunSpawned;
+  newThread->regs.esp = newThread->kernelStackPage + PAGE_SIZE - 1;
+  newThread->regs.ebp = 0;
+  uint32_t* futureStack = (uint32_t*)newThread->regs.esp;
+  futureStack[-1] = (uint32_t)&retValueForParentCall;
+  futureStack[-2] = (uint32_t)argpkg;
+  futureStack[-3] = (uint32_t)newThread;
+  futureStack[-4] = (uint32_t)currentThread;
+  futureStack[-5] = 0xdeadbeef;   // invalid ret address of root call frame
+  newThread->regs.esp = (uint32_t)&futureStack[-5];
+
+  // Atomic deschedule, and wait for the program loaded
+  LocalLockR();
+  currentThread->status = THREAD_BLOCKED;
+  removeFromXLX(currentThread);
+  swtichToThread_Prelocked(newThread);
+
+  return retValueForParentCall;
+}
+
+// Go into ring3 for the first time with the program just loaded, or
+// bootstrap the guest for a virtual machine. Never returns
+static void enterRing3(tcb* currentThread, uint32_t eip, uint32_t esp) {
   if (!(get_eflags() & EFL_IF)) {
     panic("Oooops! Lock skews... current lock layer = %d",
         getLocalCPU()->currentMutexLayer);
@@ -393,6 +546,78 @@ int execProcess(tcb* currentThread, const char* filename, ArgPackage* argpkg) {
   } else {
     switchToRing3(esp, neweflags, eip);
   }
+}
+
+// Switch the current process to pd and memMeta, and return the old ones
+static void swapAddressSpace(pcb* proc, PageDirectory* pd,
+    ProcessMemoryMeta* memMeta) {
+  PageDirectory oldPD = proc->pd;
+  ProcessMemoryMeta oldMemMeta = proc->memMeta;
+  LocalLockR();
+  proc->pd = *pd;
+  proc->memMeta = *memMeta;
+  activatePageDirectory(proc->pd);
+  LocalUnlockR();
+  *pd = oldPD;
+  *memMeta = oldMemMeta;
+}
+
+// Internal implementation of exec(), load a new elf to the current process.
+// The program is loaded into a new page directory with an empty region tree,
+// and the old address space is dropped only on success, so a failing exec
+// leaves the process untouched.
+// A vfork() child loads into its own page directory instead, and gives the
+// borrowed one back to its parent on success.
+// NOTE: the current process *must* only have the current thread
+// argpkg can be null, or a smalloc'd array. If it success (no return), argpkg
+// will be disposed correctly; otherwise, the caller should dispose it
+int execProcess(tcb* currentThread, const char* filename, ArgPackage* argpkg) {
+  KERNEL_STACK_CHECK;
+  pcb* currentProc = currentThread->process;
+  bool borrowed = currentProc->vforkParent != NULL;
+  PageDirectory pd;
+  if (borrowed) {
+    pd = currentProc->vforkPD;
+  } else {
+    pd = newPageDirectory();
+    setKernelMapping(pd);
+  }
+  ProcessMemoryMeta memMeta = currentProc->memMeta;
+  memMeta.regions = NULL;
+  swapAddressSpace(currentProc, &pd, &memMeta);
+  // Loading rewrites SectionA of hyperInfo in place (see fillHyperInfo), keep
+  // the old one as well. The whole HyperInfo is too large for kernel stack
+  HyperInfo* hyper = &currentProc->hyperInfo;
+  bool oldIsHyper = hyper->isHyper;
+  HyperStatus oldStatus = hyper->status;
+  int oldCS = hyper->cs, oldDS = hyper->ds;
+  uint32_t oldBaseAddr = hyper->baseAddr;
+
+  uint32_t esp, eip;
+  if (LoadELFToProcess(
+          currentProc, currentThread, filename,
+          argpkg, &eip, &esp) < 0) {
+    // Drop whatever is loaded, and keep running on the old one
+    swapAddressSpace(currentProc, &pd, &memMeta);
+    hyper->isHyper = oldIsHyper;
+    hyper->status = oldStatus;
+    hyper->cs = oldCS;
+    hyper->ds = oldDS;
+    hyper->baseAddr = oldBaseAddr;
+    freeUserspace(pd, &memMeta.regions);
+    if (!borrowed) freePageDirectory(pd);
+    return -1;
+  }
+
+  if (argpkg) sfree(argpkg, sizeof(ArgPackage));
+  if (borrowed) {
+    resumeVforkParent(currentProc);
+  } else {
+    freeUserspace(pd, &memMeta.regions);
+    freePageDirectory(pd);
+  }
+
+  enterRing3(currentThread, eip, esp);
   return 0;
 }
 
@@ -25,6 +25,21 @@ int forkProcess(tcb* currentThread);
 
 int execProcess(tcb* currentThread, const char* filename, ArgPackage* argpkg);
 
+// The internal implementation of spawn. Create a process running the program in
+// argpkg on virtual console vcNumber (already referred for it), without copying
+// anything of the current process. Return the first thread TID of the new
+// process, or -1 on failure. argpkg is still owned by the caller
+int spawnProcess(tcb* currentThread, ArgPackage* argpkg, int vcNumber);
+
+// The internal implementation of vfork. The same as forkProcess, but the child
+// borrows the parent's address space, and the parent is blocked until the
+// child execs or dies
+int vforkProcess(tcb* currentThread);
+
+// Give the borrowed address space back to the parent of a vfork() child, and
+// let the parent run. Do nothing if proc is not a vfork() child
+void resumeVforkParent(pcb* proc);
+
 // Terminate thread. This function never returns
 void terminateThread(tcb* currentThread);
 
@@ -13,10 +13,13 @@
 /* vIDT slots match regular x86-32 numbers from x86/idt.h, plus these */
 #define HV_TICKBACK 0x20 /**< vIDT slot for virtual timer interrupt */
 #define HV_KEYBOARD 0x21 /**< vIDT slot for virtual keyboard interrupt */
+#define HV_EVENT_RING 0x22 /**< vIDT slot for "event ring non-empty" */
 
 #define HV_MAGIC 0xC001C0DE /**< hv_magic() value for v2 of PebPeb API */
 #define HV_SETIDT_PRIVILEGED 1
 #define HV_PRINT_MAX 410
+#define HV_EVENT_RING_SIZE 256 /**< Slots of an event ring, a power of 2 */
+#define HV_VCPU_ALL (-1) /**< hv_route_interrupt() target for every vCPU */
 
 #define GUEST_LAUNCH_EAX 0x15410DE0U /**< Value for %EAX at guest launch */
 #define GUEST_CRASH_STATUS 0xDEADC0DE /**< For simulated hv_exit() */
@@ -29,6 +32,26 @@
 #define NORETURN __attribute__((__noreturn__))
 #endif
 
+/** @brief One event in an event ring, for the virtual interrupt it replaces */
+typedef struct {
+  int irqno;  /**< vIDT slot, e.g. HV_TICKBACK or HV_KEYBOARD */
+  int code;   /**< Augmented char for HV_KEYBOARD, 0 otherwise */
+  int cr2;    /**< Always 0 */
+} hv_event_t;
+
+/** @brief Event ring shared by hypervisor and guest (see hv_event_ring())
+ *
+ *  The i-th event is in events[i % HV_EVENT_RING_SIZE]. The guest consumes
+ *  events in [tail, head) and advances tail after each of them, then reads
+ *  head again before leaving its HV_EVENT_RING handler.
+ */
+typedef struct {
+  volatile unsigned int head;     /**< Written by hypervisor only */
+  volatile unsigned int tail;     /**< Written by guest only */
+  volatile unsigned int dropped;  /**< Events lost on a full ring */
+  hv_event_t events[HV_EVENT_RING_SIZE];
+} hv_event_ring_t;
+
 /** @brief verify we are running under a v2 PebPeb hypervisor
  *  @return HV_MAGIC
  */
@@ -126,6 +149,40 @@ void hv_cons_get_cursor_pos(int *rowp, int *colp);
  */
 void hv_print_at(int len, unsigned char *buf, int row, int col, int color);
 
+/** @brief Deliver virtual interrupts by an event ring (extension)
+ *  @param  ring Base of an hv_event_ring_t, or NULL to go back to one
+ *               virtual interrupt per event
+ *  @return 0 on success, negative if ring is not a page of guest memory
+ *  @pre    ring must be page-aligned
+ *  @note   Virtual interrupts (not virtual exceptions) are appended to the
+ *          ring instead, and HV_EVENT_RING is raised only when the ring
+ *          becomes non-empty, so one handler drains many of them
+ *  @note   ring address is guest-physical, and the ring is reset on success
+ */
+int hv_event_ring(void *ring);
+
+/** @brief Start one more virtual CPU in the guest (extension)
+ *  @param  eip  Where the new vCPU starts, in guest-kernel mode
+ *  @param  esp  Initial %esp of the new vCPU
+ *  @return id of the new vCPU (the boot one is 0) on success, also passed to
+ *          it in %eax; negative if no more vCPU can be started
+ *  @note   The new vCPU starts with paging off, interrupts disabled and an
+ *          empty vIDT: hv_setpd(), hv_adjustpg(), hv_setidt() and interrupt
+ *          flag are per-vCPU, so a changed mapping is adjusted on each vCPU
+ *  @note   hv_exit() on any vCPU ends the whole guest
+ *  @note   eip, esp addresses are guest-physical
+ */
+int hv_start_vcpu(void *eip, void *esp);
+
+/** @brief Choose the vCPU(s) a virtual interrupt is delivered to (extension)
+ *  @param  irqno IDT slot index
+ *  @param  vcpu  Id of the vCPU, or HV_VCPU_ALL for every one of them
+ *  @return 0 on success, negative if irqno or vcpu is invalid
+ *  @note   All virtual interrupts go to vCPU 0 when guest kernel launches.
+ *          Virtual exceptions always go to the vCPU that causes them
+ */
+int hv_route_interrupt(int irqno, int vcpu);
+
 #endif /* ASSEMBLER */
 
 #endif /* _HVCALL_H */
@@ -46,4 +46,9 @@
 #define HV_RESERVED_7        0x27
 #define HV_RESERVED_END      0x27
 
+/* Extensions living in the reserved range */
+#define HV_EVENT_RING_OP     HV_RESERVED_0
+#define HV_START_VCPU_OP     HV_RESERVED_1
+#define HV_ROUTE_INT_OP      HV_RESERVED_2
+
 #endif /* _HVCALL_INT_H */
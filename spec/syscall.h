@@ -87,6 +87,10 @@ int swexn(void *esp3, swexn_handler_t eip, void *arg, ureg_t *newureg);
 /* Project 4 F2017 */
 int new_console(void); 
 
+/* Extensions: process creation without copying the caller */
+int spawn(char *execname, char *argvec[], int console);
+int vfork(void);
+
 /* Previous API */
 /*
 void exit(int status) NORETURN;
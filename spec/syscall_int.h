@@ -66,4 +66,8 @@
 #define SYSCALL_RESERVED_15       0x8F
 #define SYSCALL_RESERVED_END      0x8F
 
+/* Extensions living in the reserved range */
+#define SPAWN_INT           SYSCALL_RESERVED_0
+#define VFORK_INT           SYSCALL_RESERVED_1
+
 #endif /* _SYSCALL_INT_H */
@@ -0,0 +1,23 @@
+/** @file fast_syscall.h
+ *
+ *  @brief Syscalls entering kernel by SYSENTER instead of INT
+ *
+ *  They behave exactly the same as the ones in syscall.h, but skip the IDT
+ *  and the interrupt frame, so they are much cheaper. Only the syscalls that
+ *  are hot in thread libraries are provided. Not for guests under hypervisor:
+ *  a guest calling them is crashed.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#ifndef FAST_SYSCALL_H
+#define FAST_SYSCALL_H
+
+int fast_gettid(void);
+int fast_yield(int pid);
+int fast_deschedule(int *flag);
+int fast_make_runnable(int pid);
+int fast_sleep(int ticks);
+unsigned int fast_get_ticks(void);
+
+#endif
@@ -0,0 +1,31 @@
+/** @file latency_bench.h
+ *
+ *  @brief Latency measurement shared by the syscall microbenchmarks
+ *
+ *  @author Leiyu Zhao
+ */
+
+#ifndef LATENCY_BENCH_H
+#define LATENCY_BENCH_H
+
+#include <syscall.h>
+
+// One timer tick is 10ms
+#define NS_PER_TICK 10000000
+
+// Return the average latency in ns of calling fn for iterations times
+static inline unsigned int measureLatency(int (*fn)(void), int iterations) {
+  unsigned int start = get_ticks();
+  for (int i = 0; i < iterations; i++) {
+    fn();
+  }
+  unsigned long long elapsed = get_ticks() - start;
+  return (unsigned int)(elapsed * NS_PER_TICK / iterations);
+}
+
+// yield(-1) in the shape measureLatency() takes
+static inline int yieldAny(void) {
+  return yield(-1);
+}
+
+#endif
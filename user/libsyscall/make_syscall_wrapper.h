@@ -40,3 +40,33 @@
         int     $intNumber;                             \
                                                         \
         ret;
+
+// Fast version of MAKE_WRAPPER_SINGLEPARAM by SYSENTER (see fast_syscall.h)
+// Syscall number goes to %eax, and SYSEXIT brings us back to %edx with stack
+// %ecx, so both of them are clobbered
+#define MAKE_FAST_WRAPPER_SINGLEPARAM(globalName, intNumber) \
+    .globl globalName;                                  \
+    globalName:                                         \
+        pushl   %esi;                                   \
+        mov     8(%esp), %esi;                          \
+        mov     $intNumber, %eax;                       \
+        mov     %esp, %ecx;                             \
+        mov     $1f, %edx;                              \
+                                                        \
+        sysenter;                                       \
+                                                        \
+    1:  popl    %esi;                                   \
+                                                        \
+        ret;
+
+// Fast version of MAKE_WRAPPER_NOPARAM by SYSENTER
+#define MAKE_FAST_WRAPPER_NOPARAM(globalName, intNumber) \
+    .globl globalName;                                  \
+    globalName:                                         \
+        mov     $intNumber, %eax;                       \
+        mov     %esp, %ecx;                             \
+        mov     $1f, %edx;                              \
+                                                        \
+        sysenter;                                       \
+                                                        \
+    1:  ret;
@@ -0,0 +1,87 @@
+/** @file large_pages_test.c
+ *
+ *  @brief Test new_pages() on 4MiB aligned regions, which may be backed by
+ *  large pages.
+ *
+ *  The region must come zeroed, survive fork() (parent and child each keep
+ *  their own copy), and be released by remove_pages() so that it can be
+ *  allocated again.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <simics.h>
+
+#define LARGE_PAGE_SIZE (PAGE_SIZE * 1024)
+#define REGION_BASE ((char*)0x40000000)
+#define REGION_LEN (2 * LARGE_PAGE_SIZE)
+
+// Return 0 if the region equals to value, sampled every half page
+static int checkRegion(char value) {
+  for (int i = 0; i < REGION_LEN; i += PAGE_SIZE / 2) {
+    if (REGION_BASE[i] != value) return -1;
+  }
+  return 0;
+}
+
+static void fillRegion(char value) {
+  for (int i = 0; i < REGION_LEN; i += PAGE_SIZE / 2) {
+    REGION_BASE[i] = value;
+  }
+}
+
+int main() {
+  if (new_pages(REGION_BASE, REGION_LEN) < 0) {
+    printf("large_pages_test: new_pages failed\n");
+    return -1;
+  }
+  if (checkRegion(0) < 0) {
+    printf("large_pages_test: new region is not zeroed\n");
+    return -1;
+  }
+  fillRegion('p');
+
+  int pid = fork();
+  if (pid < 0) {
+    printf("large_pages_test: fork failed\n");
+    return -1;
+  }
+  if (pid == 0) {
+    if (checkRegion('p') < 0) exit(-1);
+    fillRegion('c');
+    if (checkRegion('c') < 0) exit(-1);
+    exit(0);
+  }
+
+  int status;
+  if (wait(&status) != pid || status != 0) {
+    printf("large_pages_test: child sees wrong content\n");
+    return -1;
+  }
+  if (checkRegion('p') < 0) {
+    printf("large_pages_test: parent's copy is changed by child\n");
+    return -1;
+  }
+
+  // Only the head of the region can be removed
+  if (remove_pages(REGION_BASE + LARGE_PAGE_SIZE) == 0) {
+    printf("large_pages_test: remove_pages accepts the middle of region\n");
+    return -1;
+  }
+  if (remove_pages(REGION_BASE) < 0) {
+    printf("large_pages_test: remove_pages failed\n");
+    return -1;
+  }
+  if (new_pages(REGION_BASE, REGION_LEN) < 0 || checkRegion(0) < 0) {
+    printf("large_pages_test: cannot reuse the region\n");
+    return -1;
+  }
+  remove_pages(REGION_BASE);
+
+  printf("large_pages_test: success\n");
+  lprintf("large_pages_test: success");
+  return 0;
+}
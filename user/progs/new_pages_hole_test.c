@@ -0,0 +1,58 @@
+/** @file new_pages_hole_test.c
+ *
+ *  @brief Test new_pages() with a NULL base, which finds a free range itself.
+ *
+ *  The range returned must be page aligned, not overlap any existing memory,
+ *  and be found again once it's removed, as the lowest hole is taken.
+ *  What's inside the range is checked by large_pages_test and the others.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <simics.h>
+
+#define REGION_LEN (16 * PAGE_SIZE)
+
+static int global = 1;
+
+// Return 0 if [a, a + REGION_LEN) and [b, b + REGION_LEN) don't overlap
+static int checkDisjoint(char* a, char* b) {
+  return (a + REGION_LEN <= b || b + REGION_LEN <= a) ? 0 : -1;
+}
+
+int main() {
+  char* base = (char*)new_pages(NULL, REGION_LEN);
+  if (base == (char*)-1 || ((unsigned int)base & (PAGE_SIZE - 1)) != 0) {
+    printf("new_pages_hole_test: no aligned range is found\n");
+    return -1;
+  }
+  // Must not overlap anything we have
+  if (new_pages(base, PAGE_SIZE) == 0 ||
+      new_pages((void*)((unsigned int)&global & ~(PAGE_SIZE - 1)),
+          PAGE_SIZE) == 0) {
+    printf("new_pages_hole_test: overlapping ranges are accepted\n");
+    return -1;
+  }
+  char* next = (char*)new_pages(NULL, REGION_LEN);
+  if (next == (char*)-1 || checkDisjoint(base, next) < 0) {
+    printf("new_pages_hole_test: ranges found overlap\n");
+    return -1;
+  }
+  base[0] = next[0] = 'p';
+
+  // The hole left is the lowest one, so it's found again
+  if (remove_pages(base) < 0 ||
+      (char*)new_pages(NULL, REGION_LEN) != base) {
+    printf("new_pages_hole_test: cannot reuse the range\n");
+    return -1;
+  }
+  remove_pages(base);
+  remove_pages(next);
+
+  printf("new_pages_hole_test: success\n");
+  lprintf("new_pages_hole_test: success");
+  return 0;
+}
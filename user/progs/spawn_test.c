@@ -0,0 +1,76 @@
+/** @file spawn_test.c
+ *
+ *  @brief Test spawn() and vfork()
+ *
+ *  spawn() must run the program with the given arguments and report a wrong
+ *  program name by itself. A vfork() child must run on the parent's memory
+ *  while the parent is blocked, and hand it back on exec or vanish.
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include <simics.h>
+
+#define CHILD_STATUS 42
+
+static volatile int shared;
+
+// Return 0 if a child pid finishes with status
+static int expectChild(int pid, int status) {
+  int childStatus;
+  if (pid < 0 || wait(&childStatus) != pid) return -1;
+  return childStatus == status ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
+  // Spawned as a child: say the status given
+  if (argc == 3 && strcmp(argv[1], "child") == 0) {
+    return atoi(argv[2]);
+  }
+
+  char status[16];
+  sprintf(status, "%d", CHILD_STATUS);
+  char* childArgv[] = {"spawn_test", "child", status, NULL};
+
+  if (expectChild(spawn("spawn_test", childArgv, -1), CHILD_STATUS) < 0) {
+    printf("spawn_test: spawned child fails\n");
+    return -1;
+  }
+  char* wrongArgv[] = {"no_such_program", NULL};
+  if (spawn("no_such_program", wrongArgv, -1) >= 0) {
+    printf("spawn_test: spawn accepts a wrong program\n");
+    return -1;
+  }
+
+  // The child writes my memory before I go on
+  shared = 0;
+  int pid = vfork();
+  if (pid == 0) {
+    shared = 1;
+    set_status(CHILD_STATUS);
+    vanish();
+  }
+  if (expectChild(pid, CHILD_STATUS) < 0 || shared != 1) {
+    printf("spawn_test: vfork child does not share memory\n");
+    return -1;
+  }
+
+  pid = vfork();
+  if (pid == 0) {
+    exec("spawn_test", childArgv);
+    set_status(-1);
+    vanish();
+  }
+  if (expectChild(pid, CHILD_STATUS) < 0) {
+    printf("spawn_test: vfork child fails to exec\n");
+    return -1;
+  }
+
+  printf("spawn_test: success\n");
+  lprintf("spawn_test: success");
+  return 0;
+}
@@ -0,0 +1,69 @@
+/** @file syscall_bench.c
+ *
+ *  @brief Microbenchmark for syscall round trip: INT against SYSENTER
+ *
+ *  Both paths go to the same kernel functions, so the difference is just the
+ *  cost of entering and leaving kernel. Results of both paths are also
+ *  compared to make sure they agree, and SYSENTER is tried with TF set, which
+ *  must not bring the kernel down.
+ *
+ *  Usage: syscall_bench [iterations]
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <simics.h>
+#include <fast_syscall.h>
+#include <syscall_int.h>
+#include <latency_bench.h>
+
+#define DEFAULT_ITERATIONS 1000000
+
+// fast_gettid() entered with TF set. SYSENTER keeps TF, so the kernel gets a
+// single step trap on its first instruction; it should clear TF and return
+// here without any trap
+static int singleStepFastGettid(void) {
+  int tid;
+  asm volatile("movl %%esp, %%ecx\n\t"
+               "movl $1f, %%edx\n\t"
+               "pushfl\n\t"
+               "orl $0x100, (%%esp)\n\t"
+               "popfl\n\t"
+               "sysenter\n"
+               "1:"
+               : "=a"(tid)
+               : "a"(GETTID_INT)
+               : "ecx", "edx", "cc", "memory");
+  return tid;
+}
+
+static int fastYieldAny(void) {
+  return fast_yield(-1);
+}
+
+int main(int argc, char** argv) {
+  int iterations = DEFAULT_ITERATIONS;
+  if (argc > 1) iterations = atoi(argv[1]);
+  if (iterations <= 0) {
+    printf("usage: syscall_bench [iterations]\n");
+    return -1;
+  }
+
+  if (fast_gettid() != gettid() || fast_yield(-1) != 0 ||
+      fast_make_runnable(gettid()) >= 0 ||
+      singleStepFastGettid() != gettid()) {
+    printf("syscall_bench: fast syscall returns wrong result\n");
+    return -1;
+  }
+
+  printf("%10s %14s %14s\n", "syscall", "int(ns)", "sysenter(ns)");
+  printf("%10s %14u %14u\n", "gettid", measureLatency(gettid, iterations),
+      measureLatency(fast_gettid, iterations));
+  printf("%10s %14u %14u\n", "yield", measureLatency(yieldAny, iterations),
+      measureLatency(fastYieldAny, iterations));
+  lprintf("syscall_bench: success");
+  return 0;
+}
@@ -0,0 +1,92 @@
+/** @file tid_lookup_bench.c
+ *
+ *  @brief Microbenchmark for gettid()/yield() latency against thread count
+ *
+ *  Every syscall looks up the caller's TCB by tid, so their latency should not
+ *  grow with the number of threads alive in the system. This program parks
+ *  more and more blocked threads, and measures the average latency of
+ *  gettid() and yield(-1) at each step.
+ *
+ *  Usage: tid_lookup_bench [max_threads]
+ *
+ *  @author Leiyu Zhao
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <simics.h>
+#include <thread.h>
+#include <latency_bench.h>
+
+#define STACK_SIZE 1024
+#define DEFAULT_MAX_THREADS 1024
+#define ITERATIONS 100000
+
+static volatile int stop = 0;
+static int* kernelTIDs;
+
+// Park here (blocked) until main thread wakes everyone up
+static void* parkedThread(void* arg) {
+  kernelTIDs[(int)arg] = gettid();
+  while (!stop) {
+    deschedule((int*)&stop);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  int maxThreads = DEFAULT_MAX_THREADS;
+  if (argc > 1) maxThreads = atoi(argv[1]);
+  if (maxThreads <= 0) {
+    printf("usage: tid_lookup_bench [max_threads]\n");
+    return -1;
+  }
+
+  thr_init(STACK_SIZE);
+  int* tids = malloc(sizeof(int) * maxThreads);
+  kernelTIDs = malloc(sizeof(int) * maxThreads);
+  if (!tids || !kernelTIDs) {
+    printf("no memory\n");
+    return -1;
+  }
+
+  printf("%8s %14s %14s\n", "threads", "gettid(ns)", "yield(ns)");
+  int created = 0;
+  for (int target = 1; ; target *= 2) {
+    if (target > maxThreads) target = maxThreads;
+    while (created < target) {
+      kernelTIDs[created] = -1;
+      tids[created] = thr_create(parkedThread, (void*)created);
+      if (tids[created] < 0) {
+        printf("fail to create thread #%d\n", created);
+        target = maxThreads = created;
+        break;
+      }
+      created++;
+    }
+    // wait for all of them to be parked
+    for (int i = 0; i < created; i++) {
+      while (kernelTIDs[i] < 0) yield(-1);
+    }
+
+    printf("%8d %14u %14u\n", created, measureLatency(gettid, ITERATIONS),
+        measureLatency(yieldAny, ITERATIONS));
+    if (target == maxThreads) break;
+  }
+
+  // deschedule() rejects to block once stop is set, so a failing
+  // make_runnable() only means that thread is already on its way out
+  stop = 1;
+  for (int i = 0; i < created; i++) {
+    make_runnable(kernelTIDs[i]);
+  }
+  for (int i = 0; i < created; i++) {
+    thr_join(tids[i], NULL);
+  }
+
+  free(tids);
+  free(kernelTIDs);
+  thr_exit(0);
+  return 0;
+}